@@ -0,0 +1,210 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "admit_queue.h"
+#include "slab.h"
+
+/* Completion queue for `scheduler_try_admit`. Vehicles that could not enter straight away get a
+ * ticket, and once the scheduler admits them their tickets are appended here from inside the
+ * admission callback. The queue owns a file descriptor that is readable exactly while completed
+ * tickets are waiting, so an event loop can wait on it with poll or epoll alongside its other
+ * descriptors. It is an eventfd on Linux and a pipe elsewhere. */
+
+struct PendingTicket {
+    struct AdmitTicket ticket;
+    AdmitQueue *queue;
+    struct PendingTicket *next;
+};
+
+struct AdmitQueue {
+    pthread_mutex_t lock;
+    struct PendingTicket *head;
+    struct PendingTicket *tail;
+    atomic_ulong next_ticket;
+    int read_fd;
+    int write_fd;
+};
+
+static struct Slab ticket_slab = SLAB_INITIALIZER(struct PendingTicket);
+
+/** @brief  Creates an empty admission completion queue.
+ *
+ *  @return Pointer to the created queue.
+ */
+AdmitQueue *admit_queue_create(void) {
+    AdmitQueue *queue = calloc(1, sizeof *queue);
+    if (queue == NULL) {
+        perror("admit_queue_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    atomic_init(&queue->next_ticket, 1);
+#ifdef __linux__
+    queue->read_fd = queue->write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->read_fd < 0) {
+        perror("admit_queue_create: eventfd");
+        exit(EXIT_FAILURE);
+    }
+#else
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("admit_queue_create: pipe");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    queue->read_fd = fds[0];
+    queue->write_fd = fds[1];
+#endif
+    return queue;
+}
+
+/** @brief  Frees the given queue and any completed tickets it still holds.
+ *
+ *  Must not be called while vehicles admitted through it are still waiting.
+ *
+ *  @param  queue   The queue to destroy.
+ */
+void admit_queue_destroy(AdmitQueue *queue) {
+    struct PendingTicket *pending = queue->head;
+    while (pending != NULL) {
+        struct PendingTicket *next = pending->next;
+        slab_free(&ticket_slab, pending);
+        pending = next;
+    }
+    close(queue->read_fd);
+    if (queue->write_fd != queue->read_fd) {
+        close(queue->write_fd);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+/** @brief  Returns the descriptor that is readable while completed tickets are waiting.
+ *
+ *  Only wait on it; `admit_queue_poll` takes care of reading it.
+ *
+ *  @param  queue   The queue.
+ *  @return The file descriptor.
+ */
+int admit_queue_fd(AdmitQueue *queue) {
+    return queue->read_fd;
+}
+
+/** @brief  Makes the queue's descriptor readable, with its lock held. */
+static void signal_fd(AdmitQueue *queue) {
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+    if (write(queue->write_fd, &one, sizeof one) < 0) {
+        perror("admit_queue: write");
+    }
+}
+
+/** @brief  Drains the queue's descriptor, with its lock held. */
+static void clear_fd(AdmitQueue *queue) {
+    char buf[64];
+    while (read(queue->read_fd, buf, sizeof buf) > 0) {
+    }
+}
+
+/** @brief  Takes completed tickets off the queue without blocking.
+ *
+ *  @param  queue       The queue.
+ *  @param  tickets     Where to store the completed tickets, in completion order.
+ *  @param  max_tickets The most tickets to take.
+ *  @return The number of tickets taken, 0 if none has completed.
+ */
+int admit_queue_poll(AdmitQueue *queue, struct AdmitTicket *tickets, int max_tickets) {
+    int count = 0;
+    pthread_mutex_lock(&queue->lock);
+    while (count < max_tickets && queue->head != NULL) {
+        struct PendingTicket *pending = queue->head;
+        tickets[count++] = pending->ticket;
+        if ((queue->head = pending->next) == NULL) {
+            queue->tail = NULL;
+        }
+        slab_free(&ticket_slab, pending);
+    }
+    if (queue->head == NULL && count > 0) {
+        clear_fd(queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+/** @brief  Admission callback that completes a ticket, or frees it if the vehicle was cancelled. */
+static void on_admitted(struct Vehicle *vehicle, struct Tunnel *tunnel, void *arg) {
+    (void)vehicle;
+    struct PendingTicket *pending = arg;
+    if (tunnel == NULL) {
+        slab_free(&ticket_slab, pending);
+        return;
+    }
+    AdmitQueue *queue = pending->queue;
+    pending->ticket.tunnel = tunnel;
+    pending->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail != NULL) {
+        queue->tail->next = pending;
+    } else {
+        queue->head = pending;
+        signal_fd(queue);
+    }
+    queue->tail = pending;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Admits a vehicle if it can enter a tunnel right now, or hands out a ticket otherwise.
+ *
+ * Follows the same rules and logs the same events as `scheduler_admit`, but never blocks. A
+ * vehicle that has to wait keeps its place in line, and once it has been admitted a ticket with
+ * the same id and its tunnel shows up in `queue`. Either way the vehicle must later leave through
+ * `scheduler_exit`. A waiting vehicle may be withdrawn with `scheduler_cancel`, which frees its
+ * ticket, and the ticket never completes.
+ *
+ * A vehicle `scheduler_admit` would not admit at all, because the scheduler has no tunnels or the
+ * vehicle's priority is not below `scheduler_num_priorities`, gets neither a tunnel nor a ticket.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle to admit.
+ * @param queue The queue the ticket completes on.
+ * @param ticket Set to the id of the ticket, or to 0 if the vehicle was admitted straight away or
+ *               rejected.
+ * @return The tunnel the vehicle was admitted into, or NULL if it was given a ticket or, with
+ *         `ticket` set to 0, rejected.
+ */
+struct Tunnel *scheduler_try_admit(PriorityScheduler *scheduler, struct Vehicle *vehicle, AdmitQueue *queue,
+                                   unsigned long *ticket) {
+    *ticket = 0;
+    if (scheduler_num_tunnels(scheduler) == 0 || vehicle->priority < 0
+        || vehicle->priority >= scheduler_num_priorities(scheduler)) {
+        return NULL;
+    }
+    struct PendingTicket *pending = slab_alloc(&ticket_slab);
+    pending->ticket = (struct AdmitTicket){
+        .id = atomic_fetch_add(&queue->next_ticket, 1),
+        .vehicle = vehicle,
+    };
+    pending->queue = queue;
+    // The ticket may complete before this returns, so its id is read beforehand
+    *ticket = pending->ticket.id;
+    struct Tunnel *tunnel;
+    if (scheduler_admit_async(scheduler, vehicle, on_admitted, pending, &tunnel) != ADMIT_QUEUED) {
+        slab_free(&ticket_slab, pending);
+        *ticket = 0;
+    }
+    return tunnel;
+}
@@ -0,0 +1,25 @@
+#ifndef ADMIT_QUEUE_H
+#define ADMIT_QUEUE_H
+
+#include "priority_scheduler.h"
+#include "tunnel.h"
+#include "vehicle.h"
+
+typedef struct AdmitQueue AdmitQueue;
+
+struct AdmitTicket {
+    unsigned long id;
+    struct Vehicle *vehicle;
+    struct Tunnel *tunnel;
+};
+
+AdmitQueue     *admit_queue_create(void);
+void            admit_queue_destroy(AdmitQueue *queue);
+
+int             admit_queue_fd(AdmitQueue *queue);
+int             admit_queue_poll(AdmitQueue *queue, struct AdmitTicket *tickets, int max_tickets);
+
+struct Tunnel  *scheduler_try_admit(PriorityScheduler *scheduler, struct Vehicle *vehicle, AdmitQueue *queue,
+                                    unsigned long *ticket);
+
+#endif
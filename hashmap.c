@@ -4,26 +4,45 @@
 #include "vehicle.h"
 #include "hashmap.h"
 
-#define DEFAULT_CAPACITY 64
+#define MIN_CAPACITY 64
 
-struct Node {
+/* Open addressing with linear probing over a power-of-two table. Keys are compared by vehicle id.
+ * The table doubles when it is three quarters full and halves when it drops below one eighth, and
+ * removal shifts later entries of the probe run back so no tombstones are needed. */
+
+struct Entry {
     struct Vehicle *key;
     struct Tunnel *value;
-    struct Node *next;
+    int id;
 };
 
 struct HashMap {
     size_t (*hash_func)(const struct Vehicle *key);
-    struct Node **buckets;
+    struct Entry *entries;
     size_t size;
     size_t capacity;
 };
 
-/** @brief  Creates and returns a pointer to a hashmap with the given capacity.
+/** @brief  Allocates an empty table with the given capacity.
+ *
+ *  @param  capacity    The number of entries, a power of two.
+ *  @return Pointer to the table.
+ */
+static struct Entry *entries_create(size_t capacity) {
+    struct Entry *entries = calloc(capacity, sizeof *entries);
+    if (entries == NULL) {
+        perror("hashmap");
+        exit(EXIT_FAILURE);
+    }
+    return entries;
+}
+
+/** @brief  Creates and returns a pointer to an empty hashmap.
  *
  *  You should call `hashmap_destroy` to free the memory allocated to the hashmap.
  *
- *  @param  hash_func   Function pointer for the hash function to be used in the map.
+ *  @param  hash_func   Function pointer for the hash function to be used in the map. It must only
+ *                      depend on the vehicle's id.
  *  @return Pointer to the created hashmap.
  */
 HashMap *hashmap_create(size_t (*hash_func)(const struct Vehicle *key)) {
@@ -32,14 +51,9 @@ HashMap *hashmap_create(size_t (*hash_func)(const struct Vehicle *key)) {
         perror("hashmap_create");
         exit(EXIT_FAILURE);
     }
-    map->buckets = calloc(DEFAULT_CAPACITY, sizeof *map->buckets);
-    if (map->buckets == NULL) {
-        perror("hashmap_create");
-        free(map);
-        exit(EXIT_FAILURE);
-    }
+    map->entries = entries_create(MIN_CAPACITY);
     map->hash_func = hash_func;
-    map->capacity = DEFAULT_CAPACITY;
+    map->capacity = MIN_CAPACITY;
     map->size = 0;
     return map;
 }
@@ -50,54 +64,62 @@ HashMap *hashmap_create(size_t (*hash_func)(const struct Vehicle *key)) {
  *  @return Void.
  */
 void hashmap_destroy(HashMap *map) {
-    for (size_t i = 0; i < map->capacity; i++) {
-        struct Node *node = map->buckets[i];
-        while (node != NULL) {
-            struct Node *tmp = node;
-            node = node->next;
-            free(tmp);
-        }
-    }
-    free(map->buckets);
+    free(map->entries);
     free(map);
 }
 
-/** @brief  Creates and returns a node to hold the given key and value.
- *  
- *  @param  key     The vehicle with which the given tunnel is associated.
- *  @param  value   The tunnel associated with the given key.
- *  @return Pointer to the created node.
+/** @brief  Returns the index of the entry for the given key, or of the empty entry ending its probe run.
+ *
+ *  @param  map The hashmap.
+ *  @param  key The key to look for.
+ *  @return Index of the entry holding the key, or of the empty entry where it would go.
  */
-static struct Node *create_node(struct Vehicle *key, struct Tunnel *value) {
-    struct Node *node = malloc(sizeof *node);
-    if (node == NULL) {
-        perror("hashmap: create_node");
-        exit(EXIT_FAILURE);
+static size_t find_slot(const HashMap *map, const struct Vehicle *key) {
+    size_t mask = map->capacity - 1;
+    size_t index = map->hash_func(key) & mask;
+    while (map->entries[index].key != NULL && map->entries[index].id != key->id) {
+        index = (index + 1) & mask;
     }
-    *node = (struct Node){ .key = key, .value = value, .next = NULL };
-    return node;
+    return index;
+}
+
+/** @brief  Moves every entry of the given hashmap into a new table of the given capacity.
+ *
+ *  @param  map         The hashmap.
+ *  @param  capacity    The new capacity, a power of two larger than the size.
+ *  @return Void.
+ */
+static void resize(HashMap *map, size_t capacity) {
+    struct Entry *old_entries = map->entries;
+    size_t old_capacity = map->capacity;
+    map->entries = entries_create(capacity);
+    map->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].key != NULL) {
+            map->entries[find_slot(map, old_entries[i].key)] = old_entries[i];
+        }
+    }
+    free(old_entries);
 }
 
 /** @brief  Puts the key value pair into the given hashmap.
- *  
+ *
  *  @param  map     The hashmap to put into.
  *  @param  key     The vehicle with which the given tunnel is to be associated.
  *  @param  value   The tunnel to be associated with the given key.
- *  @return Void. 
+ *  @return Void.
  */
 void hashmap_put(HashMap *map, struct Vehicle *key, struct Tunnel *value) {
-    size_t index = map->hash_func(key) % map->capacity;
-    struct Node *node = map->buckets[index];
-    while (node != NULL) {
-        if (key == node->key) {
-            node->value = value;
-            return;
-        }
-        node = node->next;
+    size_t index = find_slot(map, key);
+    if (map->entries[index].key != NULL) {
+        map->entries[index].value = value;
+        return;
     }
-    struct Node *new_node = create_node(key, value);
-    new_node->next = map->buckets[index];
-    map->buckets[index] = new_node;
+    if (4 * (map->size + 1) > 3 * map->capacity) {
+        resize(map, 2 * map->capacity);
+        index = find_slot(map, key);
+    }
+    map->entries[index] = (struct Entry){ .key = key, .value = value, .id = key->id };
     map->size++;
 }
 
@@ -108,15 +130,8 @@ void hashmap_put(HashMap *map, struct Vehicle *key, struct Tunnel *value) {
  *  @return The tunnel associated to the given vehicle, or NULL if there is no mapping for the given key.
  */
 struct Tunnel *hashmap_get(HashMap *map, struct Vehicle *key) {
-    size_t index = map->hash_func(key) % map->capacity;
-    struct Node *node = map->buckets[index];
-    while (node != NULL) {
-        if (key == node->key) {
-            return node->value;
-        }
-        node = node->next;
-    }
-    return NULL;
+    struct Entry *entry = &map->entries[find_slot(map, key)];
+    return entry->key != NULL ? entry->value : NULL;
 }
 
 /** @brief  Retrieves and removes the tunnel associated with the given vehicles.
@@ -126,23 +141,27 @@ struct Tunnel *hashmap_get(HashMap *map, struct Vehicle *key) {
  *  @return The tunnel associated to the given vehicle, or NULL if there was no mapping for the given key.
  */
 struct Tunnel *hashmap_remove(HashMap *map, struct Vehicle *key) {
-    size_t index = map->hash_func(key) % map->capacity;
-    struct Node *node = map->buckets[index];
-    struct Node *prev = NULL;
-    while (node != NULL) {
-        if (key == node->key) {
-            struct Tunnel *tunnel = node->value;
-            if (prev != NULL) {
-                prev->next = node->next;
-            } else {
-                map->buckets[index] = node->next;
-            }
-            free(node);
-            map->size--;
-            return tunnel;
+    size_t mask = map->capacity - 1;
+    size_t index = find_slot(map, key);
+    if (map->entries[index].key == NULL) {
+        return NULL;
+    }
+    struct Tunnel *tunnel = map->entries[index].value;
+
+    // Shift back later entries of the probe run that would no longer be reachable
+    size_t hole = index;
+    for (size_t next = (hole + 1) & mask; map->entries[next].key != NULL; next = (next + 1) & mask) {
+        size_t home = map->hash_func(map->entries[next].key) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            map->entries[hole] = map->entries[next];
+            hole = next;
         }
-        prev = node;
-        node = node->next;
     }
-    return NULL;
+    map->entries[hole] = (struct Entry){ 0 };
+    map->size--;
+
+    if (map->capacity > MIN_CAPACITY && 8 * map->size < map->capacity) {
+        resize(map, map->capacity / 2);
+    }
+    return tunnel;
 }
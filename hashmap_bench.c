@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hashmap.h"
+#include "tunnel.h"
+#include "vehicle.h"
+
+/* Compares the open-addressing HashMap against the fixed 64-bucket chained map it replaced, for
+ * the put/get/remove pattern the scheduler uses: every vehicle is put on entry, looked up, and
+ * removed on exit.
+ *
+ * Build: make hashmap_bench
+ * Usage: hashmap_bench [rounds]
+ */
+
+#define CHAINED_CAPACITY 64
+
+struct ChainedNode {
+    struct Vehicle *key;
+    struct Tunnel *value;
+    struct ChainedNode *next;
+};
+
+struct ChainedMap {
+    struct ChainedNode *buckets[CHAINED_CAPACITY];
+};
+
+/* The previous vehicle_hash, which also mixed in direction, speed and priority. */
+static size_t chained_hash(const struct Vehicle *vehicle) {
+    size_t hash = 7;
+    hash = 23 * hash + vehicle->id;
+    hash = 23 * hash + vehicle->direction;
+    hash = 23 * hash + vehicle->speed;
+    hash = 23 * hash + vehicle->priority;
+    return hash;
+}
+
+static void chained_put(struct ChainedMap *map, struct Vehicle *key, struct Tunnel *value) {
+    size_t index = chained_hash(key) % CHAINED_CAPACITY;
+    for (struct ChainedNode *node = map->buckets[index]; node != NULL; node = node->next) {
+        if (node->key == key) {
+            node->value = value;
+            return;
+        }
+    }
+    struct ChainedNode *node = malloc(sizeof *node);
+    if (node == NULL) {
+        perror("hashmap_bench");
+        exit(EXIT_FAILURE);
+    }
+    *node = (struct ChainedNode){ .key = key, .value = value, .next = map->buckets[index] };
+    map->buckets[index] = node;
+}
+
+static struct Tunnel *chained_get(struct ChainedMap *map, struct Vehicle *key) {
+    for (struct ChainedNode *node = map->buckets[chained_hash(key) % CHAINED_CAPACITY]; node != NULL; node = node->next) {
+        if (node->key == key) {
+            return node->value;
+        }
+    }
+    return NULL;
+}
+
+static struct Tunnel *chained_remove(struct ChainedMap *map, struct Vehicle *key) {
+    struct ChainedNode **link = &map->buckets[chained_hash(key) % CHAINED_CAPACITY];
+    for (struct ChainedNode *node = *link; node != NULL; link = &node->next, node = node->next) {
+        if (node->key == key) {
+            struct Tunnel *value = node->value;
+            *link = node->next;
+            free(node);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    static const int sizes[] = { 64, 1000, 10000, 100000 };
+    struct Tunnel tunnel = { .id = 0 };
+    unsigned long checksum = 0;
+    unsigned long expected = 0;
+
+    printf("implementation,keys,ns_per_op\n");
+    for (size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        int n = sizes[s];
+        struct Vehicle *vehicles = malloc(n * sizeof *vehicles);
+        if (vehicles == NULL) {
+            perror("hashmap_bench");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            vehicles[i] = (struct Vehicle){ .id = i + 1, .direction = i % 2, .speed = 4 + 2 * (i % 3 == 0), .priority = i % 5 };
+        }
+
+        struct timespec start, end;
+        HashMap *map = hashmap_create(vehicle_hash);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < n; i++) {
+                hashmap_put(map, &vehicles[i], &tunnel);
+            }
+            for (int i = 0; i < n; i++) {
+                checksum += hashmap_get(map, &vehicles[i]) != NULL;
+            }
+            for (int i = 0; i < n; i++) {
+                checksum += hashmap_remove(map, &vehicles[i]) != NULL;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        hashmap_destroy(map);
+        printf("open_addressing,%d,%.1f\n", n, elapsed_ns(&start, &end) / (3.0 * n * rounds));
+
+        struct ChainedMap chained = { { NULL } };
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < n; i++) {
+                chained_put(&chained, &vehicles[i], &tunnel);
+            }
+            for (int i = 0; i < n; i++) {
+                checksum += chained_get(&chained, &vehicles[i]) != NULL;
+            }
+            for (int i = 0; i < n; i++) {
+                checksum += chained_remove(&chained, &vehicles[i]) != NULL;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("chained_64,%d,%.1f\n", n, elapsed_ns(&start, &end) / (3.0 * n * rounds));
+
+        expected += 4UL * n * rounds;
+        free(vehicles);
+    }
+    if (checksum != expected) {
+        fprintf(stderr, "hashmap_bench: lookups failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#include <stdatomic.h>
+#include "histogram.h"
+
+#define SUB_BUCKETS (1UL << HISTOGRAM_SUB_BITS)
+
+/** @brief  Returns the index of the bucket the given value is counted in. */
+static int bucket_index(unsigned long value) {
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzl(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((value >> shift) - SUB_BUCKETS);
+}
+
+/** @brief  Returns the smallest value counted in the given bucket. */
+static unsigned long bucket_lowest(int index) {
+    if (index < (int)SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    return (SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+}
+
+/** @brief  Returns the largest value counted in the given bucket. */
+static unsigned long bucket_highest(int index) {
+    return index + 1 < HISTOGRAM_BUCKETS ? bucket_lowest(index + 1) - 1 : ~0UL;
+}
+
+/** @brief  Counts a value in the given histogram.
+ *
+ *  Lock-free and safe to call from any number of threads, including while the histogram is being
+ *  summarized.
+ *
+ *  @param  histogram   The histogram.
+ *  @param  value       The value to count.
+ *  @return Void.
+ */
+void histogram_record(struct Histogram *histogram, unsigned long value) {
+    atomic_fetch_add_explicit(&histogram->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+/** @brief  Adds the counts of one histogram to another.
+ *
+ *  Reads `histogram` like `histogram_summarize` does. Nothing else may use `total` meanwhile.
+ *
+ *  @param  total       The histogram to add to.
+ *  @param  histogram   The histogram whose counts to add.
+ *  @return Void.
+ */
+void histogram_add(struct Histogram *total, const struct Histogram *histogram) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        unsigned long count = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        atomic_store_explicit(&total->counts[i],
+                atomic_load_explicit(&total->counts[i], memory_order_relaxed) + count, memory_order_relaxed);
+    }
+    unsigned long sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    atomic_store_explicit(&total->sum, atomic_load_explicit(&total->sum, memory_order_relaxed) + sum,
+            memory_order_relaxed);
+}
+
+/** @brief  Computes the count, mean, extremes and percentiles of the given histogram.
+ *
+ *  Reads the histogram without stopping threads recording into it, so values recorded meanwhile
+ *  may or may not be included. Percentiles and the maximum are the highest value of their bucket,
+ *  and the minimum is the lowest value of its bucket.
+ *
+ *  @param  histogram   The histogram.
+ *  @param  summary     Where to store the summary.
+ *  @return Void.
+ */
+void histogram_summarize(const struct Histogram *histogram, struct HistogramSummary *summary) {
+    static const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    unsigned long *percentiles[] = { &summary->p50, &summary->p90, &summary->p99, &summary->p999 };
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long count = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        count += counts[i];
+    }
+    *summary = (struct HistogramSummary){ .count = count };
+    if (count == 0) {
+        return;
+    }
+    summary->mean = (double)atomic_load_explicit(&histogram->sum, memory_order_relaxed) / count;
+
+    unsigned long seen = 0;
+    int next = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        if (seen == 0) {
+            summary->min = bucket_lowest(i);
+        }
+        seen += counts[i];
+        while (next < 4 && seen >= fractions[next] * count) {
+            *percentiles[next++] = bucket_highest(i);
+        }
+        summary->max = bucket_highest(i);
+    }
+}
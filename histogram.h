@@ -0,0 +1,33 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+
+/* Log-linear histogram in the style of HdrHistogram: values below 2^HISTOGRAM_SUB_BITS get a bucket
+ * each, and every power of two above that is split into 2^HISTOGRAM_SUB_BITS buckets, so a value is
+ * recorded with a relative error below 1/16 over the whole range of an unsigned 64-bit value. */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct Histogram {
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong sum;
+};
+
+struct HistogramSummary {
+    unsigned long count;
+    unsigned long min;
+    unsigned long max;
+    double mean;
+    unsigned long p50;
+    unsigned long p90;
+    unsigned long p99;
+    unsigned long p999;
+};
+
+void    histogram_record(struct Histogram *histogram, unsigned long value);
+void    histogram_add(struct Histogram *total, const struct Histogram *histogram);
+void    histogram_summarize(const struct Histogram *histogram, struct HistogramSummary *summary);
+
+#endif
@@ -0,0 +1,427 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "logger.h"
+#include "log_file.h"
+#include "tunnel.h"
+#include "vehicle.h"
+
+/* A log file is a header page followed by fixed-width records, the record for sequence number n
+ * at offset HEADER_SIZE + n * sizeof(struct EventRecord). Writers map the file one window at a time
+ * and the writer that completes a window unmaps it, so only the windows still being filled are
+ * resident however long the run is. Records hold ids rather than pointers, and the reader rebuilds
+ * one vehicle and one tunnel object per id so replayed events look like live ones.
+ *
+ * A finished file can also be read as several ranges of records at once, each by its own reader
+ * with its own vehicle and tunnel objects, so that ranges can be read on separate threads.
+ *
+ * Writers hand out sequence numbers and count records in the header page, which they map shared, so
+ * processes forked after the file was created write to it as well. Each process maps its own
+ * windows, and the file only ever grows while it is written, so that no process cuts off records
+ * another wrote further on. */
+
+#define LOG_FILE_MAGIC "TNLLOG01"
+#define HEADER_SIZE 4096
+#define WINDOW_RECORDS (1 << 15)
+#define MAX_WINDOWS (1 << 17)
+
+/* `next_seq` is only used while the file is written. */
+struct LogFileHeader {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+    _Atomic uint64_t num_records;
+    _Atomic uint64_t next_seq;
+};
+
+struct EventRecord {
+    uint64_t seq;
+    int32_t vehicle_id;
+    int32_t tunnel_id;
+    uint8_t vehicle_type;
+    uint8_t direction;
+    uint8_t priority;
+    uint8_t event_type;
+    int32_t shard;
+};
+
+_Static_assert(sizeof(struct EventRecord) == 24, "log records must stay 24 bytes");
+_Static_assert(WINDOW_RECORDS * sizeof(struct EventRecord) % HEADER_SIZE == 0, "windows must be page aligned");
+
+#define WINDOW_BYTES ((size_t)WINDOW_RECORDS * sizeof(struct EventRecord))
+
+struct LogFile {
+    int fd;
+    bool writable;
+    /* Writer state */
+    struct LogFileHeader *header;
+    pid_t creator;
+    pthread_mutex_t grow_lock;
+    off_t file_size;
+    struct EventRecord *_Atomic *windows;
+    atomic_int *window_counts;
+    /* Reader state */
+    uint64_t num_records;
+    const struct EventRecord *records;
+    size_t map_size;
+    LogFileReader *reader;
+};
+
+struct LogFileReader {
+    const struct EventRecord *records;
+    uint64_t read_pos;
+    uint64_t end;
+    struct Vehicle **vehicles;
+    int vehicles_capacity;
+    struct Tunnel **tunnels;
+    int tunnels_capacity;
+    struct Event current;
+};
+
+/** @brief  Creates an empty log file at the given path to be written with `log_file_write`.
+ *
+ *  Any existing file at the path is truncated. Processes forked afterwards may write to the file
+ *  too. You should call `log_file_close` to finish the file, in every process that writes it.
+ *
+ *  @param  path    The path of the file.
+ *  @return Pointer to the created log file.
+ */
+LogFile *log_file_create(const char *path) {
+    LogFile *file = calloc(1, sizeof *file);
+    if (file == NULL) {
+        perror("log_file_create");
+        exit(EXIT_FAILURE);
+    }
+    if ((file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    file->windows = calloc(MAX_WINDOWS, sizeof *file->windows);
+    file->window_counts = calloc(MAX_WINDOWS, sizeof *file->window_counts);
+    if (file->windows == NULL || file->window_counts == NULL) {
+        perror("log_file_create");
+        exit(EXIT_FAILURE);
+    }
+    file->writable = true;
+    file->file_size = HEADER_SIZE;
+    pthread_mutex_init(&file->grow_lock, NULL);
+    if (ftruncate(file->fd, file->file_size) != 0) {
+        perror("log_file_create: ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    file->header = mmap(NULL, HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (file->header == MAP_FAILED) {
+        perror("log_file_create: mmap");
+        exit(EXIT_FAILURE);
+    }
+    file->creator = getpid();
+    return file;
+}
+
+/** @brief  Opens the log file at the given path to be read back with `log_file_read`.
+ *
+ *  @param  path    The path of a file written through `log_file_create`.
+ *  @return Pointer to the opened log file.
+ */
+LogFile *log_file_open(const char *path) {
+    LogFile *file = calloc(1, sizeof *file);
+    if (file == NULL) {
+        perror("log_file_open");
+        exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if ((file->fd = open(path, O_RDONLY)) < 0 || fstat(file->fd, &st) != 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    struct LogFileHeader header;
+    if (pread(file->fd, &header, sizeof header, 0) != sizeof header
+            || memcmp(header.magic, LOG_FILE_MAGIC, sizeof header.magic) != 0
+            || header.record_size != sizeof(struct EventRecord)
+            || (uint64_t)st.st_size < HEADER_SIZE + header.num_records * sizeof(struct EventRecord)) {
+        fprintf(stderr, "%s: not a complete log file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    file->map_size = st.st_size;
+    void *map = mmap(NULL, file->map_size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("log_file_open: mmap");
+        exit(EXIT_FAILURE);
+    }
+    madvise(map, file->map_size, MADV_SEQUENTIAL);
+    file->records = (const struct EventRecord *)((const char *)map + HEADER_SIZE);
+    file->num_records = header.num_records;
+    file->reader = log_file_reader_create(file, 0, file->num_records);
+    return file;
+}
+
+/** @brief  Finishes and closes the given log file.
+ *
+ *  For a file being written, no other thread of the calling process may still be writing to it.
+ *  In the process that created the file, no other process may be either: the header is filled in
+ *  and the file is trimmed to the records actually written. Other processes only let go of it.
+ *
+ *  @param  file    The log file to close.
+ *  @return Void.
+ */
+void log_file_close(LogFile *file) {
+    if (file->writable) {
+        for (int w = 0; w < MAX_WINDOWS; w++) {
+            struct EventRecord *window = atomic_load(&file->windows[w]);
+            if (window != NULL) {
+                munmap(window, WINDOW_BYTES);
+            }
+        }
+        if (file->creator == getpid()) {
+            uint64_t num_records = atomic_load(&file->header->num_records);
+            if (ftruncate(file->fd, HEADER_SIZE + num_records * sizeof(struct EventRecord)) != 0) {
+                perror("log_file_close");
+                exit(EXIT_FAILURE);
+            }
+            file->header->record_size = sizeof(struct EventRecord);
+            memcpy(file->header->magic, LOG_FILE_MAGIC, sizeof file->header->magic);
+        }
+        munmap(file->header, HEADER_SIZE);
+        pthread_mutex_destroy(&file->grow_lock);
+        free(file->windows);
+        free(file->window_counts);
+    } else {
+        log_file_reader_destroy(file->reader);
+        munmap((char *)file->records - HEADER_SIZE, file->map_size);
+    }
+    close(file->fd);
+    free(file);
+}
+
+/** @brief  Returns the mapping of the given window, mapping it first if needed.
+ *
+ *  @param  file    The log file being written.
+ *  @param  w       The index of the window.
+ *  @return Pointer to the first record of the window.
+ */
+static struct EventRecord *map_window(LogFile *file, uint64_t w) {
+    struct EventRecord *window = atomic_load_explicit(&file->windows[w], memory_order_acquire);
+    if (window != NULL) {
+        return window;
+    }
+    pthread_mutex_lock(&file->grow_lock);
+    if ((window = atomic_load(&file->windows[w])) == NULL) {
+        off_t offset = HEADER_SIZE + w * WINDOW_BYTES;
+        if (file->file_size < offset + (off_t)WINDOW_BYTES) {
+            // Unlike ftruncate, never shrinks a file another process grew further
+            file->file_size = offset + WINDOW_BYTES;
+            int error = posix_fallocate(file->fd, offset, WINDOW_BYTES);
+            if (error != 0) {
+                errno = error;
+                perror("log_file_write: posix_fallocate");
+                exit(EXIT_FAILURE);
+            }
+        }
+        window = mmap(NULL, WINDOW_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, offset);
+        if (window == MAP_FAILED) {
+            perror("log_file_write: mmap");
+            exit(EXIT_FAILURE);
+        }
+        atomic_store_explicit(&file->windows[w], window, memory_order_release);
+    }
+    pthread_mutex_unlock(&file->grow_lock);
+    return window;
+}
+
+/** @brief  Takes the next sequence number of the given log file.
+ *
+ *  Numbers are shared with every process writing the file, so each is taken once across them.
+ *
+ *  @param  file    The log file being written.
+ *  @return The sequence number.
+ */
+uint64_t log_file_next_seq(LogFile *file) {
+    return atomic_fetch_add_explicit(&file->header->next_seq, 1, memory_order_relaxed);
+}
+
+/** @brief  Writes the given event to the given log file.
+ *
+ *  Safe to call from any number of threads and processes at once. The record is placed according
+ *  to the event's sequence number, so every sequence number from 0 up must be written exactly once,
+ *  see `log_file_next_seq`.
+ *
+ *  @param  file    The log file being written.
+ *  @param  event   The event to write.
+ *  @return Void.
+ */
+void log_file_write(LogFile *file, const struct Event *event) {
+    uint64_t w = event->seq / WINDOW_RECORDS;
+    if (w >= MAX_WINDOWS) {
+        fprintf(stderr, "log_file_write: log file full\n");
+        exit(EXIT_FAILURE);
+    }
+    struct EventRecord *window = map_window(file, w);
+    window[event->seq % WINDOW_RECORDS] = (struct EventRecord){
+        .seq = event->seq,
+        .vehicle_id = event->vehicle->id,
+        .tunnel_id = event->tunnel != NULL ? event->tunnel->id : -1,
+        .vehicle_type = event->vehicle->vehicle_type,
+        .direction = event->vehicle->direction,
+        .priority = event->vehicle->priority,
+        .event_type = event->event_type,
+        .shard = event->shard,
+    };
+    atomic_fetch_add_explicit(&file->header->num_records, 1, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&file->window_counts[w], 1, memory_order_acq_rel) + 1 == WINDOW_RECORDS) {
+        atomic_store(&file->windows[w], NULL);
+        munmap(window, WINDOW_BYTES);
+    }
+}
+
+/** @brief  Returns the slot for the given id in a table grown on demand.
+ *
+ *  @param  table       The table, reallocated when the id is past its end.
+ *  @param  capacity    The number of slots in the table.
+ *  @param  id          The id to look up.
+ *  @return Pointer to the table slot for the id.
+ */
+static void **table_slot(void ***table, int *capacity, int id) {
+    if (id >= *capacity) {
+        int new_capacity = *capacity ? *capacity : 64;
+        while (new_capacity <= id) {
+            new_capacity *= 2;
+        }
+        void **new_table = realloc(*table, new_capacity * sizeof *new_table);
+        if (new_table == NULL) {
+            perror("log_file_read");
+            exit(EXIT_FAILURE);
+        }
+        memset(new_table + *capacity, 0, (new_capacity - *capacity) * sizeof *new_table);
+        *table = new_table;
+        *capacity = new_capacity;
+    }
+    return &(*table)[id];
+}
+
+/** @brief  Retrieves the next event of the given log file.
+ *
+ *  @param  file    The log file being read.
+ *  @return The next event in sequence order, or NULL once every event has been read, or if the
+ *          file is being written. The event is owned by the file and stays valid until the next call.
+ */
+struct Event *log_file_read(LogFile *file) {
+    if (file->writable) {
+        return NULL;
+    }
+    return log_file_reader_next(file->reader);
+}
+
+/** @brief  Returns the number of records of a log file opened with `log_file_open`.
+ *
+ *  The record of sequence number n is the n-th record, so this is also one past the last sequence
+ *  number.
+ *
+ *  @param  file    The log file being read.
+ *  @return The number of records.
+ */
+uint64_t log_file_length(LogFile *file) {
+    return file->num_records;
+}
+
+/** @brief  Creates a reader for a range of the records of a log file opened with `log_file_open`.
+ *
+ *  Readers of the same file may be used on different threads at once, and independently of
+ *  `log_file_read`. Each rebuilds its own vehicle and tunnel objects, which are only valid until
+ *  the reader is destroyed.
+ *
+ *  @param  file    The log file being read.
+ *  @param  first   The first record to read.
+ *  @param  last    One past the last record to read, at most `log_file_length`.
+ *  @return Pointer to the created reader.
+ */
+LogFileReader *log_file_reader_create(LogFile *file, uint64_t first, uint64_t last) {
+    LogFileReader *reader = calloc(1, sizeof *reader);
+    if (reader == NULL) {
+        perror("log_file_reader_create");
+        exit(EXIT_FAILURE);
+    }
+    reader->records = file->records;
+    reader->read_pos = first;
+    reader->end = last;
+    return reader;
+}
+
+/** @brief  Frees the given reader and the vehicles and tunnels of the events it returned.
+ *
+ *  @param  reader  The reader to destroy.
+ *  @return Void.
+ */
+void log_file_reader_destroy(LogFileReader *reader) {
+    for (int i = 0; i < reader->vehicles_capacity; i++) {
+        free(reader->vehicles[i]);
+    }
+    for (int i = 0; i < reader->tunnels_capacity; i++) {
+        free(reader->tunnels[i]);
+    }
+    free(reader->vehicles);
+    free(reader->tunnels);
+    free(reader);
+}
+
+/** @brief  Retrieves the next event of the given reader's range.
+ *
+ *  @param  reader  The reader.
+ *  @return The next event in sequence order, or NULL once every event of the range has been read.
+ *          The event is owned by the reader and stays valid until the next call.
+ */
+struct Event *log_file_reader_next(LogFileReader *reader) {
+    if (reader->read_pos == reader->end) {
+        return NULL;
+    }
+    const struct EventRecord *record = &reader->records[reader->read_pos++];
+    bool tunnel_event = record->event_type != ARRIVE && record->event_type != ENTER_TIMEOUT
+                        && record->event_type != ENTER_CANCELLED;
+    if (record->vehicle_id < 0 || (record->tunnel_id < 0 && tunnel_event)) {
+        fprintf(stderr, "log_file_read: corrupt record %llu\n", (unsigned long long)record->seq);
+        exit(EXIT_FAILURE);
+    }
+    struct Vehicle **vehicle = (struct Vehicle **)table_slot((void ***)&reader->vehicles, &reader->vehicles_capacity,
+                                                         record->vehicle_id);
+    if (*vehicle == NULL && (*vehicle = calloc(1, sizeof **vehicle)) == NULL) {
+        perror("log_file_read");
+        exit(EXIT_FAILURE);
+    }
+    **vehicle = (struct Vehicle){
+        .id = record->vehicle_id,
+        .vehicle_type = record->vehicle_type,
+        .direction = record->direction,
+        .priority = record->priority,
+    };
+    struct Tunnel *tunnel = NULL;
+    if (record->tunnel_id >= 0) {
+        struct Tunnel **slot = (struct Tunnel **)table_slot((void ***)&reader->tunnels, &reader->tunnels_capacity,
+                                                               record->tunnel_id);
+        if (*slot == NULL) {
+            if ((*slot = aligned_alloc(_Alignof(struct Tunnel), sizeof **slot)) == NULL) {
+                perror("log_file_read");
+                exit(EXIT_FAILURE);
+            }
+            **slot = (struct Tunnel){ .state = &(*slot)->own_state };
+        }
+        (*slot)->id = record->tunnel_id;
+        tunnel = *slot;
+    }
+    reader->current = (struct Event){
+        .vehicle = *vehicle,
+        .tunnel = tunnel,
+        .event_type = record->event_type,
+        .shard = record->shard,
+        .seq = record->seq,
+    };
+    return &reader->current;
+}
@@ -0,0 +1,23 @@
+#ifndef LOG_FILE_H
+#define LOG_FILE_H
+
+#include <stdint.h>
+#include "logger.h"
+
+typedef struct LogFile LogFile;
+typedef struct LogFileReader LogFileReader;
+
+LogFile        *log_file_create(const char *path);
+LogFile        *log_file_open(const char *path);
+void            log_file_close(LogFile *file);
+
+uint64_t        log_file_next_seq(LogFile *file);
+void            log_file_write(LogFile *file, const struct Event *event);
+struct Event   *log_file_read(LogFile *file);
+
+uint64_t        log_file_length(LogFile *file);
+LogFileReader  *log_file_reader_create(LogFile *file, uint64_t first, uint64_t last);
+struct Event   *log_file_reader_next(LogFileReader *reader);
+void            log_file_reader_destroy(LogFileReader *reader);
+
+#endif
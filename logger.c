@@ -1,17 +1,71 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "tunnel.h"
 #include "vehicle.h"
 #include "logger.h"
+#include "log_file.h"
+#include "slab.h"
 
-struct Node {
-    struct Event *event;
-    struct Node *next;
+#define SEGMENT_EVENTS 64
+
+/* Every thread that logs owns a producer: a chain of fixed-size segments that only it writes and
+ * only the consumer reads. The consumer hands drained segments back through `spare`, so a producer
+ * that is kept up with cycles between two segments without allocating. Events carry a global
+ * sequence number and `log_get_head` merges the producers back into that order.
+ *
+ * A bounded log caps how many segments each producer may have waiting for the consumer. A producer
+ * that reaches the cap yields until the consumer catches up, so a log that is read while it is
+ * written uses a fixed amount of memory per thread.
+ *
+ * A log can instead be backed by a binary log file, see log_file.c. Its events take their sequence
+ * numbers from the file, so that processes forked after the log was created can add to it too.
+ *
+ * A finished log can also be read in ranges of sequence numbers, on several threads at once. Since
+ * each producer's segments are in sequence order, a range is gathered by skipping every segment
+ * outside it and placing the events of the others by their sequence numbers.
+ *
+ * Events the level of the log leaves out are dropped in `log_add` before they take a sequence
+ * number, so the events of a summary log are numbered without gaps like those of a full one. */
+
+struct Segment {
+    struct Event events[SEGMENT_EVENTS];
+    atomic_int count;
+    struct Segment *_Atomic next;
+};
+
+struct Producer {
+    struct Segment *write;
+    struct Segment *read;
+    int read_pos;
+    struct Segment *_Atomic spare;
+    atomic_int backlog;
+    const void *owner;
+};
+
+/* The events of a range read with `log_read_range`. Those of a log file point to vehicles and
+ * tunnels owned by `reader`. */
+struct LogRange {
+    LogFileReader *reader;
 };
 
 struct Log {
-    struct Node *head;
-    struct Node *tail;
+    unsigned long id;
+    enum LogLevel level;
+    LogFile *file;
+    atomic_ulong next_seq;
+    int max_segments;
+    pthread_mutex_t producers_lock;
+    struct Producer **producers;
+    int num_producers;
+    int producers_capacity;
+    struct Producer **heap;
+    int heap_size;
+    unsigned long expected_seq;
+    struct Event current;
 };
 
 const char* const event_strings[] = {
@@ -23,6 +77,16 @@ const char* const event_strings[] = {
     [COMPLETE] = "has completed",
     [ERROR] = "error in log",
     [END_TEST] = "end of test",
+    [ARRIVE] = "arrived",
+    [ENTER_TIMEOUT] = "gave up waiting",
+    [ENTER_CANCELLED] = "was cancelled",
+    [ENTER_SUMMARY] = "entered successfully",
+};
+
+const char *const log_level_names[] = {
+    [LOG_FULL] = "full",
+    [LOG_SUMMARY] = "summary",
+    [LOG_OFF] = "off",
 };
 
 const char* const vehicle_names[] = {
@@ -35,104 +99,489 @@ const char* const direction_strings[] = {
     [SOUTH] = "SOUTH",
 };
 
+static struct Slab segment_slab = SLAB_INITIALIZER(struct Segment);
+
+static atomic_ulong log_ids = 1;
+
+/* The producer this thread last logged through, and the log it belongs to. */
+static _Thread_local unsigned long local_log_id;
+static _Thread_local struct Producer *local_producer;
+static _Thread_local char local_owner;
+
 /** @brief  Creates and returns a pointer to a log.
- *  
+ *
  *  You should call `log_destroy` to free the memory allocated to the log.
  *
  *  @return Pointer to the created log.
  */
 Log *log_create(void) {
     Log *new_log;
-    if ((new_log = malloc(sizeof *new_log)) == NULL) {
+    if ((new_log = calloc(1, sizeof *new_log)) == NULL) {
         perror("log_create");
         exit(EXIT_FAILURE);
     }
-    new_log->head = new_log->tail = NULL;
+    new_log->id = atomic_fetch_add(&log_ids, 1);
+    pthread_mutex_init(&new_log->producers_lock, NULL);
+    return new_log;
+}
+
+/** @brief  Creates and returns a pointer to a log whose unread events take bounded memory.
+ *
+ *  Once a thread has about `max_events` events in the log that have not been read yet,
+ *  `log_add` waits for the reader to catch up. The log must therefore be read concurrently, e.g.
+ *  by a verifier started with `verifier_start`, from a thread that never waits on the writers.
+ *
+ *  @param  max_events  The most unread events per writing thread, rounded up to whole segments.
+ *  @return Pointer to the created log.
+ */
+Log *log_create_bounded(int max_events) {
+    Log *new_log = log_create();
+    new_log->max_segments = (max_events + SEGMENT_EVENTS - 1) / SEGMENT_EVENTS;
+    if (new_log->max_segments < 1) {
+        new_log->max_segments = 1;
+    }
+    return new_log;
+}
+
+/** @brief  Creates and returns a pointer to a log that writes its events to a binary file.
+ *
+ *  Events are not kept in memory and cannot be read back from this log. Processes forked afterwards
+ *  may add to it as well, and should destroy their copy once done. Once it has been destroyed in
+ *  this process too, after the others, the file can be read back with `log_open`.
+ *
+ *  @param  path    The path of the file to write, which is truncated if it exists.
+ *  @return Pointer to the created log.
+ */
+Log *log_create_mapped(const char *path) {
+    Log *new_log = log_create();
+    new_log->file = log_file_create(path);
+    return new_log;
+}
+
+/** @brief  Opens a binary file written by a log from `log_create_mapped` for reading.
+ *
+ *  The events are replayed through `log_get_head`. Their vehicles and tunnels are rebuilt from
+ *  the file and only hold the ids, types, directions and priorities recorded there.
+ *
+ *  @param  path    The path of the file to read.
+ *  @return Pointer to the opened log.
+ */
+Log *log_open(const char *path) {
+    Log *new_log = log_create();
+    new_log->file = log_file_open(path);
     return new_log;
 }
 
 /** @brief  Frees the memory allocated to the given log.
+ *
+ *  Must not be called while other threads may still add to the log.
  *
  *  @param  log The log to destroy.
  *  @return Void.
  */
 void log_destroy(Log *log) {
-    struct Event *event = log_get_head(log);
-    while (event != NULL) {
-        free(event);
-        event = log_get_head(log);
+    for (int i = 0; i < log->num_producers; i++) {
+        struct Producer *producer = log->producers[i];
+        struct Segment *segment = producer->read;
+        while (segment != NULL) {
+            struct Segment *next = atomic_load(&segment->next);
+            slab_free(&segment_slab, segment);
+            segment = next;
+        }
+        slab_free(&segment_slab, atomic_load(&producer->spare));
+        free(producer);
+    }
+    if (log->file != NULL) {
+        log_file_close(log->file);
     }
+    pthread_mutex_destroy(&log->producers_lock);
+    free(log->producers);
+    free(log->heap);
     free(log);
 }
 
-/** @brief  Creates an event with the given attributes.
+/** @brief  Sets which events the given log records, see `enum LogLevel`.
  *
- *  @param  vehicle     The vehicle involved the event.
- *  @param  tunnel      The tunnel involved the event.
- *  @param  event_type  The type of event.
- *  @return Pointer to the created event.
+ *  Must be called before anything is added to the log. A new log is full.
+ *
+ *  @param  log     The log.
+ *  @param  level   The new level of the log.
+ *  @return Void.
  */
-static struct Event *event_create(struct Vehicle *vehicle, struct Tunnel *tunnel, enum EventType event_type) {
-    struct Event *new_event;
-    if ((new_event = malloc(sizeof *new_event)) == NULL) {
-        perror("event_create");
-        exit(EXIT_FAILURE);
+void log_set_level(Log *log, enum LogLevel level) {
+    log->level = level;
+}
+
+/** @brief  Returns which events the given log records.
+ *
+ *  @param  log The log.
+ *  @return The level of the log.
+ */
+enum LogLevel log_get_level(Log *log) {
+    return log->level;
+}
+
+/** @brief  Returns whether the level of the given log keeps events of the given type. */
+static bool log_keeps(const Log *log, enum EventType event_type) {
+    switch (log->level) {
+        case LOG_FULL:
+            return true;
+        case LOG_SUMMARY:
+            return event_type != ENTER_ATTEMPT && event_type != ENTER_SUCCESS && event_type != ENTER_FAILED
+                   && event_type != LEAVE_START;
+        default:
+            return false;
+    }
+}
+
+/** @brief  Allocates an empty segment.
+ *
+ *  @return Pointer to the created segment.
+ */
+static struct Segment *segment_create(void) {
+    struct Segment *segment = slab_alloc(&segment_slab);
+    atomic_init(&segment->count, 0);
+    atomic_init(&segment->next, NULL);
+    return segment;
+}
+
+/** @brief  Returns the calling thread's producer for the given log, registering one if needed.
+ *
+ *  @param  log The log being added to.
+ *  @return The calling thread's producer.
+ */
+static struct Producer *get_producer(Log *log) {
+    if (local_log_id == log->id) {
+        return local_producer;
+    }
+    pthread_mutex_lock(&log->producers_lock);
+    struct Producer *producer = NULL;
+    for (int i = 0; i < log->num_producers; i++) {
+        if (log->producers[i]->owner == &local_owner) {
+            producer = log->producers[i];
+            break;
+        }
     }
-    *new_event = (struct Event){ .vehicle = vehicle, .tunnel = tunnel, .event_type = event_type };
-    return new_event;
+    if (producer == NULL) {
+        if (log->num_producers == log->producers_capacity) {
+            int capacity = log->producers_capacity ? 2 * log->producers_capacity : 16;
+            struct Producer **producers = realloc(log->producers, capacity * sizeof *producers);
+            if (producers == NULL) {
+                perror("log_add");
+                exit(EXIT_FAILURE);
+            }
+            log->producers = producers;
+            log->producers_capacity = capacity;
+        }
+        if ((producer = malloc(sizeof *producer)) == NULL) {
+            perror("log_add");
+            exit(EXIT_FAILURE);
+        }
+        producer->write = producer->read = segment_create();
+        producer->read_pos = 0;
+        atomic_init(&producer->spare, NULL);
+        atomic_init(&producer->backlog, 0);
+        producer->owner = &local_owner;
+        log->producers[log->num_producers++] = producer;
+    }
+    pthread_mutex_unlock(&log->producers_lock);
+    local_log_id = log->id;
+    local_producer = producer;
+    return producer;
+}
+
+/** @brief  Stamps an event with the next sequence number of the given log and appends it. */
+static void add_event(Log *log, struct Vehicle *vehicle, struct Tunnel *tunnel, enum EventType event_type,
+                      int shard) {
+    if (log->file != NULL) {
+        struct Event event = {
+            .vehicle = vehicle,
+            .tunnel = tunnel,
+            .event_type = event_type,
+            .shard = shard,
+            .seq = log_file_next_seq(log->file),
+        };
+        log_file_write(log->file, &event);
+        return;
+    }
+    struct Producer *producer = get_producer(log);
+    struct Segment *segment = producer->write;
+    int count = atomic_load_explicit(&segment->count, memory_order_relaxed);
+    if (count == SEGMENT_EVENTS) {
+        // Waits before taking a sequence number, so the reader never waits on this thread meanwhile
+        while (log->max_segments > 0 && atomic_load(&producer->backlog) >= log->max_segments) {
+            sched_yield();
+        }
+        atomic_fetch_add(&producer->backlog, 1);
+        struct Segment *next = atomic_exchange(&producer->spare, NULL);
+        if (next == NULL) {
+            next = segment_create();
+        } else {
+            atomic_store_explicit(&next->count, 0, memory_order_relaxed);
+            atomic_store_explicit(&next->next, NULL, memory_order_relaxed);
+        }
+        atomic_store_explicit(&segment->next, next, memory_order_release);
+        producer->write = segment = next;
+        count = 0;
+    }
+    segment->events[count] = (struct Event){
+        .vehicle = vehicle,
+        .tunnel = tunnel,
+        .event_type = event_type,
+        .shard = shard,
+        .seq = atomic_fetch_add_explicit(&log->next_seq, 1, memory_order_relaxed),
+    };
+    atomic_store_explicit(&segment->count, count + 1, memory_order_release);
 }
 
-/** @brief  Adds an event with the given attributes to the given log.
+/** @brief  Adds an event with the given attributes to the given log, unless its level leaves the
+ *          event out.
+ *
+ *  Safe to call from any number of threads at once. The event is stamped with the next sequence
+ *  number of the log, which is the order in which `log_get_head` returns events. On a bounded log
+ *  this may wait for the reader.
  *
- *  @param  log         The log to add the event to.
+ *  @param  log         The log to add the event to, or NULL for events that are not logged.
  *  @param  vehicle     The vehicle involved the event.
  *  @param  tunnel      The tunnel involved the event.
  *  @param  event_type  The type of event.
  *  @return Void.
  */
 void log_add(Log *log, struct Vehicle *vehicle, struct Tunnel *tunnel, enum EventType event_type) {
-    struct Node *new_node;
-    if ((new_node = malloc(sizeof *new_node)) == NULL) {
-        perror("log_add");
+    if (log == NULL || !log_keeps(log, event_type)) {
+        return;
+    }
+    add_event(log, vehicle, tunnel, event_type, 0);
+}
+
+/** @brief  Adds the ARRIVE event of a vehicle to the given log, with the scheduler shard it waits in.
+ *
+ *  The admission order only holds among the vehicles of the same shard, so the verifier checks it
+ *  per shard. Vehicles of a scheduler without shards are all in shard 0.
+ *
+ *  @param  log     The log to add the event to, or NULL for events that are not logged.
+ *  @param  vehicle The vehicle that arrived.
+ *  @param  shard   The index of the vehicle's home shard.
+ *  @return Void.
+ */
+void log_add_arrival(Log *log, struct Vehicle *vehicle, int shard) {
+    if (log == NULL || !log_keeps(log, ARRIVE)) {
+        return;
+    }
+    add_event(log, vehicle, NULL, ARRIVE, shard);
+}
+
+/** @brief  Adds the ENTER_SUMMARY event of an admission to the given log, if it is a summary log.
+ *
+ *  A summary log records an admission with this single event in place of the attempts to enter
+ *  and the entry, which `log_add` leaves out of it. A full log already has those and gets nothing.
+ *  Must be called right after the vehicle entered, under the same lock as its attempts.
+ *
+ *  @param  log     The log to add the event to, or NULL for events that are not logged.
+ *  @param  vehicle The vehicle that entered.
+ *  @param  tunnel  The tunnel it entered.
+ *  @return Void.
+ */
+void log_add_summary(Log *log, struct Vehicle *vehicle, struct Tunnel *tunnel) {
+    if (log == NULL || log->level != LOG_SUMMARY) {
+        return;
+    }
+    add_event(log, vehicle, tunnel, ENTER_SUMMARY, 0);
+}
+
+/** @brief  Returns the next unread event of the given producer without consuming it.
+ *
+ *  Drained segments are handed back to the producer on the way.
+ *
+ *  @param  producer    The producer to peek at.
+ *  @return The producer's next event, or NULL if it has none published yet.
+ */
+static struct Event *producer_peek(struct Producer *producer) {
+    struct Segment *segment = producer->read;
+    if (producer->read_pos == SEGMENT_EVENTS) {
+        struct Segment *next = atomic_load_explicit(&segment->next, memory_order_acquire);
+        if (next == NULL) {
+            return NULL;
+        }
+        slab_free(&segment_slab, atomic_exchange(&producer->spare, segment));
+        producer->read = segment = next;
+        producer->read_pos = 0;
+        atomic_fetch_sub(&producer->backlog, 1);
+    }
+    if (producer->read_pos < atomic_load_explicit(&segment->count, memory_order_acquire)) {
+        return &segment->events[producer->read_pos];
+    }
+    return NULL;
+}
+
+/** @brief  Returns the sequence number of the producer's next event, which must exist. */
+static unsigned long heap_key(struct Log *log, int i) {
+    return producer_peek(log->heap[i])->seq;
+}
+
+/** @brief  Restores the heap order below position i. */
+static void heap_sift_down(Log *log, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < log->heap_size && heap_key(log, left) < heap_key(log, smallest)) {
+            smallest = left;
+        }
+        if (right < log->heap_size && heap_key(log, right) < heap_key(log, smallest)) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        struct Producer *tmp = log->heap[i];
+        log->heap[i] = log->heap[smallest];
+        log->heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/** @brief  Rebuilds the heap from every producer that has a published event. */
+static void heap_rebuild(Log *log) {
+    pthread_mutex_lock(&log->producers_lock);
+    struct Producer **heap = realloc(log->heap, (log->producers_capacity + 1) * sizeof *heap);
+    if (heap == NULL) {
+        perror("log_get_head");
         exit(EXIT_FAILURE);
     }
-    struct Event *new_event = event_create(vehicle, tunnel, event_type); 
-    new_node->event = new_event;
-    if (log->tail == NULL) {
-        new_node->next = NULL;
-        log->head = log->tail = new_node;
-    } else {
-        log->tail = log->tail->next = new_node;
+    log->heap = heap;
+    log->heap_size = 0;
+    for (int i = 0; i < log->num_producers; i++) {
+        if (producer_peek(log->producers[i]) != NULL) {
+            log->heap[log->heap_size++] = log->producers[i];
+        }
+    }
+    pthread_mutex_unlock(&log->producers_lock);
+    for (int i = log->heap_size / 2 - 1; i >= 0; i--) {
+        heap_sift_down(log, i);
     }
 }
 
 /** @brief  Retrieves and removes the head of the given log.
+ *
+ *  Events are returned in sequence number order. Only one thread may read from a log, but other
+ *  threads may keep adding to it meanwhile.
  *
  *  @param  log The log to get the event from.
- *  @return The event at the head of the log, or NULL if the log is empty.
+ *  @return The event at the head of the log, or NULL if the next event has not been added yet.
+ *          The event is owned by the log and stays valid until the next call.
  */
 struct Event *log_get_head(Log *log) {
-    if (log->head == NULL) {
-        return NULL;
+    if (log->file != NULL) {
+        return log_file_read(log->file);
+    }
+    if (log->heap_size == 0 || heap_key(log, 0) != log->expected_seq) {
+        heap_rebuild(log);
+        if (log->heap_size == 0 || heap_key(log, 0) != log->expected_seq) {
+            return NULL;
+        }
+    }
+    struct Producer *producer = log->heap[0];
+    log->current = *producer_peek(producer);
+    producer->read_pos++;
+    if (producer_peek(producer) == NULL) {
+        log->heap[0] = log->heap[--log->heap_size];
+    }
+    heap_sift_down(log, 0);
+    log->expected_seq++;
+    return &log->current;
+}
+
+/** @brief  Returns the number of events in a finished log.
+ *
+ *  Events are numbered without gaps from 0, so this is also one past the last sequence number.
+ *
+ *  @param  log The log, which no thread may still be adding to.
+ *  @return The number of events.
+ */
+unsigned long log_length(Log *log) {
+    if (log->file != NULL) {
+        return log_file_length(log->file);
+    }
+    return atomic_load(&log->next_seq);
+}
+
+/** @brief  Copies the events of a range of sequence numbers of a finished log.
+ *
+ *  Several threads may read ranges of the same log at once. The log must not be read with
+ *  `log_get_head`, nor added to, while they do.
+ *
+ *  @param  log     The log to read, which must be either in memory or opened with `log_open`.
+ *  @param  first   The sequence number of the first event to copy.
+ *  @param  last    One past the sequence number of the last event, at most `log_length`.
+ *  @param  events  Where to store the events, the one with sequence number n at `events[n - first]`.
+ *  @return The range, to destroy with `log_range_destroy` once the events are no longer used,
+ *          since the vehicles and tunnels of a log file's events belong to it.
+ */
+LogRange *log_read_range(Log *log, unsigned long first, unsigned long last, struct Event *events) {
+    LogRange *range = calloc(1, sizeof *range);
+    if (range == NULL) {
+        perror("log_read_range");
+        exit(EXIT_FAILURE);
     }
-    struct Event *event = log->head->event;
-    struct Node *old_head = log->head;
-    log->head = log->head->next;
-    free(old_head);
-    if (log->head == NULL) {
-        log->tail = NULL;
+    if (log->file != NULL) {
+        range->reader = log_file_reader_create(log->file, first, last);
+        struct Event *event;
+        for (unsigned long i = 0; (event = log_file_reader_next(range->reader)) != NULL; i++) {
+            events[i] = *event;
+        }
+        return range;
     }
-    return event;
+    pthread_mutex_lock(&log->producers_lock);
+    int num_producers = log->num_producers;
+    pthread_mutex_unlock(&log->producers_lock);
+    for (int i = 0; i < num_producers; i++) {
+        const struct Segment *segment = log->producers[i]->read;
+        for (; segment != NULL; segment = atomic_load_explicit(&segment->next, memory_order_acquire)) {
+            int count = atomic_load_explicit(&segment->count, memory_order_acquire);
+            if (count == 0 || segment->events[0].seq >= last || segment->events[count - 1].seq < first) {
+                continue;
+            }
+            for (int j = 0; j < count; j++) {
+                unsigned long seq = segment->events[j].seq;
+                if (seq >= first && seq < last) {
+                    events[seq - first] = segment->events[j];
+                }
+            }
+        }
+    }
+    return range;
+}
+
+/** @brief  Frees a range read with `log_read_range`, with the vehicles and tunnels its events
+ *          point to if they were rebuilt from a log file.
+ *
+ *  @param  range   The range to destroy.
+ *  @return Void.
+ */
+void log_range_destroy(LogRange *range) {
+    if (range->reader != NULL) {
+        log_file_reader_destroy(range->reader);
+    }
+    free(range);
 }
 
 /** @brief  Prints a description of the given event.
+ *
+ *  Arrivals and vehicles giving up are the only events without a tunnel. Summarised entries also
+ *  show how many tunnels were tried, if there was more than one.
  *
  *  @param  event   The event to be printed.
  *  @return Void.
  */
 void print_event(struct Event *event) {
     struct Vehicle *vehicle = event->vehicle;
+    if (event->tunnel == NULL) {
+        printf("%s %s %d with priority %d %s\n", direction_strings[vehicle->direction],
+                vehicle_names[vehicle->vehicle_type], vehicle->id, vehicle->priority,
+                event_strings[event->event_type]);
+        return;
+    }
     printf("%s %s %d with priority %d %s %d\n", direction_strings[vehicle->direction],
-            vehicle_names[vehicle->vehicle_type], vehicle->id, vehicle->priority, 
+            vehicle_names[vehicle->vehicle_type], vehicle->id, vehicle->priority,
             event_strings[event->event_type], event->tunnel->id);
 }
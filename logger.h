@@ -13,24 +13,56 @@ enum EventType {
     COMPLETE,
     ERROR,
     END_TEST,
+    ARRIVE,
+    ENTER_TIMEOUT,
+    ENTER_CANCELLED,
+    ENTER_SUMMARY,
     NUM_EVENT_TYPES,
 };
 
+/* How much a log records. A full log has every attempt to enter and both ends of every exit. A
+ * summary log has a single ENTER_SUMMARY per admission instead of the attempts, and only the end of
+ * each exit, so it grows with the number of vehicles however many tunnels each admission tries.
+ * Nothing is added to a log that is off. */
+enum LogLevel {
+    LOG_FULL,
+    LOG_SUMMARY,
+    LOG_OFF,
+    NUM_LOG_LEVELS,
+};
+
+extern const char *const log_level_names[];
+
 typedef struct Log Log;
+typedef struct LogRange LogRange;
 
 struct Event {
     struct Vehicle *vehicle;
     struct Tunnel *tunnel;
     enum EventType event_type;
+    int shard;
+    unsigned long seq;
 };
 
 
 Log            *log_create(void);
+Log            *log_create_bounded(int max_events);
+Log            *log_create_mapped(const char *path);
+Log            *log_open(const char *path);
 void            log_destroy(Log *log);
 
+void            log_set_level(Log *log, enum LogLevel level);
+enum LogLevel   log_get_level(Log *log);
+
 void            log_add(Log *log, struct Vehicle *vehicle, struct Tunnel *tunnel, enum EventType event_type);
+void            log_add_arrival(Log *log, struct Vehicle *vehicle, int shard);
+void            log_add_summary(Log *log, struct Vehicle *vehicle, struct Tunnel *tunnel);
 struct Event   *log_get_head(Log *log);
 
+unsigned long   log_length(Log *log);
+LogRange       *log_read_range(Log *log, unsigned long first, unsigned long last, struct Event *events);
+void            log_range_destroy(LogRange *range);
+
 void            print_event(struct Event *event);
 
 #endif
@@ -1,142 +1,2705 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include "tunnel.h"
 #include "vehicle.h"
 #include "hashmap.h"
 #include "priority_scheduler.h"
+#include "slab.h"
 
-struct PriorityScheduler {
+#define NUM_CLASSES (NUM_VEHICLE_TYPES * NUM_DIRECTIONS)
+#define SHARED_MAGIC 0x54554e32u
+#define MAX_PROCESSES 64
+#define CHECK_PERIOD_NS 50000000LL
+
+/* What a waiter slot of a shared scheduler is doing: on the free list, queued, or taken by a
+ * vehicle that is not queued, either because it has not been queued yet or because it has been
+ * admitted or given up and its admission call has not returned. */
+enum SlotState {
+    SLOT_FREE,
+    SLOT_HELD,
+    SLOT_QUEUED,
+};
+
+/**
+ * A vehicle parked in `scheduler_admit`. Each waiter sleeps on its own condition variable, and
+ * whoever frees capacity admits it on its behalf before signalling, so a wakeup is never wasted.
+ * Waiters queued by `scheduler_admit_async` have a callback instead. A queued vehicle points back
+ * to its waiter, so that the waiter can be taken out of the middle of its queue when it gives up.
+ *
+ * Waiters refer to their vehicle and to each other by reference, see `scheduler_at`, and to the
+ * tunnel they were admitted into by its id, or -1 until then. The waiters of a shared scheduler sit
+ * in slots of its state, where any process may admit them, so their `vehicle` refers to `copy`,
+ * which the waiting process fills in and reads back. Each slot also records the process it is held
+ * by, and the ticket its vehicle was queued with, which orders the queued waiters of a shard.
+ */
+struct Waiter {
+    uintptr_t vehicle;
+    int tunnel;
+    enum SlotState slot_state;
+    pid_t pid;
+    unsigned long ticket;
+    pthread_cond_t cv;
+    AdmitCallback callback;
+    void *arg;
+    bool cancelled;
+    uintptr_t prev;
+    uintptr_t next;
+    struct Vehicle copy;
+};
+
+static struct Slab waiter_slab = SLAB_INITIALIZER(struct Waiter);
+
+/** Doubly linked FIFO of waiters sharing a priority and a (vehicle type, direction) class. */
+struct WaitQueue {
+    uintptr_t head;
+    uintptr_t tail;
+    int length;
+};
+
+/**
+ * Two-level bitmap of the priorities that have waiting vehicles. Bit w of `summary` is set when
+ * `words[w]` is non-zero, so the highest set priority takes two count-leading-zeros whatever the
+ * number of levels.
+ */
+struct PriorityBitmap {
+    uint64_t summary;
+    uint64_t words[SCHEDULER_MAX_PRIORITIES / 64];
+};
+
+/* Partially filled tunnels of class c are in bucket c. Empty tunnels are in EMPTY_BUCKET if they
+ * were never used, and in EMPTY_BUCKET + 1 + c if the last vehicles they held were of class c. */
+#define EMPTY_BUCKET NUM_CLASSES
+#define NUM_BUCKETS (2 * NUM_CLASSES + 1)
+#define NO_BUCKET (-1)
+
+/**
+ * Buckets every tunnel of a shard that still has room by what it can take: the empty tunnels by
+ * the class they last held, and one bucket per class of partially filled tunnels. Tunnels are
+ * linked through their `IndexEntry`, by their position in the shard, so finding, moving and
+ * removing a tunnel are all constant time.
+ *
+ * The entries also follow each tunnel from the moment it stops being empty until it is empty again,
+ * recording the most vehicles it held meanwhile, for the flip and fill counters.
+ */
+struct TunnelIndex {
+    int heads[NUM_BUCKETS];
+};
+
+struct IndexEntry {
+    int bucket;
+    int next;
+    int prev;
+    int last_class;
+    int occupants;
+    int peak;
+};
+
+/**
+ * A contiguous slice of the tunnels behind its own lock. Vehicles are queued in, and mapped to their
+ * tunnels by, their home shard, which is picked from the vehicle id. `num_waiting`, `highest` and
+ * `has_room` mirror the shard's state so that other shards can read it without taking its lock.
+ *
+ * The shard's arrays are slices of the scheduler's: NUM_CLASSES wait queues and a count per
+ * priority, with the bit of every priority with a non-zero count set in `priorities`, and an index
+ * entry per tunnel. `turn` and the shard's deficits are the weighted-fair policy's state for the
+ * shard's own waiters.
+ *
+ * The scheduler's snapshot arrays copy the priority counts and the occupancy of the shard's tunnels
+ * as the index sees it, for `scheduler_snapshot`. They are written under the shard lock inside a
+ * seqlock: `snapshot_seq` is odd while a copy is being changed, so readers can tell when what they
+ * read may be torn and read it again, without ever taking the lock.
+ *
+ * In a shared scheduler, vehicles wait in the shard's own waiter slots, and those not in use are
+ * chained from `free_waiters`. A vehicle that finds none free waits on `slot_cv`. The lock is
+ * robust: if a process dies holding it, the next to take it rebuilds the shard, see `repair_shard`.
+ */
+struct Shard {
     pthread_mutex_t lock;
-    pthread_cond_t lock_cv;
-    HashMap *tunnel_map;
-    int priority_counts[HIGHEST_PRIORITY + 1];
+    struct PriorityBitmap priorities;
+    atomic_int highest;
+    int turn;
+    int first_tunnel;
+    int num_tunnels;
+    struct TunnelIndex index;
+    struct SchedulerCounters counters;
+    int convoy_class;
+    int convoy_length;
+    atomic_int num_waiting;
+    atomic_bool has_room;
+    atomic_uint snapshot_seq;
+    uintptr_t free_waiters;
+    pthread_cond_t slot_cv;
+#ifdef SCHEDULER_LOCK_PROFILE
+    long long locked_ns;
+#endif
+} __attribute__((aligned(64)));
+
+#ifdef SCHEDULER_LOCK_PROFILE
+/* Lock profiling, compiled in with -DSCHEDULER_LOCK_PROFILE. Every shard lock acquisition is
+ * charged to the operation the calling thread is in, and the totals are printed to stderr when the
+ * scheduler is destroyed. Without the flag the wrappers below are plain pthread calls. */
+
+enum LockSite {
+    LOCK_SITE_ADMIT,
+    LOCK_SITE_EXIT,
+    LOCK_SITE_OTHER,
+    NUM_LOCK_SITES,
+};
+
+static const char *const lock_site_names[] = {
+    [LOCK_SITE_ADMIT] = "admit",
+    [LOCK_SITE_EXIT] = "exit",
+    [LOCK_SITE_OTHER] = "other",
+};
+
+struct LockProfile {
+    atomic_ulong acquisitions;
+    atomic_ulong wait_ns;
+    atomic_ulong max_wait_ns;
+    atomic_ulong hold_ns;
+    atomic_ulong max_hold_ns;
+    atomic_ulong requeued_wakeups;
+    atomic_ulong signals;
+};
+
+static _Thread_local enum LockSite lock_site = LOCK_SITE_OTHER;
+
+#define SET_LOCK_SITE(site) (lock_site = (site))
+#else
+#define SET_LOCK_SITE(site) ((void)0)
+#endif
+
+/**
+ * Picks the priority whose waiting vehicles of a home shard are served next. `select` returns that
+ * priority, or -1 if no vehicle is waiting, and sets `kick` when its choice moved to another
+ * priority while there are several shards, since other shards may now admit their waiters.
+ * `admitted` is told of each admission made for the selected priority and returns whether that
+ * priority may go on being served without selecting again. Both are called with the home shard
+ * locked.
+ */
+struct PolicyOps {
+    int (*select)(PriorityScheduler *scheduler, struct Shard *home, bool *kick);
+    bool (*admitted)(PriorityScheduler *scheduler, struct Shard *home, int priority);
+};
+
+/**
+ * A vehicle of a shared scheduler in a tunnel: the process that owns it, and the ticket of its
+ * waiter if a dispatcher admitted it, or zero. The number of owners of a tunnel is the number of
+ * vehicles in it, except while the tunnel's shard is locked.
+ */
+struct Owner {
+    pid_t pid;
+    unsigned long ticket;
+};
+
+/**
+ * A process that opened a shared scheduler. `alive` is a robust mutex held from the moment the
+ * process opens the scheduler until it closes it, so that other processes can tell when it died
+ * without closing it, see `reap_processes`. Entries not in use have a `pid` of zero.
+ */
+struct Process {
+    pid_t pid;
+    pthread_mutex_t alive;
+};
+
+/**
+ * The state a scheduler's admissions and exits change, at the start of the block holding it: its
+ * shards and the arrays behind them follow at the offsets `lay_out` gives them. The block of a
+ * shared scheduler is a POSIX shared memory segment that each process maps wherever it likes, which
+ * is why nothing in the block is a pointer. The header also keeps the dimensions and the policy for
+ * the processes that open it, the ticket of the last queued waiter, and whether a shard was
+ * repaired since processes were last reaped.
+ */
+struct SchedulerState {
+    unsigned int magic;
+    size_t size;
+    int num_tunnels;
+    int num_priorities;
+    int num_shards;
+    int max_waiters;
+    enum SchedulerPolicy policy;
+    int convoy_window;
+    atomic_ulong last_ticket;
+    atomic_bool reap_needed;
+};
+
+/**
+ * Each policy orders the waiters of a home shard exactly, since they are all queued, admitted and
+ * withdrawn under the shard's lock. Between shards it is best effort. The highest priority waiting
+ * in any shard is the largest `highest` of the shards. Under the strict policy every shard checks
+ * it before admitting a vehicle, so that a shard does not admit lower priorities while another
+ * shard has higher ones waiting, but a vehicle arriving in one shard can still race an admission
+ * in another.
+ *
+ * The weighted-fair policy instead serves the priorities that have waiting vehicles in turns,
+ * from the highest down and round again, for up to `shares` of a priority's admissions per turn.
+ * Each shard takes its own turns over its own waiters.
+ *
+ * A PriorityScheduler is a handle on the state block, with the addresses of its parts as mapped in
+ * the calling process. A private scheduler's block is allocated with the handle, its references are
+ * plain addresses and `base` is zero. A shared scheduler has a handle per process: `name` is the
+ * name of its segment, `base` the address the process mapped it at, and its tunnels are the
+ * process's own tunnel objects for the state words in the block. The block of a shared scheduler
+ * also has `max_owners` owners per tunnel, enough for its largest capacity, and the table of the
+ * processes that opened it, with `pid` the calling process's entry. The tunnel maps are always the
+ * process's own, since they only hold the vehicles admitted by the process.
+ *
+ * Arrivals and vehicles that give up are logged to `log`, the log of the first tunnel, which is NULL
+ * when there are no tunnels.
+ *
+ * The histograms count, in nanoseconds, how long vehicles waited from their admission call to
+ * entering a tunnel and how long they then occupied it. There is one per priority and vehicle type,
+ * so that recording a sample touches a single histogram; summaries per priority or per type merge
+ * them when a snapshot is taken.
+ */
+struct PriorityScheduler {
     int num_tunnels;
     struct Tunnel **tunnels;
+    Log *log;
+    int num_shards;
+    struct Shard *shards;
+    int *tunnel_shards;
+    int num_priorities;
+    int convoy_window;
+    const struct PolicyOps *policy;
+    int *shares;
+    struct Histogram (*wait)[NUM_VEHICLE_TYPES];
+    struct Histogram (*occupancy)[NUM_VEHICLE_TYPES];
+    struct SchedulerState *state;
+    uintptr_t base;
+    char *name;
+    int max_waiters;
+    HashMap **tunnel_maps;
+    int *priority_counts;
+    int *deficits;
+    struct WaitQueue *wait_queues;
+    struct IndexEntry *index_entries;
+    atomic_int *snapshot_waiting;
+    atomic_uint *snapshot_tunnels;
+    struct TunnelWord *tunnel_words;
+    struct Waiter *waiters;
+    int max_owners;
+    struct Owner *owners;
+    struct Process *processes;
+    pid_t pid;
+#ifdef SCHEDULER_LOCK_PROFILE
+    struct LockProfile lock_profiles[NUM_LOCK_SITES];
+#endif
+};
+
+/**
+ * @brief Returns the index of the wait queue class for the given vehicle.
+ */
+static int vehicle_class(const struct Vehicle *vehicle) {
+    return vehicle->vehicle_type * NUM_DIRECTIONS + vehicle->direction;
+}
+
+/**
+ * @brief Returns the class of the vehicles in a tunnel with the given occupancy, which must not
+ *        be empty.
+ */
+static int occupancy_class(const struct TunnelOccupancy *occupancy) {
+    return occupancy->vehicle_type * NUM_DIRECTIONS + occupancy->direction;
+}
+
+/**
+ * @brief Returns what the given reference refers to, or NULL for the null reference 0.
+ *
+ * References are offsets from the scheduler's `base`, which is the address its state block is
+ * mapped at if it is shared and zero otherwise. They are plain addresses in a private scheduler,
+ * and mean the same in every process that maps a shared one.
+ */
+static void *scheduler_at(PriorityScheduler *scheduler, uintptr_t ref) {
+    return ref != 0 ? (void *)(scheduler->base + ref) : NULL;
+}
+
+/**
+ * @brief Returns the reference to the given object, or 0 for NULL. See `scheduler_at`.
+ */
+static uintptr_t scheduler_ref(PriorityScheduler *scheduler, const void *object) {
+    return object != NULL ? (uintptr_t)object - scheduler->base : 0;
+}
+
+/**
+ * @brief Returns the vehicle of the given waiter, as the calling process sees it.
+ */
+static struct Vehicle *waiter_vehicle(PriorityScheduler *scheduler, struct Waiter *waiter) {
+    return scheduler_at(scheduler, waiter->vehicle);
+}
+
+/**
+ * @brief Returns the position of the given shard in the scheduler.
+ */
+static int shard_number(PriorityScheduler *scheduler, const struct Shard *shard) {
+    return (int)(shard - scheduler->shards);
+}
+
+/**
+ * @brief Returns the number of vehicles waiting in the given shard at each priority.
+ */
+static int *shard_counts(PriorityScheduler *scheduler, const struct Shard *shard) {
+    return &scheduler->priority_counts[shard_number(scheduler, shard) * scheduler->num_priorities];
+}
+
+/**
+ * @brief Returns the weighted-fair policy's deficit of each priority in the given shard.
+ */
+static int *shard_deficits(PriorityScheduler *scheduler, const struct Shard *shard) {
+    return &scheduler->deficits[shard_number(scheduler, shard) * scheduler->num_priorities];
+}
+
+/**
+ * @brief Returns the snapshot copy of the number of vehicles waiting in the given shard at each
+ *        priority.
+ */
+static atomic_int *shard_snapshot_waiting(PriorityScheduler *scheduler, const struct Shard *shard) {
+    return &scheduler->snapshot_waiting[shard_number(scheduler, shard) * scheduler->num_priorities];
+}
+
+/**
+ * @brief Returns the index entries of the tunnels of the given shard, by position in the shard.
+ */
+static struct IndexEntry *shard_entries(PriorityScheduler *scheduler, const struct Shard *shard) {
+    return &scheduler->index_entries[shard->first_tunnel];
+}
+
+/**
+ * @brief Returns the tunnel at the given position in the given shard.
+ */
+static struct Tunnel *shard_tunnel(PriorityScheduler *scheduler, const struct Shard *shard, int slot) {
+    return scheduler->tunnels[shard->first_tunnel + slot];
+}
+
+/**
+ * @brief Returns the bucket a tunnel with the given index entry and occupancy belongs in.
+ */
+static int tunnel_bucket(const struct IndexEntry *entry, const struct TunnelOccupancy *occupancy) {
+    if (occupancy->num_vehicles == 0) {
+        return EMPTY_BUCKET + 1 + entry->last_class;
+    }
+    if (occupancy->num_vehicles < tunnel_capacities[occupancy->vehicle_type]) {
+        return occupancy_class(occupancy);
+    }
+    return NO_BUCKET;
+}
+
+/**
+ * @brief Moves the given tunnel into the bucket matching its current occupancy.
+ *
+ * Must be called whenever a vehicle enters or leaves the tunnel.
+ *
+ * @param index The tunnel index.
+ * @param entries The index entries of the shard's tunnels.
+ * @param slot The position of the tunnel in its shard.
+ * @param occupancy The tunnel's new occupancy.
+ */
+static void index_update(struct TunnelIndex *index, struct IndexEntry *entries, int slot,
+                         const struct TunnelOccupancy *occupancy) {
+    struct IndexEntry *entry = &entries[slot];
+    int bucket = tunnel_bucket(entry, occupancy);
+    if (bucket == entry->bucket) {
+        return;
+    }
+    if (entry->bucket != NO_BUCKET) {
+        if (entry->prev >= 0) {
+            entries[entry->prev].next = entry->next;
+        } else {
+            index->heads[entry->bucket] = entry->next;
+        }
+        if (entry->next >= 0) {
+            entries[entry->next].prev = entry->prev;
+        }
+    }
+    entry->bucket = bucket;
+    if (bucket != NO_BUCKET) {
+        entry->prev = -1;
+        entry->next = index->heads[bucket];
+        if (index->heads[bucket] >= 0) {
+            entries[index->heads[bucket]].prev = slot;
+        }
+        index->heads[bucket] = slot;
+    }
+}
+
+/**
+ * @brief Builds the tunnel index for the given tunnels.
+ *
+ * @param index The tunnel index to initialize.
+ * @param entries The index entries to initialize, one per tunnel.
+ * @param num_tunnels The number of tunnels.
+ * @param tunnels Array of pointers to tunnels.
+ */
+static void index_init(struct TunnelIndex *index, struct IndexEntry *entries, int num_tunnels,
+                       struct Tunnel **tunnels) {
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        index->heads[b] = -1;
+    }
+    for (int i = num_tunnels - 1; i >= 0; i--) {
+        struct TunnelOccupancy occupancy = tunnel_occupancy(tunnels[i]);
+        entries[i] = (struct IndexEntry){
+            .bucket = NO_BUCKET,
+            .last_class = occupancy.num_vehicles > 0 ? occupancy_class(&occupancy) : -1,
+            .occupants = occupancy.num_vehicles,
+            .peak = occupancy.num_vehicles,
+        };
+        index_update(index, entries, i, &occupancy);
+    }
+}
+
+/**
+ * @brief Finds a tunnel of the given shard the vehicle fits in.
+ *
+ * Partially filled tunnels of the vehicle's class are preferred over empty tunnels so that empty
+ * tunnels stay available for other classes. With convoys, empty tunnels that last held the
+ * vehicle's class are preferred over other empty tunnels, so that the tunnel does not flip.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param shard The shard, with its lock held.
+ * @param vehicle The vehicle to place.
+ * @param convoy Whether to prefer empty tunnels that last held the vehicle's class.
+ * @return A tunnel with room for the vehicle, or NULL if there is none.
+ */
+static struct Tunnel *index_find(PriorityScheduler *scheduler, struct Shard *shard, const struct Vehicle *vehicle,
+                                 bool convoy) {
+    int slot = shard->index.heads[vehicle_class(vehicle)];
+    if (slot < 0 && convoy) {
+        slot = shard->index.heads[EMPTY_BUCKET + 1 + vehicle_class(vehicle)];
+    }
+    for (int b = EMPTY_BUCKET; slot < 0 && b < NUM_BUCKETS; b++) {
+        slot = shard->index.heads[b];
+    }
+    return slot >= 0 ? shard_tunnel(scheduler, shard, slot) : NULL;
+}
+
+/**
+ * @brief Starts a change of the snapshot copies of the given shard, whose lock must be held.
+ */
+static void snapshot_begin(struct Shard *shard) {
+    unsigned int seq = atomic_load_explicit(&shard->snapshot_seq, memory_order_relaxed);
+    atomic_store_explicit(&shard->snapshot_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * @brief Ends a change of the snapshot copies started by `snapshot_begin`.
+ */
+static void snapshot_end(struct Shard *shard) {
+    unsigned int seq = atomic_load_explicit(&shard->snapshot_seq, memory_order_relaxed);
+    atomic_store_explicit(&shard->snapshot_seq, seq + 1, memory_order_release);
+}
+
+/**
+ * @brief Copies the number of vehicles and the class of a tunnel for snapshots.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param shard The shard owning the tunnel, with its lock held.
+ * @param id The id of the tunnel.
+ * @param num_vehicles The number of vehicles in the tunnel.
+ * @param class The class of the vehicles, which is only meaningful if there are any.
+ */
+static void snapshot_tunnel(PriorityScheduler *scheduler, struct Shard *shard, int id, int num_vehicles,
+                            int class) {
+    snapshot_begin(shard);
+    atomic_store_explicit(&scheduler->snapshot_tunnels[id], (unsigned int)num_vehicles << 8 | (class & 0xff),
+                          memory_order_relaxed);
+    snapshot_end(shard);
+}
+
+/**
+ * @brief Updates the index entry of a tunnel of the given shard and whether the shard has room.
+ *
+ * Also counts a flip when the tunnel stops being empty with a class other than the one it last
+ * held, and a convoy with its largest number of vehicles when the tunnel becomes empty again.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param shard The shard owning the tunnel, with its lock held.
+ * @param tunnel The tunnel whose occupancy changed.
+ */
+static void shard_update(PriorityScheduler *scheduler, struct Shard *shard, const struct Tunnel *tunnel) {
+    struct IndexEntry *entries = shard_entries(scheduler, shard);
+    int slot = tunnel->id - shard->first_tunnel;
+    struct IndexEntry *entry = &entries[slot];
+    struct TunnelOccupancy occupancy = tunnel_occupancy(tunnel);
+    if (entry->occupants == 0 && occupancy.num_vehicles > 0) {
+        int class = occupancy_class(&occupancy);
+        if (entry->last_class >= 0 && entry->last_class != class) {
+            shard->counters.tunnel_flips++;
+        }
+        entry->last_class = class;
+        entry->peak = 0;
+    }
+    if (occupancy.num_vehicles > entry->peak) {
+        entry->peak = occupancy.num_vehicles;
+    }
+    if (entry->occupants > 0 && occupancy.num_vehicles == 0) {
+        shard->counters.convoys++;
+        shard->counters.convoy_vehicles += entry->peak;
+        shard->counters.convoy_capacity += tunnel_capacities[entry->last_class / NUM_DIRECTIONS];
+    }
+    if (entry->occupants != occupancy.num_vehicles) {
+        snapshot_tunnel(scheduler, shard, tunnel->id, occupancy.num_vehicles, entry->last_class);
+    }
+    entry->occupants = occupancy.num_vehicles;
+    index_update(&shard->index, entries, slot, &occupancy);
+    bool has_room = false;
+    for (int b = 0; b < NUM_BUCKETS && !has_room; b++) {
+        has_room = shard->index.heads[b] >= 0;
+    }
+    atomic_store(&shard->has_room, has_room);
+}
+
+/**
+ * @brief Marks the given priority as having waiting vehicles.
+ */
+static void bitmap_set(struct PriorityBitmap *bitmap, int priority) {
+    bitmap->words[priority >> 6] |= 1ULL << (priority & 63);
+    bitmap->summary |= 1ULL << (priority >> 6);
+}
+
+/**
+ * @brief Marks the given priority as having no waiting vehicles.
+ */
+static void bitmap_clear(struct PriorityBitmap *bitmap, int priority) {
+    bitmap->words[priority >> 6] &= ~(1ULL << (priority & 63));
+    if (bitmap->words[priority >> 6] == 0) {
+        bitmap->summary &= ~(1ULL << (priority >> 6));
+    }
+}
+
+/**
+ * @brief Returns the highest priority marked in the bitmap, or -1 if there is none.
+ */
+static int bitmap_highest(const struct PriorityBitmap *bitmap) {
+    if (bitmap->summary == 0) {
+        return -1;
+    }
+    int word = 63 - __builtin_clzll(bitmap->summary);
+    return word * 64 + 63 - __builtin_clzll(bitmap->words[word]);
+}
+
+/**
+ * @brief Returns the wait queue of the given shard for a priority and class.
+ */
+static struct WaitQueue *wait_queue(PriorityScheduler *scheduler, const struct Shard *shard, int priority,
+                                    int class) {
+    return &scheduler->wait_queues[(shard_number(scheduler, shard) * scheduler->num_priorities + priority)
+                                   * NUM_CLASSES + class];
+}
+
+/**
+ * @brief Returns where a part of the given size starts in a block, at the first cache line from
+ *        `offset` on, and moves `offset` past it.
+ */
+static void *lay_out_part(uintptr_t block, size_t *offset, size_t size) {
+    *offset = (*offset + 63) & ~(size_t)63;
+    void *part = (void *)(block + *offset);
+    *offset += size;
+    return part;
+}
+
+/**
+ * @brief Points the scheduler at the parts of its state block.
+ *
+ * Where the parts go only depends on the scheduler's dimensions, so every process that maps a
+ * shared block finds them at the same offsets. Only a shared block holds the tunnels' state words
+ * and owners, the shards' waiter slots and the process table.
+ *
+ * @param scheduler The PriorityScheduler, with its dimensions and name set.
+ * @param block The address of the block, or zero to only compute its size.
+ * @return The size of the block.
+ */
+static size_t lay_out(PriorityScheduler *scheduler, uintptr_t block) {
+    size_t num_shards = scheduler->num_shards;
+    size_t num_levels = num_shards * scheduler->num_priorities;
+    size_t num_tunnels = scheduler->num_tunnels;
+    size_t num_shared = scheduler->name != NULL ? 1 : 0;
+    size_t offset = 0;
+    scheduler->state = lay_out_part(block, &offset, sizeof *scheduler->state);
+    scheduler->shards = lay_out_part(block, &offset, num_shards * sizeof *scheduler->shards);
+    scheduler->priority_counts = lay_out_part(block, &offset, num_levels * sizeof *scheduler->priority_counts);
+    scheduler->deficits = lay_out_part(block, &offset, num_levels * sizeof *scheduler->deficits);
+    scheduler->shares = lay_out_part(block, &offset, scheduler->num_priorities * sizeof *scheduler->shares);
+    scheduler->wait_queues = lay_out_part(block, &offset, num_levels * NUM_CLASSES * sizeof *scheduler->wait_queues);
+    scheduler->index_entries = lay_out_part(block, &offset, num_tunnels * sizeof *scheduler->index_entries);
+    scheduler->snapshot_waiting = lay_out_part(block, &offset, num_levels * sizeof *scheduler->snapshot_waiting);
+    scheduler->snapshot_tunnels = lay_out_part(block, &offset, num_tunnels * sizeof *scheduler->snapshot_tunnels);
+    scheduler->tunnel_words = lay_out_part(block, &offset,
+                                           num_shared * num_tunnels * sizeof *scheduler->tunnel_words);
+    scheduler->waiters = lay_out_part(block, &offset,
+                                      num_shared * num_shards * scheduler->max_waiters * sizeof *scheduler->waiters);
+    scheduler->owners = lay_out_part(block, &offset,
+                                     num_shared * num_tunnels * scheduler->max_owners * sizeof *scheduler->owners);
+    scheduler->processes = lay_out_part(block, &offset, num_shared * MAX_PROCESSES * sizeof *scheduler->processes);
+    return (offset + 63) & ~(size_t)63;
+}
+
+/**
+ * @brief Allocates a scheduler handle with the given dimensions, clamped as `scheduler_create`
+ *        describes.
+ */
+static PriorityScheduler *scheduler_alloc(int num_tunnels, int num_priorities, int num_shards) {
+    PriorityScheduler *scheduler = calloc(1, sizeof(PriorityScheduler));
+    if (!scheduler) {
+        perror("scheduler_create: calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    if (num_shards > num_tunnels) {
+        num_shards = num_tunnels;
+    }
+    if (num_shards < 1) {
+        num_shards = 1;
+    }
+    if (num_priorities > SCHEDULER_MAX_PRIORITIES) {
+        num_priorities = SCHEDULER_MAX_PRIORITIES;
+    }
+    if (num_priorities < 1) {
+        num_priorities = 1;
+    }
+    scheduler->num_tunnels = num_tunnels;
+    scheduler->num_shards = num_shards;
+    scheduler->num_priorities = num_priorities;
+    for (int t = 0; t < NUM_VEHICLE_TYPES; t++) {
+        if (tunnel_capacities[t] > scheduler->max_owners) {
+            scheduler->max_owners = tunnel_capacities[t];
+        }
+    }
+    return scheduler;
+}
+
+/**
+ * @brief Initializes a condition variable of a shared scheduler, which works across processes and
+ *        waits on the monotonic clock.
+ */
+static void init_shared_cond(pthread_cond_t *cv) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(cv, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * @brief Fills in a zeroed state block for the scheduler's tunnels.
+ *
+ * Gives each shard its slice of the tunnels, empty wait queues and, if the scheduler is shared,
+ * its free waiter slots. The locks and condition variables of a shared scheduler work across
+ * processes, and its locks are robust.
+ *
+ * @param scheduler The PriorityScheduler, laid out over the block and with its tunnels set.
+ * @param size The size of the block.
+ */
+static void init_state(PriorityScheduler *scheduler, size_t size) {
+    bool shared = scheduler->name != NULL;
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    if (shared) {
+        pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    }
+    *scheduler->state = (struct SchedulerState){
+        .size = size,
+        .num_tunnels = scheduler->num_tunnels,
+        .num_priorities = scheduler->num_priorities,
+        .num_shards = scheduler->num_shards,
+        .max_waiters = scheduler->max_waiters,
+    };
+
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        *shard = (struct Shard){ .convoy_class = -1, .turn = -1 };
+        pthread_mutex_init(&shard->lock, &mutex_attr);
+        atomic_init(&shard->highest, -1);
+        shard->first_tunnel = (int)((long)k * scheduler->num_tunnels / scheduler->num_shards);
+        shard->num_tunnels = (int)((long)(k + 1) * scheduler->num_tunnels / scheduler->num_shards)
+                             - shard->first_tunnel;
+        struct IndexEntry *entries = shard_entries(scheduler, shard);
+        index_init(&shard->index, entries, shard->num_tunnels, &scheduler->tunnels[shard->first_tunnel]);
+        atomic_init(&shard->has_room, shard->num_tunnels > 0);
+        atomic_init(&shard->snapshot_seq, 0);
+        for (int p = 0; p < scheduler->num_priorities; p++) {
+            atomic_init(&scheduler->snapshot_waiting[k * scheduler->num_priorities + p], 0);
+        }
+        for (int i = 0; i < shard->num_tunnels; i++) {
+            atomic_init(&scheduler->snapshot_tunnels[shard->first_tunnel + i],
+                        (unsigned int)entries[i].occupants << 8 | (entries[i].last_class & 0xff));
+        }
+
+        // Chain the shard's waiter slots, first slot first
+        if (shared) {
+            init_shared_cond(&shard->slot_cv);
+            for (int w = scheduler->max_waiters - 1; w >= 0; w--) {
+                struct Waiter *slot = &scheduler->waiters[k * scheduler->max_waiters + w];
+                init_shared_cond(&slot->cv);
+                slot->next = shard->free_waiters;
+                shard->free_waiters = scheduler_ref(scheduler, slot);
+            }
+        }
+    }
+    for (int i = 0; shared && i < MAX_PROCESSES; i++) {
+        pthread_mutex_init(&scheduler->processes[i].alive, &mutex_attr);
+    }
+    pthread_mutexattr_destroy(&mutex_attr);
+}
+
+/**
+ * @brief Sets up the parts of a scheduler handle that are the calling process's own: which shard
+ *        each tunnel is in, the tunnel maps and the histograms.
+ *
+ * @param scheduler The PriorityScheduler, laid out over an initialized block and with its tunnels set.
+ */
+static void init_handle(PriorityScheduler *scheduler) {
+    scheduler->log = scheduler->num_tunnels > 0 ? scheduler->tunnels[0]->log : NULL;
+    scheduler->convoy_window = scheduler->state->convoy_window;
+    scheduler->tunnel_shards = malloc((scheduler->num_tunnels + 1) * sizeof *scheduler->tunnel_shards);
+    scheduler->tunnel_maps = malloc(scheduler->num_shards * sizeof *scheduler->tunnel_maps);
+    scheduler->wait = calloc(scheduler->num_priorities, sizeof *scheduler->wait);
+    scheduler->occupancy = calloc(scheduler->num_priorities, sizeof *scheduler->occupancy);
+    if (!scheduler->tunnel_shards || !scheduler->tunnel_maps || !scheduler->wait || !scheduler->occupancy) {
+        perror("scheduler_create: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        for (int i = 0; i < shard->num_tunnels; i++) {
+            scheduler->tunnel_shards[shard->first_tunnel + i] = k;
+        }
+
+        // Create the hashmap
+        scheduler->tunnel_maps[k] = hashmap_create(vehicle_hash);
+        if (!scheduler->tunnel_maps[k]) {
+            perror("scheduler_create: hashmap_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * @brief Creates a PriorityScheduler with the given number of tunnels.
+ *
+ * @param num_tunnels The number of tunnels.
+ * @param tunnels Array of pointers to tunnels.
+ * @param num_priorities The number of priority levels, clamped between 1 and
+ *                       SCHEDULER_MAX_PRIORITIES. Vehicle priorities must be below it.
+ * @return Pointer to the created PriorityScheduler.
+ */
+PriorityScheduler *scheduler_create(int num_tunnels, struct Tunnel **tunnels, int num_priorities) {
+    return scheduler_create_sharded(num_tunnels, tunnels, num_priorities, 1);
+}
+
+/**
+ * @brief Creates a PriorityScheduler whose tunnels are split between independently locked shards.
+ *
+ * Each shard owns a contiguous slice of the tunnels. A vehicle is queued in the shard picked by its
+ * id and takes room from the other shards when its own is full, so admissions and exits in
+ * different shards only contend when tunnels run short. Tunnel ids must be their positions in the
+ * tunnels array, as set up by `tunnels_create`.
+ *
+ * @param num_tunnels The number of tunnels.
+ * @param tunnels Array of pointers to tunnels.
+ * @param num_priorities The number of priority levels, see `scheduler_create`.
+ * @param num_shards The number of shards, clamped between 1 and the number of tunnels.
+ * @return Pointer to the created PriorityScheduler.
+ */
+PriorityScheduler *scheduler_create_sharded(int num_tunnels, struct Tunnel **tunnels, int num_priorities,
+                                            int num_shards) {
+    PriorityScheduler *scheduler = scheduler_alloc(num_tunnels, num_priorities, num_shards);
+    scheduler->tunnels = tunnels;
+    size_t size = lay_out(scheduler, 0);
+    void *block = aligned_alloc(64, size);
+    if (!block) {
+        perror("scheduler_create: aligned_alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(block, 0, size);
+    lay_out(scheduler, (uintptr_t)block);
+    init_state(scheduler, size);
+    init_handle(scheduler);
+    scheduler_set_policy(scheduler, SCHEDULER_POLICY_STRICT, NULL);
+
+    return scheduler;
+}
+
+#ifdef SCHEDULER_LOCK_PROFILE
+/**
+ * @brief Prints the lock profile of each lock site to stderr.
+ */
+static void print_lock_profile(PriorityScheduler *scheduler) {
+    fprintf(stderr, "scheduler lock profile (%d shards)\n"
+            "site   acquisitions  mean_wait_ns   max_wait_ns  mean_hold_ns   max_hold_ns  requeued_wakeups"
+            "       signals\n", scheduler->num_shards);
+    for (int site = 0; site < NUM_LOCK_SITES; site++) {
+        struct LockProfile *profile = &scheduler->lock_profiles[site];
+        unsigned long acquisitions = atomic_load(&profile->acquisitions);
+        fprintf(stderr, "%-6s %12lu %13.1f %13lu %13.1f %13lu %17lu %13lu\n", lock_site_names[site], acquisitions,
+                acquisitions ? (double)atomic_load(&profile->wait_ns) / acquisitions : 0.0,
+                atomic_load(&profile->max_wait_ns),
+                acquisitions ? (double)atomic_load(&profile->hold_ns) / acquisitions : 0.0,
+                atomic_load(&profile->max_hold_ns), atomic_load(&profile->requeued_wakeups),
+                atomic_load(&profile->signals));
+    }
+}
+#endif
+
+/**
+ * @brief Groups waiting vehicles of the same priority into convoys of the same type and direction.
+ *
+ * When room frees up, waiters that can fill a partially filled tunnel or keep an empty tunnel at
+ * the type and direction it last held are admitted before other waiters of the same priority, and
+ * the class admitted last stays first for up to `window` admissions in a row. Priorities are still
+ * served strictly in order. Must be called before the scheduler is used, and for a shared
+ * scheduler before other processes open it, which then keep the same window.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param window The most admissions in a row a convoy keeps its place, or 0 for the default
+ *               fixed order of classes.
+ */
+void scheduler_set_convoy_window(PriorityScheduler *scheduler, int window) {
+    scheduler->convoy_window = window > 0 ? window : 0;
+    scheduler->state->convoy_window = scheduler->convoy_window;
+}
+
+/**
+ * @brief Returns the number of priority levels of the scheduler.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @return The number of levels; vehicle priorities run from 0 up to one less than it.
+ */
+int scheduler_num_priorities(PriorityScheduler *scheduler) {
+    return scheduler->num_priorities;
+}
+
+/**
+ * @brief Returns the number of tunnels of the scheduler.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @return The number of tunnels; a scheduler without any admits no vehicle.
+ */
+int scheduler_num_tunnels(PriorityScheduler *scheduler) {
+    return scheduler->num_tunnels;
+}
+
+/**
+ * @brief Frees what the calling process's handle on a scheduler holds, and unmaps or frees the
+ *        scheduler's state block.
+ */
+static void release_handle(PriorityScheduler *scheduler) {
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        hashmap_destroy(scheduler->tunnel_maps[k]);
+    }
+    free(scheduler->tunnel_maps);
+    free(scheduler->wait);
+    free(scheduler->occupancy);
+    free(scheduler->tunnel_shards);
+    if (scheduler->name != NULL) {
+        tunnels_destroy(scheduler->tunnels);
+        munmap(scheduler->state, scheduler->state->size);
+        free(scheduler->name);
+    } else {
+        free(scheduler->state);
+    }
+    free(scheduler);
+}
+
+/**
+ * @brief Frees the memory associated with the PriorityScheduler.
+ *
+ * A shared scheduler is also removed, see `scheduler_create_shared`. That must happen once, in a
+ * single process, after every other process has closed it.
+ *
+ * @param scheduler The PriorityScheduler to destroy.
+ */
+void scheduler_destroy(PriorityScheduler *scheduler) {
+#ifdef SCHEDULER_LOCK_PROFILE
+    print_lock_profile(scheduler);
+#endif
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        pthread_mutex_destroy(&shard->lock);
+    }
+    // The condition variables of a shared scheduler are left as they are: a process that died
+    // waiting on one would make destroying it block, and the segment goes away with them anyway
+    for (int i = 0; scheduler->name != NULL && i < MAX_PROCESSES; i++) {
+        struct Process *process = &scheduler->processes[i];
+        if (process->pid == scheduler->pid) {
+            pthread_mutex_unlock(&process->alive);
+        }
+        pthread_mutex_destroy(&process->alive);
+    }
+    if (scheduler->name != NULL) {
+        shm_unlink(scheduler->name);
+    }
+    release_handle(scheduler);
+}
+
+/**
+ * @brief Fills in wait and occupancy summaries per priority and per vehicle type.
+ *
+ * The histograms are read without taking any lock, so admissions and exits carry on meanwhile.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param stats Where to store the summaries.
+ */
+void scheduler_stats(PriorityScheduler *scheduler, struct SchedulerStats *stats) {
+    stats->num_priorities = scheduler->num_priorities;
+    static struct Histogram zero;
+    struct Histogram *by_type = malloc(2 * NUM_VEHICLE_TYPES * sizeof *by_type);
+    struct Histogram *total = malloc(sizeof *total);
+    if (!by_type || !total) {
+        perror("scheduler_stats: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < 2 * NUM_VEHICLE_TYPES; t++) {
+        by_type[t] = zero;
+    }
+    for (int p = 0; p < scheduler->num_priorities; p++) {
+        *total = zero;
+        for (int t = 0; t < NUM_VEHICLE_TYPES; t++) {
+            histogram_add(total, &scheduler->wait[p][t]);
+            histogram_add(&by_type[t], &scheduler->wait[p][t]);
+        }
+        histogram_summarize(total, &stats->wait[p]);
+        *total = zero;
+        for (int t = 0; t < NUM_VEHICLE_TYPES; t++) {
+            histogram_add(total, &scheduler->occupancy[p][t]);
+            histogram_add(&by_type[NUM_VEHICLE_TYPES + t], &scheduler->occupancy[p][t]);
+        }
+        histogram_summarize(total, &stats->occupancy[p]);
+    }
+    for (int t = 0; t < NUM_VEHICLE_TYPES; t++) {
+        histogram_summarize(&by_type[t], &stats->wait_by_type[t]);
+        histogram_summarize(&by_type[NUM_VEHICLE_TYPES + t], &stats->occupancy_by_type[t]);
+    }
+    free(by_type);
+    free(total);
+}
+
+/**
+ * @brief Returns the monotonic time in nanoseconds that wait and occupancy times are measured in.
+ */
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Records how long the given vehicle waited, now that it has entered a tunnel.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle that entered a tunnel.
+ * @param waited Whether the vehicle had to wait. Vehicles admitted within their admission call
+ *               reuse its arrival time instead of reading the clock again and record a wait
+ *               of zero.
+ */
+static void record_entry(PriorityScheduler *scheduler, struct Vehicle *vehicle, bool waited) {
+    vehicle->entry_ns = waited ? now_ns() : vehicle->arrival_ns;
+    histogram_record(&scheduler->wait[vehicle->priority][vehicle->vehicle_type],
+                     vehicle->entry_ns - vehicle->arrival_ns);
+}
+
+/**
+ * @brief Records how long the given vehicle occupied its tunnel, given the time it left.
+ */
+static void record_exit(PriorityScheduler *scheduler, const struct Vehicle *vehicle, long long exit_ns) {
+    histogram_record(&scheduler->occupancy[vehicle->priority][vehicle->vehicle_type],
+                     exit_ns - vehicle->entry_ns);
+}
+
+/**
+ * @brief Returns the home shard of the given vehicle.
+ */
+static struct Shard *vehicle_shard(PriorityScheduler *scheduler, const struct Vehicle *vehicle) {
+    return &scheduler->shards[(unsigned int)vehicle->id % scheduler->num_shards];
+}
+
+#ifdef SCHEDULER_LOCK_PROFILE
+/**
+ * @brief Raises a profile maximum to the given value.
+ */
+static void profile_max(atomic_ulong *max, unsigned long value) {
+    unsigned long current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(max, &current, value,
+                                                                     memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Charges the time since the shard was locked to the current lock site.
+ */
+static void profile_release(PriorityScheduler *scheduler, struct Shard *shard) {
+    struct LockProfile *profile = &scheduler->lock_profiles[lock_site];
+    unsigned long hold = now_ns() - shard->locked_ns;
+    atomic_fetch_add_explicit(&profile->hold_ns, hold, memory_order_relaxed);
+    profile_max(&profile->max_hold_ns, hold);
+}
+#endif
+
+/**
+ * @brief Returns the owners of the tunnel with the given id of a shared scheduler.
+ */
+static struct Owner *tunnel_owners(PriorityScheduler *scheduler, int id) {
+    return &scheduler->owners[id * scheduler->max_owners];
+}
+
+/**
+ * @brief Returns the number of owners of the tunnel with the given id of a shared scheduler.
+ */
+static int count_owners(PriorityScheduler *scheduler, int id) {
+    struct Owner *owners = tunnel_owners(scheduler, id);
+    int count = 0;
+    for (int i = 0; i < scheduler->max_owners; i++) {
+        count += owners[i].pid != 0;
+    }
+    return count;
+}
+
+/**
+ * @brief Records that a vehicle of the given process entered the tunnel with the given id.
+ *
+ * @param scheduler The shared PriorityScheduler.
+ * @param id The id of the tunnel, whose shard is locked.
+ * @param pid The process of the vehicle.
+ * @param ticket The ticket of the vehicle's waiter if it waited, or zero.
+ */
+static void add_owner(PriorityScheduler *scheduler, int id, pid_t pid, unsigned long ticket) {
+    struct Owner *owners = tunnel_owners(scheduler, id);
+    for (int i = 0; i < scheduler->max_owners; i++) {
+        if (owners[i].pid == 0) {
+            owners[i] = (struct Owner){ .pid = pid, .ticket = ticket };
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Drops an owner of the tunnel with the given id that is the given process.
+ */
+static void drop_owner(PriorityScheduler *scheduler, int id, pid_t pid) {
+    struct Owner *owners = tunnel_owners(scheduler, id);
+    for (int i = 0; i < scheduler->max_owners; i++) {
+        if (owners[i].pid == pid) {
+            owners[i] = (struct Owner){ 0 };
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Orders waiter slots by the tickets they were queued with.
+ */
+static int compare_tickets(const void *a, const void *b) {
+    const struct Waiter *x = *(struct Waiter *const *)a;
+    const struct Waiter *y = *(struct Waiter *const *)b;
+    return (x->ticket > y->ticket) - (x->ticket < y->ticket);
+}
+
+/**
+ * @brief Rebuilds what a shard of a shared scheduler derives from its waiter slots and from the
+ *        owners of its tunnels.
+ *
+ * For when a process may have died while changing the shard. The queued slots are queued again in
+ * ticket order and the free ones chained again; a slot that a dispatcher gave a tunnel before it
+ * could take the slot out of its queue counts as admitted. The priority counts and everything that
+ * mirrors them are counted again, and the weighted-fair turn starts over. Each tunnel keeps as many
+ * vehicles as it has owners, and the index and its snapshot copies are rebuilt from the tunnels.
+ *
+ * @param scheduler The shared PriorityScheduler.
+ * @param shard The shard, with its lock held.
+ */
+static void repair_shard(PriorityScheduler *scheduler, struct Shard *shard) {
+    int k = shard_number(scheduler, shard);
+    int *counts = shard_counts(scheduler, shard);
+    struct Waiter **queued = malloc(scheduler->max_waiters * sizeof *queued);
+    if (!queued) {
+        perror("repair_shard: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    int num_queued = 0;
+    shard->free_waiters = 0;
+    for (int w = scheduler->max_waiters - 1; w >= 0; w--) {
+        struct Waiter *slot = &scheduler->waiters[k * scheduler->max_waiters + w];
+        if (slot->slot_state == SLOT_QUEUED && slot->tunnel >= 0) {
+            slot->slot_state = SLOT_HELD;
+        }
+        if (slot->slot_state == SLOT_FREE) {
+            slot->next = shard->free_waiters;
+            shard->free_waiters = scheduler_ref(scheduler, slot);
+        } else if (slot->slot_state == SLOT_QUEUED) {
+            queued[num_queued++] = slot;
+        }
+    }
+    qsort(queued, num_queued, sizeof *queued, compare_tickets);
+
+    // Queue the waiters again and count them
+    for (int p = 0; p < scheduler->num_priorities; p++) {
+        counts[p] = 0;
+        shard_deficits(scheduler, shard)[p] = 0;
+        for (int c = 0; c < NUM_CLASSES; c++) {
+            *wait_queue(scheduler, shard, p, c) = (struct WaitQueue){ 0 };
+        }
+    }
+    shard->priorities = (struct PriorityBitmap){ 0 };
+    for (int i = 0; i < num_queued; i++) {
+        struct Waiter *slot = queued[i];
+        struct Vehicle *vehicle = waiter_vehicle(scheduler, slot);
+        struct WaitQueue *queue = wait_queue(scheduler, shard, vehicle->priority, vehicle_class(vehicle));
+        uintptr_t ref = scheduler_ref(scheduler, slot);
+        slot->prev = queue->tail;
+        slot->next = 0;
+        if (queue->tail != 0) {
+            ((struct Waiter *)scheduler_at(scheduler, queue->tail))->next = ref;
+        } else {
+            queue->head = ref;
+        }
+        queue->tail = ref;
+        queue->length++;
+        counts[vehicle->priority]++;
+        bitmap_set(&shard->priorities, vehicle->priority);
+    }
+    free(queued);
+    shard->turn = -1;
+    atomic_store(&shard->highest, bitmap_highest(&shard->priorities));
+    atomic_store(&shard->num_waiting, num_queued);
+    snapshot_begin(shard);
+    for (int p = 0; p < scheduler->num_priorities; p++) {
+        atomic_store_explicit(&shard_snapshot_waiting(scheduler, shard)[p], counts[p], memory_order_relaxed);
+    }
+    snapshot_end(shard);
+
+    // Take the vehicles without an owner out of the tunnels and index the tunnels again
+    for (int i = 0; i < shard->num_tunnels; i++) {
+        struct Tunnel *tunnel = shard_tunnel(scheduler, shard, i);
+        int extra = tunnel_occupancy(tunnel).num_vehicles - count_owners(scheduler, tunnel->id);
+        if (extra > 0) {
+            tunnel_evict(tunnel, extra);
+        }
+    }
+    struct IndexEntry *entries = shard_entries(scheduler, shard);
+    index_init(&shard->index, entries, shard->num_tunnels, &scheduler->tunnels[shard->first_tunnel]);
+    bool has_room = false;
+    for (int i = 0; i < shard->num_tunnels; i++) {
+        snapshot_tunnel(scheduler, shard, shard->first_tunnel + i, entries[i].occupants, entries[i].last_class);
+        has_room = has_room || entries[i].bucket != NO_BUCKET;
+    }
+    atomic_store(&shard->has_room, has_room);
+    pthread_cond_broadcast(&shard->slot_cv);
+}
+
+/**
+ * @brief Makes the lock of a shard of a shared scheduler consistent again after a process died
+ *        holding it, and repairs the shard.
+ *
+ * Whatever else the dead process held is reclaimed by the next `reap_processes`.
+ *
+ * @param scheduler The shared PriorityScheduler.
+ * @param shard The shard, whose lock the caller was just given with EOWNERDEAD.
+ */
+static void recover_shard(PriorityScheduler *scheduler, struct Shard *shard) {
+    pthread_mutex_consistent(&shard->lock);
+    repair_shard(scheduler, shard);
+    atomic_store(&scheduler->state->reap_needed, true);
+}
+
+/**
+ * @brief Locks the given shard, repairing it if it was left locked by a process that died.
+ */
+static void shard_lock(PriorityScheduler *scheduler, struct Shard *shard) {
+#ifdef SCHEDULER_LOCK_PROFILE
+    struct LockProfile *profile = &scheduler->lock_profiles[lock_site];
+    long long start = now_ns();
+    int result = pthread_mutex_lock(&shard->lock);
+    shard->locked_ns = now_ns();
+    atomic_fetch_add_explicit(&profile->acquisitions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&profile->wait_ns, shard->locked_ns - start, memory_order_relaxed);
+    profile_max(&profile->max_wait_ns, shard->locked_ns - start);
+#else
+    int result = pthread_mutex_lock(&shard->lock);
+#endif
+    if (result == EOWNERDEAD) {
+        recover_shard(scheduler, shard);
+    }
+}
+
+/**
+ * @brief Unlocks the given shard.
+ */
+static void shard_unlock(PriorityScheduler *scheduler, struct Shard *shard) {
+#ifdef SCHEDULER_LOCK_PROFILE
+    profile_release(scheduler, shard);
+#else
+    (void)scheduler;
+#endif
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Waits on a condition variable with the given shard locked, repairing the shard if the
+ *        lock was left locked by a process that died meanwhile.
+ */
+static void shard_wait(PriorityScheduler *scheduler, struct Shard *shard, pthread_cond_t *cv) {
+#ifdef SCHEDULER_LOCK_PROFILE
+    profile_release(scheduler, shard);
+    int result = pthread_cond_wait(cv, &shard->lock);
+    shard->locked_ns = now_ns();
+#else
+    int result = pthread_cond_wait(cv, &shard->lock);
+#endif
+    if (result == EOWNERDEAD) {
+        recover_shard(scheduler, shard);
+    }
+}
+
+/**
+ * @brief Waits on a condition variable with the given shard locked, until an absolute monotonic
+ *        time if one is given.
+ *
+ * @return Zero, or ETIMEDOUT once the deadline has passed.
+ */
+static int shard_timedwait(PriorityScheduler *scheduler, struct Shard *shard, pthread_cond_t *cv,
+                           const struct timespec *deadline) {
+    if (deadline == NULL) {
+        shard_wait(scheduler, shard, cv);
+        return 0;
+    }
+#ifdef SCHEDULER_LOCK_PROFILE
+    profile_release(scheduler, shard);
+    int result = pthread_cond_timedwait(cv, &shard->lock, deadline);
+    shard->locked_ns = now_ns();
+#else
+    int result = pthread_cond_timedwait(cv, &shard->lock, deadline);
+#endif
+    if (result == EOWNERDEAD) {
+        recover_shard(scheduler, shard);
+        return 0;
+    }
+    return result;
+}
+
+/**
+ * @brief Locks two shards, lower index first so that threads locking pairs cannot deadlock.
+ */
+static void lock_pair(PriorityScheduler *scheduler, struct Shard *a, struct Shard *b) {
+    if (a == b) {
+        shard_lock(scheduler, a);
+    } else if (a < b) {
+        shard_lock(scheduler, a);
+        shard_lock(scheduler, b);
+    } else {
+        shard_lock(scheduler, b);
+        shard_lock(scheduler, a);
+    }
+}
+
+/**
+ * @brief Unlocks two shards locked by `lock_pair`.
+ */
+static void unlock_pair(PriorityScheduler *scheduler, struct Shard *a, struct Shard *b) {
+    shard_unlock(scheduler, a);
+    if (a != b) {
+        shard_unlock(scheduler, b);
+    }
+}
+
+/**
+ * @brief Copies the scheduler's counters, summed over its shards.
+ *
+ * A convoy is a tunnel's stretch from taking its first vehicle to being empty again, and a flip a
+ * convoy of another class than the tunnel's previous one. The average fill of the tunnels is
+ * `convoy_vehicles / convoy_capacity`, the most vehicles each convoy held against its capacity.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param counters Where to store the counters.
+ */
+void scheduler_get_counters(PriorityScheduler *scheduler, struct SchedulerCounters *counters) {
+    SET_LOCK_SITE(LOCK_SITE_OTHER);
+    *counters = (struct SchedulerCounters){ 0 };
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        shard_lock(scheduler, shard);
+        counters->admissions += shard->counters.admissions;
+        counters->wakeups += shard->counters.wakeups;
+        counters->tunnel_flips += shard->counters.tunnel_flips;
+        counters->convoys += shard->counters.convoys;
+        counters->convoy_vehicles += shard->counters.convoy_vehicles;
+        counters->convoy_capacity += shard->counters.convoy_capacity;
+        shard_unlock(scheduler, shard);
+    }
+}
+
+/**
+ * @brief Copies the occupancy of every tunnel and the number of vehicles waiting at each priority,
+ *        without taking any lock.
+ *
+ * Each shard's tunnels and waiting counts are copied as they were at a single moment, retrying the
+ * copy whenever the shard changed during it, so admissions and exits never wait for a reader. With
+ * several shards, different shards may be copied at slightly different moments. Occupancy is as the
+ * scheduler's tunnel index sees it, so a vehicle that has just left a tunnel still counts until its
+ * exit has handed the room on.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param snapshot Where to store the copy. Its `tunnels` must point to room for the occupancy of
+ *                 every tunnel of the scheduler, in tunnel id order.
+ * @return The number of times a shard was copied again because it changed during the copy.
+ */
+int scheduler_snapshot(PriorityScheduler *scheduler, struct SchedulerSnapshot *snapshot) {
+    int retries = 0;
+    int waiting[SCHEDULER_MAX_PRIORITIES];
+    snapshot->num_tunnels = scheduler->num_tunnels;
+    snapshot->num_priorities = scheduler->num_priorities;
+    for (int p = 0; p < scheduler->num_priorities; p++) {
+        snapshot->waiting[p] = 0;
+    }
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        for (;;) {
+            unsigned int seq = atomic_load_explicit(&shard->snapshot_seq, memory_order_acquire);
+            if (seq & 1) {
+                retries++;
+                continue;
+            }
+            for (int p = 0; p < scheduler->num_priorities; p++) {
+                waiting[p] = atomic_load_explicit(&scheduler->snapshot_waiting[k * scheduler->num_priorities + p],
+                                                  memory_order_relaxed);
+            }
+            for (int i = 0; i < shard->num_tunnels; i++) {
+                unsigned int word = atomic_load_explicit(&scheduler->snapshot_tunnels[shard->first_tunnel + i],
+                                                         memory_order_relaxed);
+                int class = word >> 8 ? (int)(word & 0xff) : 0;
+                snapshot->tunnels[shard->first_tunnel + i] = (struct TunnelOccupancy){
+                    .num_vehicles = word >> 8,
+                    .vehicle_type = class / NUM_DIRECTIONS,
+                    .direction = class % NUM_DIRECTIONS,
+                };
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&shard->snapshot_seq, memory_order_relaxed) == seq) {
+                break;
+            }
+            retries++;
+        }
+        for (int p = 0; p < scheduler->num_priorities; p++) {
+            snapshot->waiting[p] += waiting[p];
+        }
+    }
+    return retries;
+}
+
+/**
+ * @brief Returns the highest priority with waiting vehicles in any shard.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @return The highest non-zero priority index, or -1 if no vehicles are waiting.
+ */
+static int get_highest_priority(PriorityScheduler *scheduler) {
+    int highest = atomic_load(&scheduler->shards[0].highest);
+    for (int k = 1; k < scheduler->num_shards; k++) {
+        int shard_highest = atomic_load(&scheduler->shards[k].highest);
+        if (shard_highest > highest) {
+            highest = shard_highest;
+        }
+    }
+    return highest;
+}
+
+/**
+ * @brief Counts the given vehicle as waiting in its home shard.
+ */
+static void count_waiting(PriorityScheduler *scheduler, struct Shard *home, const struct Vehicle *vehicle) {
+    int *counts = shard_counts(scheduler, home);
+    if (counts[vehicle->priority]++ == 0) {
+        bitmap_set(&home->priorities, vehicle->priority);
+        atomic_store(&home->highest, bitmap_highest(&home->priorities));
+    }
+    snapshot_begin(home);
+    atomic_store_explicit(&shard_snapshot_waiting(scheduler, home)[vehicle->priority], counts[vehicle->priority],
+                          memory_order_relaxed);
+    snapshot_end(home);
+    atomic_fetch_add(&home->num_waiting, 1);
+}
+
+/**
+ * @brief Stops counting the given vehicle as waiting.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The vehicle's home shard, with its lock held.
+ * @param vehicle The vehicle that was admitted or gave up.
+ * @param kick Set when this lowers the highest priority waiting in the shard while there are several
+ *             shards, since other shards may now admit lower priorities.
+ */
+static void uncount_waiting(PriorityScheduler *scheduler, struct Shard *home, const struct Vehicle *vehicle,
+                            bool *kick) {
+    int *counts = shard_counts(scheduler, home);
+    atomic_fetch_sub(&home->num_waiting, 1);
+    snapshot_begin(home);
+    atomic_store_explicit(&shard_snapshot_waiting(scheduler, home)[vehicle->priority], counts[vehicle->priority] - 1,
+                          memory_order_relaxed);
+    snapshot_end(home);
+    if (--counts[vehicle->priority] == 0) {
+        bitmap_clear(&home->priorities, vehicle->priority);
+        int highest = bitmap_highest(&home->priorities);
+        if (atomic_exchange(&home->highest, highest) > highest && scheduler->num_shards > 1) {
+            *kick = true;
+        }
+    }
+}
+
+/**
+ * @brief Selects the highest priority with waiting vehicles, for the strict policy.
+ */
+static int strict_select(PriorityScheduler *scheduler, struct Shard *home, bool *kick) {
+    (void)home;
+    (void)kick;
+    return get_highest_priority(scheduler);
+}
+
+/**
+ * @brief Lets the strict policy go on serving a priority as long as it has waiting vehicles.
+ */
+static bool strict_admitted(PriorityScheduler *scheduler, struct Shard *home, int priority) {
+    (void)scheduler;
+    (void)home;
+    (void)priority;
+    return true;
+}
+
+/**
+ * @brief Selects the priority whose turn it is in the given shard, for the weighted-fair policy.
+ *
+ * The turn stays with a priority while it has waiting vehicles and admissions left of its share,
+ * and then passes to the next lower priority with waiting vehicles, wrapping around from the
+ * lowest to the highest. A priority that gets the turn may admit up to its share again.
+ */
+static int fair_select(PriorityScheduler *scheduler, struct Shard *home, bool *kick) {
+    int *counts = shard_counts(scheduler, home);
+    int *deficits = shard_deficits(scheduler, home);
+    int turn = home->turn;
+    if (turn < 0 || counts[turn] == 0 || deficits[turn] <= 0) {
+        int from = turn < 0 ? 0 : turn;
+        turn = -1;
+        for (int i = 1; i <= scheduler->num_priorities && turn < 0; i++) {
+            int p = (from - i + scheduler->num_priorities) % scheduler->num_priorities;
+            if (counts[p] > 0) {
+                turn = p;
+            }
+        }
+        if (turn >= 0) {
+            if (turn != home->turn && scheduler->num_shards > 1) {
+                *kick = true;
+            }
+            home->turn = turn;
+            deficits[turn] = scheduler->shares[turn];
+        }
+    }
+    return turn;
+}
+
+/**
+ * @brief Charges an admission to the share of its priority in the given shard, for the
+ *        weighted-fair policy.
+ */
+static bool fair_admitted(PriorityScheduler *scheduler, struct Shard *home, int priority) {
+    return priority == home->turn && --shard_deficits(scheduler, home)[priority] > 0;
+}
+
+static const struct PolicyOps policies[] = {
+    [SCHEDULER_POLICY_STRICT] = { strict_select, strict_admitted },
+    [SCHEDULER_POLICY_FAIR] = { fair_select, fair_admitted },
 };
 
+const char *const scheduler_policy_names[] = {
+    [SCHEDULER_POLICY_STRICT] = "strict",
+    [SCHEDULER_POLICY_FAIR] = "fair",
+};
+
+/**
+ * @brief Picks how the scheduler chooses between waiting vehicles of different priorities.
+ *
+ * Under the strict policy, the default, a vehicle is only admitted once no vehicle of a higher
+ * priority is waiting, so a steady stream of high priority vehicles can hold back the lower
+ * priorities indefinitely. Under the weighted-fair policy the priorities with waiting vehicles
+ * take turns, from the highest down and round again, and each turn admits up to the priority's
+ * share of vehicles, so that every priority gets admissions in proportion to its share. With
+ * several shards, the waiters of each shard are ordered by the policy among themselves. Must be
+ * called before the scheduler is used, and for a shared scheduler before other processes open it.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param policy The policy.
+ * @param shares For the weighted-fair policy, the admissions per turn of each priority, raised to
+ *               at least 1, or NULL to give priority p a share of p + 1. Ignored by the strict policy.
+ */
+void scheduler_set_policy(PriorityScheduler *scheduler, enum SchedulerPolicy policy, const int *shares) {
+    scheduler->policy = &policies[policy];
+    scheduler->state->policy = policy;
+    if (policy != SCHEDULER_POLICY_FAIR) {
+        return;
+    }
+    for (int p = 0; p < scheduler->num_priorities; p++) {
+        scheduler->shares[p] = shares == NULL ? p + 1 : shares[p] > 1 ? shares[p] : 1;
+    }
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        scheduler->shards[k].turn = -1;
+    }
+}
+
+/**
+ * @brief Logs that the given vehicle arrived, so that the log shows which vehicles were waiting
+ *        whenever a vehicle enters a tunnel.
+ *
+ * An arrival is logged exactly once, under the lock of its home shard: right before the vehicle's
+ * first attempt to enter if it gets to try within its admission call, or when it is queued
+ * otherwise.
+ */
+static void log_arrival(PriorityScheduler *scheduler, struct Shard *home, struct Vehicle *vehicle) {
+    log_add_arrival(scheduler->log, vehicle, shard_number(scheduler, home));
+}
+
+/**
+ * @brief Enters the vehicle into the given tunnel of the given shard and records its admission.
+ *
+ * The tunnel is not added to the tunnel map here, since the map belongs to the process of the
+ * vehicle, which is only the calling one when the vehicle is admitted within its own call. In a
+ * shared scheduler, the vehicle's process becomes an owner of the tunnel.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The vehicle's home shard, with its lock held.
+ * @param shard The shard of the tunnel, with its lock held. May be `home`.
+ * @param tunnel The tunnel, as found in the shard's index.
+ * @param vehicle The vehicle to place.
+ * @param waiter The vehicle's waiter, or NULL if it is admitted within its admission call.
+ * @param kick See `uncount_waiting`.
+ * @return Whether the vehicle entered the tunnel.
+ */
+static bool enter_tunnel(PriorityScheduler *scheduler, struct Shard *home, struct Shard *shard,
+                         struct Tunnel *tunnel, struct Vehicle *vehicle, const struct Waiter *waiter, bool *kick) {
+    if (!tunnel_try_to_enter(tunnel, vehicle)) {
+        return false;
+    }
+    if (scheduler->name != NULL) {
+        add_owner(scheduler, tunnel->id, waiter ? waiter->pid : scheduler->pid, waiter ? waiter->ticket : 0);
+    }
+    log_add_summary(tunnel->log, vehicle, tunnel);
+    shard_update(scheduler, shard, tunnel);
+    record_entry(scheduler, vehicle, waiter != NULL);
+    home->counters.admissions++;
+    uncount_waiting(scheduler, home, vehicle, kick);
+    return true;
+}
+
+/**
+ * @brief Finds a tunnel of the given shard a waiting vehicle fits in and enters it.
+ *
+ * The tunnel is looked up in the index, so the log records a single attempt for the tunnel that
+ * is actually entered.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The vehicle's home shard, with its lock held.
+ * @param shard The shard to place the vehicle in, with its lock held. May be `home`.
+ * @param waiter The waiter of the vehicle to place, whose arrival has been logged.
+ * @param kick See `uncount_waiting`.
+ * @return The entered tunnel, or NULL if no tunnel of the shard currently has room for the vehicle.
+ */
+static struct Tunnel *enter_any_tunnel(PriorityScheduler *scheduler, struct Shard *home, struct Shard *shard,
+                                       struct Waiter *waiter, bool *kick) {
+    struct Vehicle *vehicle = waiter_vehicle(scheduler, waiter);
+    struct Tunnel *tunnel = index_find(scheduler, shard, vehicle, scheduler->convoy_window > 0);
+    if (tunnel == NULL || !enter_tunnel(scheduler, home, shard, tunnel, vehicle, waiter, kick)) {
+        return NULL;
+    }
+    return tunnel;
+}
+
 /**
- * @brief Creates a PriorityScheduler with the given number of tunnels.
- * 
- * @param num_tunnels The number of tunnels.
- * @param tunnels Array of pointers to tunnels.
- * @return Pointer to the created PriorityScheduler.
+ * @brief Hands an admitted waiter its tunnel.
+ *
+ * Blocking waiters are signalled, and add the tunnel to their home shard's tunnel map themselves
+ * once they wake up. Asynchronous waiters have theirs added, their callback run and are freed.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The waiter's home shard, with its lock held.
+ * @param waiter The admitted waiter, already removed from its queue.
  */
-PriorityScheduler *scheduler_create(int num_tunnels, struct Tunnel **tunnels) {
-    PriorityScheduler *scheduler = malloc(sizeof(PriorityScheduler));
-    if (!scheduler) {
-        perror("scheduler_create: malloc failed");
+static void complete_waiter(PriorityScheduler *scheduler, struct Shard *home, struct Waiter *waiter) {
+    if (waiter->callback != NULL) {
+        struct Vehicle *vehicle = waiter_vehicle(scheduler, waiter);
+        struct Tunnel *tunnel = scheduler->tunnels[waiter->tunnel];
+        hashmap_put(scheduler->tunnel_maps[shard_number(scheduler, home)], vehicle, tunnel);
+        waiter->callback(vehicle, tunnel, waiter->arg);
+        slab_free(&waiter_slab, waiter);
+    } else {
+#ifdef SCHEDULER_LOCK_PROFILE
+        atomic_fetch_add_explicit(&scheduler->lock_profiles[lock_site].signals, 1, memory_order_relaxed);
+#endif
+        pthread_cond_signal(&waiter->cv);
+    }
+}
+
+/**
+ * @brief Orders the classes of waiters at the given priority by which to serve first.
+ *
+ * Without convoys the order is fixed. With convoys, classes whose vehicles can join a partially
+ * filled tunnel go first, then those with an empty tunnel that last held their class, then the
+ * rest, so that tunnels fill up and keep their class. The class served last keeps going first for
+ * up to the convoy window of admissions in a row, and ties go to the longer queue.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The shard whose waiters to order, with its lock held.
+ * @param shard The shard whose tunnels they would enter, with its lock held.
+ * @param priority The priority being served.
+ * @param order Where to store the classes, first to be served first.
+ */
+static void order_classes(PriorityScheduler *scheduler, struct Shard *home, struct Shard *shard, int priority,
+                          int order[NUM_CLASSES]) {
+    int scores[NUM_CLASSES];
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        order[c] = c;
+        if (scheduler->convoy_window == 0) {
+            continue;
+        }
+        int score = shard->index.heads[c] >= 0 ? 2 : shard->index.heads[EMPTY_BUCKET + 1 + c] >= 0 ? 1 : 0;
+        if (c == home->convoy_class && home->convoy_length < scheduler->convoy_window) {
+            score = 3;
+        }
+        scores[c] = score * (1 << 24) + wait_queue(scheduler, home, priority, c)->length;
+    }
+    if (scheduler->convoy_window == 0) {
+        return;
+    }
+    for (int i = 1; i < NUM_CLASSES; i++) {
+        for (int j = i; j > 0 && scores[order[j]] > scores[order[j - 1]]; j--) {
+            int c = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = c;
+        }
+    }
+}
+
+/**
+ * @brief Admits as many waiters of one shard as the tunnels of a shard allow, in policy order.
+ *
+ * Only the head of each class queue at the priority selected by the policy is considered, and
+ * another priority is only served once the policy selects it, which under the strict policy is
+ * once no shard has vehicles of the priorities above it waiting. Within a priority, classes are
+ * served in the order of `order_classes`. Each admitted waiter is completed exactly once.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The shard whose waiters to admit, with its lock held.
+ * @param shard The shard whose tunnels to admit them into, with its lock held. May be `home`.
+ * @param kick See `uncount_waiting`.
+ */
+static void dispatch_waiters(PriorityScheduler *scheduler, struct Shard *home, struct Shard *shard, bool *kick) {
+    int *counts = shard_counts(scheduler, home);
+    int priority;
+    while ((priority = scheduler->policy->select(scheduler, home, kick)) >= 0 && counts[priority] > 0) {
+        int order[NUM_CLASSES];
+        order_classes(scheduler, home, shard, priority, order);
+        bool turn_over = false;
+        for (int i = 0; i < NUM_CLASSES && !turn_over; i++) {
+            int c = order[i];
+            struct WaitQueue *queue = wait_queue(scheduler, home, priority, c);
+            while (queue->head != 0) {
+                struct Waiter *waiter = scheduler_at(scheduler, queue->head);
+                struct Tunnel *tunnel = enter_any_tunnel(scheduler, home, shard, waiter, kick);
+                if (tunnel == NULL) {
+                    break;
+                }
+                waiter->tunnel = tunnel->id;
+                if ((queue->head = waiter->next) == 0) {
+                    queue->tail = 0;
+                } else {
+                    ((struct Waiter *)scheduler_at(scheduler, queue->head))->prev = 0;
+                }
+                queue->length--;
+                waiter->slot_state = SLOT_HELD;
+                waiter_vehicle(scheduler, waiter)->waiter = NULL;
+                if (c != home->convoy_class) {
+                    home->convoy_class = c;
+                    home->convoy_length = 0;
+                }
+                home->convoy_length++;
+                complete_waiter(scheduler, home, waiter);
+                if (!scheduler->policy->admitted(scheduler, home, priority)) {
+                    turn_over = true;
+                    break;
+                }
+            }
+        }
+        // Vehicles of this priority are still waiting for room, so the other priorities must wait too
+        if (!turn_over && counts[priority] > 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Offers the room in every shard, its own included, to the waiters of the given shard.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The shard whose waiters to admit, not locked by the caller.
+ * @param kick See `uncount_waiting`.
+ */
+static void steal_room(PriorityScheduler *scheduler, struct Shard *home, bool *kick) {
+    for (int k = 0; k < scheduler->num_shards && atomic_load(&home->num_waiting) > 0; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        if (atomic_load(&shard->has_room)) {
+            lock_pair(scheduler, home, shard);
+            dispatch_waiters(scheduler, home, shard, kick);
+            unlock_pair(scheduler, home, shard);
+        }
+    }
+}
+
+/**
+ * @brief Offers the room in the given shard to the waiters of the other shards.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param shard The shard with room, not locked by the caller.
+ * @param kick See `uncount_waiting`.
+ */
+static void offer_room(PriorityScheduler *scheduler, struct Shard *shard, bool *kick) {
+    for (int k = 0; k < scheduler->num_shards && atomic_load(&shard->has_room); k++) {
+        struct Shard *home = &scheduler->shards[k];
+        if (home != shard && atomic_load(&home->num_waiting) > 0) {
+            lock_pair(scheduler, home, shard);
+            dispatch_waiters(scheduler, home, shard, kick);
+            unlock_pair(scheduler, home, shard);
+        }
+    }
+}
+
+/**
+ * @brief Dispatches the waiters of every shard after a priority stopped having waiters.
+ *
+ * Repeats while the admissions it makes empty further priorities.
+ *
+ * @param scheduler The PriorityScheduler, with no shard locked by the caller.
+ * @param kick Whether a priority stopped having waiters.
+ */
+static void kick_shards(PriorityScheduler *scheduler, bool kick) {
+    while (kick) {
+        kick = false;
+        for (int k = 0; k < scheduler->num_shards; k++) {
+            struct Shard *home = &scheduler->shards[k];
+            if (atomic_load(&home->num_waiting) > 0) {
+                steal_room(scheduler, home, &kick);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Returns whether the vehicle's priority is one of the scheduler's levels.
+ */
+static bool valid_priority(PriorityScheduler *scheduler, const struct Vehicle *vehicle) {
+    return vehicle->priority >= 0 && vehicle->priority < scheduler->num_priorities;
+}
+
+/**
+ * @brief Counts the vehicle as waiting and enters it into a tunnel of its home shard if nobody is
+ *        ahead of it.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The vehicle's home shard, with its lock held.
+ * @param vehicle The vehicle to admit.
+ * @param arrived Set when the vehicle's arrival was logged, which it is if it tried to enter a
+ *                tunnel.
+ * @param kick See `uncount_waiting`.
+ * @return The entered tunnel, or NULL if the vehicle has to wait.
+ */
+static struct Tunnel *admit_or_count(PriorityScheduler *scheduler, struct Shard *home, struct Vehicle *vehicle,
+                                     bool *arrived, bool *kick) {
+    count_waiting(scheduler, home, vehicle);
+    *arrived = false;
+    struct WaitQueue *queue = wait_queue(scheduler, home, vehicle->priority, vehicle_class(vehicle));
+    if (vehicle->priority != scheduler->policy->select(scheduler, home, kick) || queue->head != 0) {
+        return NULL;
+    }
+    struct Tunnel *tunnel = index_find(scheduler, home, vehicle, scheduler->convoy_window > 0);
+    if (tunnel == NULL) {
+        return NULL;
+    }
+    log_arrival(scheduler, home, vehicle);
+    *arrived = true;
+    if (!enter_tunnel(scheduler, home, home, tunnel, vehicle, NULL, kick)) {
+        return NULL;
+    }
+    scheduler->policy->admitted(scheduler, home, vehicle->priority);
+    hashmap_put(scheduler->tunnel_maps[shard_number(scheduler, home)], vehicle, tunnel);
+    return tunnel;
+}
+
+/**
+ * @brief Appends the given waiter to the wait queue of its vehicle and logs its arrival, unless
+ *        that was logged already.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The vehicle's home shard, with its lock held.
+ * @param waiter The waiter to park.
+ * @param arrived Whether `admit_or_count` logged the vehicle's arrival already.
+ */
+static void enqueue_waiter(PriorityScheduler *scheduler, struct Shard *home, struct Waiter *waiter, bool arrived) {
+    struct Vehicle *vehicle = waiter_vehicle(scheduler, waiter);
+    if (!arrived) {
+        log_arrival(scheduler, home, vehicle);
+    }
+    struct WaitQueue *queue = wait_queue(scheduler, home, vehicle->priority, vehicle_class(vehicle));
+    uintptr_t ref = scheduler_ref(scheduler, waiter);
+    if (scheduler->name != NULL) {
+        waiter->ticket = atomic_fetch_add(&scheduler->state->last_ticket, 1) + 1;
+    }
+    waiter->slot_state = SLOT_QUEUED;
+    waiter->prev = queue->tail;
+    waiter->next = 0;
+    if (queue->tail != 0) {
+        ((struct Waiter *)scheduler_at(scheduler, queue->tail))->next = ref;
+    } else {
+        queue->head = ref;
+    }
+    queue->tail = ref;
+    queue->length++;
+    vehicle->waiter = waiter;
+}
+
+/**
+ * @brief Takes a waiter that gave up out of its queue and out of the priority counts.
+ *
+ * The waiter may be anywhere in its queue. If it was the last of its priority to wait, the
+ * priorities below it may now be served, so the waiters of its home shard are dispatched and
+ * `kick` is set as for an admission.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param home The vehicle's home shard, with its lock held.
+ * @param waiter The waiter, still queued.
+ * @param event The event to log for the vehicle, ENTER_TIMEOUT or ENTER_CANCELLED.
+ * @param kick See `uncount_waiting`.
+ */
+static void remove_waiter(PriorityScheduler *scheduler, struct Shard *home, struct Waiter *waiter,
+                          enum EventType event, bool *kick) {
+    struct Vehicle *vehicle = waiter_vehicle(scheduler, waiter);
+    struct WaitQueue *queue = wait_queue(scheduler, home, vehicle->priority, vehicle_class(vehicle));
+    if (waiter->prev != 0) {
+        ((struct Waiter *)scheduler_at(scheduler, waiter->prev))->next = waiter->next;
+    } else {
+        queue->head = waiter->next;
+    }
+    if (waiter->next != 0) {
+        ((struct Waiter *)scheduler_at(scheduler, waiter->next))->prev = waiter->prev;
+    } else {
+        queue->tail = waiter->prev;
+    }
+    queue->length--;
+    waiter->slot_state = SLOT_HELD;
+    vehicle->waiter = NULL;
+    log_add(scheduler->log, vehicle, NULL, event);
+    uncount_waiting(scheduler, home, vehicle, kick);
+    if (shard_counts(scheduler, home)[vehicle->priority] == 0) {
+        dispatch_waiters(scheduler, home, home, kick);
+    }
+}
+
+/**
+ * @brief Returns whether the given process is one of the given dead processes.
+ */
+static bool is_dead(const pid_t *dead, int num_dead, pid_t pid) {
+    for (int i = 0; i < num_dead; i++) {
+        if (dead[i] == pid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Returns whether the given owner was recorded by a dispatcher that died before it could take
+ *        the owner's waiter out of its queue.
+ */
+static bool half_admitted(PriorityScheduler *scheduler, const struct Owner *owner) {
+    int num_slots = scheduler->num_shards * scheduler->max_waiters;
+    for (int w = 0; owner->ticket != 0 && w < num_slots; w++) {
+        const struct Waiter *slot = &scheduler->waiters[w];
+        if (slot->slot_state == SLOT_QUEUED && slot->tunnel < 0 && slot->ticket == owner->ticket
+                && slot->pid == owner->pid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Reclaims what processes that died without closing a shared scheduler held.
+ *
+ * A process has died if the `alive` lock of its entry in the process table can be taken. With every
+ * shard locked, the waiter slots of the dead processes are freed and their vehicles taken out of
+ * the tunnels, along with any vehicle a dispatcher that died put in a tunnel without taking it out
+ * of its queue. Every shard is then repaired and its waiters dispatched into the room that freed.
+ *
+ * Nothing is done unless a process died or a shard was repaired since the last call.
+ *
+ * @param scheduler The shared PriorityScheduler, with no shard locked by the caller.
+ */
+static void reap_processes(PriorityScheduler *scheduler) {
+    pid_t dead[MAX_PROCESSES];
+    int num_dead = 0;
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        shard_lock(scheduler, &scheduler->shards[k]);
+    }
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        struct Process *process = &scheduler->processes[i];
+        if (process->pid == 0) {
+            continue;
+        }
+        int result = pthread_mutex_trylock(&process->alive);
+        if (result == EBUSY) {
+            continue;
+        }
+        if (result == EOWNERDEAD) {
+            pthread_mutex_consistent(&process->alive);
+        }
+        pthread_mutex_unlock(&process->alive);
+        dead[num_dead++] = process->pid;
+        process->pid = 0;
+    }
+
+    bool reap = atomic_exchange(&scheduler->state->reap_needed, false) || num_dead > 0;
+    bool kick = false;
+    if (reap) {
+        int num_slots = scheduler->num_shards * scheduler->max_waiters;
+        for (int w = 0; w < num_slots; w++) {
+            struct Waiter *slot = &scheduler->waiters[w];
+            if (slot->slot_state != SLOT_FREE && is_dead(dead, num_dead, slot->pid)) {
+                // The dead vehicle may have been waiting on the slot's condition variable
+                slot->slot_state = SLOT_FREE;
+                init_shared_cond(&slot->cv);
+            }
+        }
+        for (int i = 0; i < scheduler->num_tunnels * scheduler->max_owners; i++) {
+            struct Owner *owner = &scheduler->owners[i];
+            if (owner->pid != 0 && (is_dead(dead, num_dead, owner->pid) || half_admitted(scheduler, owner))) {
+                *owner = (struct Owner){ 0 };
+            }
+        }
+        for (int k = 0; k < scheduler->num_shards; k++) {
+            repair_shard(scheduler, &scheduler->shards[k]);
+        }
+        for (int k = 0; k < scheduler->num_shards; k++) {
+            dispatch_waiters(scheduler, &scheduler->shards[k], &scheduler->shards[k], &kick);
+        }
+    }
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        shard_unlock(scheduler, &scheduler->shards[k]);
+    }
+    kick_shards(scheduler, reap && scheduler->num_shards > 1);
+}
+
+/**
+ * @brief Waits on a condition variable with the given shard locked, like `shard_timedwait`, but
+ *        looks for dead processes every CHECK_PERIOD_NS if the scheduler is shared.
+ *
+ * So a process that dies while it holds room, or while its vehicles wait at a high priority, only
+ * holds up the waiters of the other processes for that long, even though nobody signals them.
+ *
+ * @return Zero once woken, EAGAIN after looking for dead processes, in which case the shard was
+ *         unlocked meanwhile, or ETIMEDOUT once the deadline has passed.
+ */
+static int wait_checking(PriorityScheduler *scheduler, struct Shard *shard, pthread_cond_t *cv,
+                         const struct timespec *deadline) {
+    if (scheduler->name == NULL) {
+        return shard_timedwait(scheduler, shard, cv, deadline);
+    }
+    long long check_ns = now_ns() + CHECK_PERIOD_NS;
+    bool before_deadline = deadline == NULL || check_ns < deadline->tv_sec * 1000000000LL + deadline->tv_nsec;
+    struct timespec until = { check_ns / 1000000000LL, check_ns % 1000000000LL };
+    int result = shard_timedwait(scheduler, shard, cv, before_deadline ? &until : deadline);
+    if (result != ETIMEDOUT || !before_deadline) {
+        return result;
+    }
+    shard_unlock(scheduler, shard);
+    reap_processes(scheduler);
+    shard_lock(scheduler, shard);
+    return EAGAIN;
+}
+
+/**
+ * @brief Enters the calling process in the process table of a shared scheduler.
+ *
+ * The process's `alive` lock is held by the calling thread until `unregister_process`, so that
+ * thread must not exit before the process closes the scheduler.
+ */
+static void register_process(PriorityScheduler *scheduler, const char *caller) {
+    struct Shard *shard = &scheduler->shards[0];
+    struct Process *process = NULL;
+    scheduler->pid = getpid();
+    shard_lock(scheduler, shard);
+    for (int i = 0; i < MAX_PROCESSES && process == NULL; i++) {
+        if (scheduler->processes[i].pid == 0) {
+            process = &scheduler->processes[i];
+        }
+    }
+    if (process == NULL) {
+        fprintf(stderr, "%s: more than %d processes\n", caller, MAX_PROCESSES);
+        exit(EXIT_FAILURE);
+    }
+    // The lock of a free entry is never held, and waiting for it here would put it after the shard
+    // locks, which the process takes while holding it from now on
+    int result = pthread_mutex_trylock(&process->alive);
+    if (result != 0) {
+        errno = result;
+        perror(caller);
         exit(EXIT_FAILURE);
     }
+    process->pid = scheduler->pid;
+    shard_unlock(scheduler, shard);
+}
 
-    // Initialize the mutex and condition variable
-    pthread_mutex_init(&scheduler->lock, NULL);
-    pthread_cond_init(&scheduler->lock_cv, NULL);
+/**
+ * @brief Takes the calling process out of the process table of a shared scheduler.
+ */
+static void unregister_process(PriorityScheduler *scheduler) {
+    struct Shard *shard = &scheduler->shards[0];
+    shard_lock(scheduler, shard);
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        struct Process *process = &scheduler->processes[i];
+        if (process->pid == scheduler->pid) {
+            process->pid = 0;
+            pthread_mutex_unlock(&process->alive);
+            break;
+        }
+    }
+    shard_unlock(scheduler, shard);
+}
 
-    // Initialize the priority counts
-    for (int i = 0; i <= HIGHEST_PRIORITY; i++) {
-        scheduler->priority_counts[i] = 0;
+/**
+ * @brief Creates a PriorityScheduler that processes share through a named POSIX shared memory
+ *        segment.
+ *
+ * The whole state of the scheduler is in the segment: its shards, the tunnels' occupancy and the
+ * vehicles waiting for room. `scheduler_admit` and `scheduler_exit`, called from any process that
+ * opened the scheduler with `scheduler_open_shared`, therefore order the vehicles of every process
+ * together, as they order the threads of a single process. Vehicles wait in slots of their home
+ * shard, and a vehicle that finds every slot of its shard in use waits for one before it arrives.
+ *
+ * Each process has its own objects for the tunnels, see `scheduler_tunnel`, whose events go to the
+ * log it gave, and its own wait and occupancy histograms, which count the admissions and exits it
+ * makes. `scheduler_admit_async` rejects every vehicle of a shared scheduler, since a callback
+ * cannot run in another process.
+ *
+ * A process may die while it uses the scheduler, even with a shard locked. The shard is then
+ * repaired by the next process to lock it, and the vehicles the dead process had waiting or in
+ * tunnels are taken out by the waiters of the other processes, which look for dead processes every
+ * CHECK_PERIOD_NS, see `reap_processes`. A process counts as alive from its call to this function
+ * or `scheduler_open_shared` to its call to `scheduler_close`, so the thread that made the first
+ * must not exit before the process makes the second. At most MAX_PROCESSES processes can have the
+ * scheduler open at once.
+ *
+ * @param name The name of the segment, as for `shm_open`. It must not exist yet.
+ * @param num_tunnels The number of tunnels.
+ * @param num_priorities The number of priority levels, see `scheduler_create`.
+ * @param num_shards The number of shards, see `scheduler_create_sharded`.
+ * @param max_waiters The most vehicles that can wait in each shard at once, raised to at least 1.
+ * @param log The log of the calling process's tunnels.
+ * @return Pointer to the created PriorityScheduler, to be closed with `scheduler_close`, or
+ *         destroyed with `scheduler_destroy` by the last process using it.
+ */
+PriorityScheduler *scheduler_create_shared(const char *name, int num_tunnels, int num_priorities, int num_shards,
+                                           int max_waiters, Log *log) {
+    PriorityScheduler *scheduler = scheduler_alloc(num_tunnels, num_priorities, num_shards);
+    scheduler->name = strdup(name);
+    scheduler->max_waiters = max_waiters > 1 ? max_waiters : 1;
+    if (!scheduler->name) {
+        perror("scheduler_create_shared: strdup failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = lay_out(scheduler, 0);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)size) != 0) {
+        perror("scheduler_create_shared: shm_open failed");
+        exit(EXIT_FAILURE);
+    }
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        perror("scheduler_create_shared: mmap failed");
+        exit(EXIT_FAILURE);
     }
 
-    // Assign the number of tunnels and the tunnels array
-    scheduler->num_tunnels = num_tunnels;
-    scheduler->tunnels = tunnels;
+    // The segment starts zeroed, which is every tunnel's state word when the tunnel is empty
+    scheduler->base = (uintptr_t)block;
+    lay_out(scheduler, scheduler->base);
+    scheduler->tunnels = tunnels_attach(scheduler->num_tunnels, log, scheduler->tunnel_words);
+    init_state(scheduler, size);
+    init_handle(scheduler);
+    scheduler_set_policy(scheduler, SCHEDULER_POLICY_STRICT, NULL);
+    register_process(scheduler, "scheduler_create_shared");
+    scheduler->state->magic = SHARED_MAGIC;
+
+    return scheduler;
+}
+
+/**
+ * @brief Opens a scheduler created by another process with `scheduler_create_shared`.
+ *
+ * The scheduler must have been created before this is called, and its policy and convoy window
+ * set, as they are read from it here.
+ *
+ * @param name The name the scheduler was created with.
+ * @param log The log of the calling process's tunnels.
+ * @return Pointer to the calling process's PriorityScheduler, to be closed with `scheduler_close`.
+ */
+PriorityScheduler *scheduler_open_shared(const char *name, Log *log) {
+    struct stat st;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("scheduler_open_shared: shm_open failed");
+        exit(EXIT_FAILURE);
+    }
+    void *block = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (block == MAP_FAILED) {
+        perror("scheduler_open_shared: mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    struct SchedulerState *state = block;
+    if ((size_t)st.st_size < sizeof *state || state->magic != SHARED_MAGIC || state->size != (size_t)st.st_size) {
+        fprintf(stderr, "scheduler_open_shared: %s is not a scheduler\n", name);
+        exit(EXIT_FAILURE);
+    }
 
-    // Create the hashmap
-    scheduler->tunnel_map = hashmap_create(vehicle_hash);
-    if (!scheduler->tunnel_map) {
-        perror("scheduler_create: hashmap_create failed");
-        free(scheduler);
+    PriorityScheduler *scheduler = scheduler_alloc(state->num_tunnels, state->num_priorities, state->num_shards);
+    scheduler->name = strdup(name);
+    scheduler->max_waiters = state->max_waiters;
+    if (!scheduler->name) {
+        perror("scheduler_open_shared: strdup failed");
         exit(EXIT_FAILURE);
     }
+    scheduler->base = (uintptr_t)block;
+    lay_out(scheduler, scheduler->base);
+    scheduler->tunnels = tunnels_attach(scheduler->num_tunnels, log, scheduler->tunnel_words);
+    init_handle(scheduler);
+    scheduler->policy = &policies[state->policy];
+
+    // Reap first, in case a process that died had the same process id
+    reap_processes(scheduler);
+    register_process(scheduler, "scheduler_open_shared");
 
     return scheduler;
 }
 
 /**
- * @brief Frees the memory associated with the PriorityScheduler.
- * 
- * @param scheduler The PriorityScheduler to destroy.
+ * @brief Closes the calling process's handle on a shared scheduler, which the other processes
+ *        that opened it go on using.
+ *
+ * @param scheduler The PriorityScheduler. One that is not shared is destroyed.
  */
-void scheduler_destroy(PriorityScheduler *scheduler) {
-    pthread_mutex_destroy(&scheduler->lock);
-    pthread_cond_destroy(&scheduler->lock_cv);
-    hashmap_destroy(scheduler->tunnel_map);
-    free(scheduler);
+void scheduler_close(PriorityScheduler *scheduler) {
+    if (scheduler->name == NULL) {
+        scheduler_destroy(scheduler);
+        return;
+    }
+    unregister_process(scheduler);
+    release_handle(scheduler);
 }
 
 /**
- * @brief Returns the highest priority with waiting vehicles.
- * 
+ * @brief Returns the calling process's object for the tunnel with the given id.
+ *
  * @param scheduler The PriorityScheduler.
- * @return The highest non-zero priority index, or -1 if no vehicles are waiting.
+ * @param id The id of the tunnel, below `scheduler_num_tunnels`.
+ * @return The tunnel.
  */
-static int get_highest_priority(PriorityScheduler *scheduler) {
-    for (int i = HIGHEST_PRIORITY; i >= 0; i--) {
-        if (scheduler->priority_counts[i] > 0) {
-            return i;
+struct Tunnel *scheduler_tunnel(PriorityScheduler *scheduler, int id) {
+    return scheduler->tunnels[id];
+}
+
+/**
+ * @brief Takes a free waiter slot of the given shard of a shared scheduler, waiting for one while
+ *        every slot is in use.
+ *
+ * @param scheduler The shared PriorityScheduler.
+ * @param home The shard, with its lock held.
+ * @return The slot, whose condition variable is ready to wait on.
+ */
+static struct Waiter *take_slot(PriorityScheduler *scheduler, struct Shard *home) {
+    while (home->free_waiters == 0) {
+        wait_checking(scheduler, home, &home->slot_cv, NULL);
+    }
+    struct Waiter *slot = scheduler_at(scheduler, home->free_waiters);
+    home->free_waiters = slot->next;
+    slot->slot_state = SLOT_HELD;
+    slot->pid = scheduler->pid;
+    return slot;
+}
+
+/**
+ * @brief Gives a waiter slot taken by `take_slot` back to its shard.
+ */
+static void give_back_slot(PriorityScheduler *scheduler, struct Shard *home, struct Waiter *slot) {
+    slot->slot_state = SLOT_FREE;
+    slot->next = home->free_waiters;
+    home->free_waiters = scheduler_ref(scheduler, slot);
+    pthread_cond_signal(&home->slot_cv);
+}
+
+/**
+ * @brief Admits a vehicle, blocking until it enters a tunnel, gives up at the deadline if one is
+ *        given, or is cancelled.
+ *
+ * The waiter of a private scheduler is on the calling thread's stack. That of a shared scheduler
+ * is a slot of the vehicle's home shard, taken before the vehicle arrives, and waits with a copy of
+ * the vehicle, which is all a dispatcher in another process can see.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle to admit.
+ * @param deadline Absolute CLOCK_MONOTONIC time to give up at, or NULL to wait indefinitely.
+ * @return The tunnel the vehicle was admitted into, or NULL if it was not admitted.
+ */
+static struct Tunnel *admit_blocking(PriorityScheduler *scheduler, struct Vehicle *vehicle,
+                                     const struct timespec *deadline) {
+    SET_LOCK_SITE(LOCK_SITE_ADMIT);
+    if (scheduler->num_tunnels == 0 || !valid_priority(scheduler, vehicle)) {
+        return NULL;
+    }
+    vehicle->arrival_ns = now_ns();
+    struct Shard *home = vehicle_shard(scheduler, vehicle);
+    bool shared = scheduler->name != NULL;
+    bool kick = false;
+    if (shared && atomic_load(&scheduler->state->reap_needed)) {
+        reap_processes(scheduler);
+    }
+
+    shard_lock(scheduler, home);
+
+    struct Waiter local = { .tunnel = -1 };
+    struct Waiter *waiter = shared ? take_slot(scheduler, home) : &local;
+    bool arrived;
+    struct Tunnel *assigned_tunnel = admit_or_count(scheduler, home, vehicle, &arrived, &kick);
+
+    // Otherwise park until a dispatcher hands over a tunnel, after looking for room in other shards
+    if (!assigned_tunnel) {
+        waiter->tunnel = -1;
+        waiter->callback = NULL;
+        waiter->cancelled = false;
+        if (shared) {
+            waiter->copy = *vehicle;
+            waiter->vehicle = scheduler_ref(scheduler, &waiter->copy);
+        } else if (deadline != NULL) {
+            waiter->vehicle = scheduler_ref(scheduler, vehicle);
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&waiter->cv, &attr);
+            pthread_condattr_destroy(&attr);
+        } else {
+            waiter->vehicle = scheduler_ref(scheduler, vehicle);
+            pthread_cond_init(&waiter->cv, NULL);
+        }
+        enqueue_waiter(scheduler, home, waiter, arrived);
+        // A shared waiter's vehicle is its copy, so `scheduler_cancel` finds the waiter from here
+        vehicle->waiter = waiter;
+        if (scheduler->num_shards > 1) {
+            shard_unlock(scheduler, home);
+            steal_room(scheduler, home, &kick);
+            kick_shards(scheduler, kick);
+            kick = false;
+            shard_lock(scheduler, home);
+        }
+        while (waiter->tunnel < 0 && !waiter->cancelled) {
+            int result = wait_checking(scheduler, home, &waiter->cv, deadline);
+            if (result == ETIMEDOUT) {
+                // A dispatcher may have admitted the vehicle just as the deadline passed
+                if (waiter->tunnel < 0 && !waiter->cancelled) {
+                    remove_waiter(scheduler, home, waiter, ENTER_TIMEOUT, &kick);
+                }
+                break;
+            }
+            if (result == EAGAIN) {
+                continue;
+            }
+            home->counters.wakeups++;
+#ifdef SCHEDULER_LOCK_PROFILE
+            if (waiter->tunnel < 0 && !waiter->cancelled) {
+                atomic_fetch_add_explicit(&scheduler->lock_profiles[lock_site].requeued_wakeups, 1,
+                                          memory_order_relaxed);
+            }
+#endif
+        }
+        vehicle->waiter = NULL;
+        if (waiter->tunnel >= 0) {
+            assigned_tunnel = scheduler->tunnels[waiter->tunnel];
+            hashmap_put(scheduler->tunnel_maps[shard_number(scheduler, home)], vehicle, assigned_tunnel);
+        }
+        if (shared) {
+            vehicle->entry_ns = waiter->copy.entry_ns;
+        } else {
+            pthread_cond_destroy(&waiter->cv);
         }
     }
-    return -1;
+    if (shared) {
+        give_back_slot(scheduler, home, waiter);
+    }
+
+    shard_unlock(scheduler, home);
+
+    kick_shards(scheduler, kick);
+
+    return assigned_tunnel;
 }
 
 /**
  * @brief Admits a vehicle into an available tunnel based on priority.
- * 
+ *
+ * Blocks until the policy selects the vehicle's priority and a tunnel has room for the vehicle.
+ * Under the default strict policy that is once no vehicle of higher priority is waiting, see
+ * `scheduler_set_policy`. Vehicles of the same priority, type, direction and home shard are
+ * admitted in arrival order.
+ *
  * @param scheduler The PriorityScheduler.
  * @param vehicle The vehicle to admit.
- * @return The tunnel the vehicle was admitted into, or NULL if no tunnel was available.
+ * @return The tunnel the vehicle was admitted into, or NULL if the scheduler has no tunnels, the
+ *         vehicle's priority is not below `scheduler_num_priorities` or the vehicle was cancelled
+ *         with `scheduler_cancel`.
  */
 struct Tunnel *scheduler_admit(PriorityScheduler *scheduler, struct Vehicle *vehicle) {
-    pthread_mutex_lock(&scheduler->lock);
+    return admit_blocking(scheduler, vehicle, NULL);
+}
+
+/**
+ * @brief Admits a vehicle like `scheduler_admit`, but gives up if it is still waiting at the
+ *        given deadline.
+ *
+ * A vehicle that gives up is taken out of its queue and the priority counts at once, and an
+ * ENTER_TIMEOUT event is logged for it. If it was the last vehicle of its priority waiting, the
+ * vehicles of the priorities it held back are dispatched straight away.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle to admit.
+ * @param deadline_ns When to give up, in nanoseconds on the CLOCK_MONOTONIC clock.
+ * @return The tunnel the vehicle was admitted into, or NULL if it timed out or was not admitted
+ *         for one of the reasons of `scheduler_admit`.
+ */
+struct Tunnel *scheduler_admit_timed(PriorityScheduler *scheduler, struct Vehicle *vehicle, long long deadline_ns) {
+    struct timespec deadline = { deadline_ns / 1000000000LL, deadline_ns % 1000000000LL };
+    return admit_blocking(scheduler, vehicle, &deadline);
+}
+
+/**
+ * @brief Admits a vehicle without blocking the calling thread.
+ *
+ * Follows the same rules as `scheduler_admit`. If the vehicle cannot enter a tunnel straight away
+ * it is queued, and `callback` is run once it has been admitted, or with a NULL tunnel if it is
+ * withdrawn by `scheduler_cancel`, so that whatever `arg` holds can be released. The callback runs with scheduler
+ * locks held on whichever thread frees the room, which with several shards may be the calling
+ * thread before this function returns. It must be short and must not call back into the scheduler.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle to admit.
+ * @param callback Function to run with the vehicle, its tunnel and `arg` once admitted or cancelled later.
+ * @param arg Argument passed through to the callback.
+ * @param tunnel Set to the tunnel the vehicle was admitted into, or NULL if it was not admitted
+ *               straight away.
+ * @return ADMIT_ENTERED if the vehicle was admitted straight away, ADMIT_QUEUED if it was queued
+ *         and the callback will run, or ADMIT_REJECTED if the scheduler has no tunnels or is shared,
+ *         see `scheduler_create_shared`, or the vehicle's priority is out of range, in which case the
+ *         callback never runs.
+ */
+enum AdmitStatus scheduler_admit_async(PriorityScheduler *scheduler, struct Vehicle *vehicle,
+                                       AdmitCallback callback, void *arg, struct Tunnel **tunnel) {
+    SET_LOCK_SITE(LOCK_SITE_ADMIT);
+    *tunnel = NULL;
+    if (scheduler->num_tunnels == 0 || scheduler->name != NULL || !valid_priority(scheduler, vehicle)) {
+        return ADMIT_REJECTED;
+    }
+    vehicle->arrival_ns = now_ns();
+    struct Shard *home = vehicle_shard(scheduler, vehicle);
+    bool kick = false;
 
-    // Increment priority count
-    scheduler->priority_counts[vehicle->priority]++;
+    shard_lock(scheduler, home);
 
-    // Wait for the highest priority
-    while (vehicle->priority != get_highest_priority(scheduler)) {
-        pthread_cond_wait(&scheduler->lock_cv, &scheduler->lock);
+    bool arrived;
+    struct Tunnel *assigned_tunnel = admit_or_count(scheduler, home, vehicle, &arrived, &kick);
+    if (!assigned_tunnel) {
+        struct Waiter *waiter = slab_alloc(&waiter_slab);
+        *waiter = (struct Waiter){
+            .vehicle = scheduler_ref(scheduler, vehicle),
+            .tunnel = -1,
+            .callback = callback,
+            .arg = arg,
+        };
+        enqueue_waiter(scheduler, home, waiter, arrived);
     }
 
-    // Attempt to find a tunnel
-    struct Tunnel *assigned_tunnel = NULL;
-    for (int i = 0; i < scheduler->num_tunnels; i++) {
-        if (tunnel_try_to_enter(scheduler->tunnels[i], vehicle)) {
-            assigned_tunnel = scheduler->tunnels[i];
-            hashmap_put(scheduler->tunnel_map, vehicle, assigned_tunnel);
-            break;
-        }
+    shard_unlock(scheduler, home);
+
+    if (!assigned_tunnel && scheduler->num_shards > 1) {
+        steal_room(scheduler, home, &kick);
     }
+    kick_shards(scheduler, kick);
 
-    // If no tunnel was found, decrement priority and signal others
-    if (!assigned_tunnel) {
-        scheduler->priority_counts[vehicle->priority]--;
-        pthread_cond_broadcast(&scheduler->lock_cv);
+    *tunnel = assigned_tunnel;
+    return assigned_tunnel ? ADMIT_ENTERED : ADMIT_QUEUED;
+}
+
+/**
+ * @brief Withdraws a waiting vehicle from admission.
+ *
+ * The vehicle is taken out of its queue and the priority counts as by a timeout in
+ * `scheduler_admit_timed`, and an ENTER_CANCELLED event is logged for it. See
+ * `scheduler_cancel_reason`.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle to withdraw.
+ * @return Whether the vehicle was waiting.
+ */
+bool scheduler_cancel(PriorityScheduler *scheduler, struct Vehicle *vehicle) {
+    return scheduler_cancel_reason(scheduler, vehicle, ENTER_CANCELLED);
+}
+
+/**
+ * @brief Withdraws a waiting vehicle from admission, logging why it was withdrawn.
+ *
+ * The vehicle is taken out of its queue and the priority counts as by a timeout in
+ * `scheduler_admit_timed`, and the given event is logged for it. A vehicle blocked in
+ * `scheduler_admit` or `scheduler_admit_timed` on another thread is woken and returns NULL; the
+ * callback of a vehicle queued by `scheduler_admit_async` is run with a NULL tunnel, with the
+ * vehicle's shard locked as for an admission. Must not be called from an admission callback.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicle The vehicle to withdraw.
+ * @param event ENTER_CANCELLED, or ENTER_TIMEOUT for a vehicle that ran out of patience while queued
+ *              by `scheduler_admit_async`.
+ * @return Whether the vehicle was waiting. If not, it was either admitted already or never queued,
+ *         and nothing is changed.
+ */
+bool scheduler_cancel_reason(PriorityScheduler *scheduler, struct Vehicle *vehicle, enum EventType event) {
+    SET_LOCK_SITE(LOCK_SITE_OTHER);
+    struct Shard *home = vehicle_shard(scheduler, vehicle);
+    bool kick = false;
+
+    shard_lock(scheduler, home);
+
+    // The waiter of a shared scheduler stays with the vehicle until its admission call returns
+    struct Waiter *waiter = vehicle->waiter;
+    bool waiting = waiter != NULL && waiter->tunnel < 0 && !waiter->cancelled;
+    if (waiting) {
+        remove_waiter(scheduler, home, waiter, event, &kick);
+        if (waiter->callback != NULL) {
+            waiter->callback(vehicle, NULL, waiter->arg);
+            slab_free(&waiter_slab, waiter);
+        } else {
+            waiter->cancelled = true;
+            pthread_cond_signal(&waiter->cv);
+        }
     }
 
-    pthread_mutex_unlock(&scheduler->lock);
+    shard_unlock(scheduler, home);
 
-    return assigned_tunnel;
+    kick_shards(scheduler, kick);
+
+    return waiting;
+}
+
+/**
+ * @brief Takes a vehicle of the calling process out of a tunnel of a shared scheduler, and the
+ *        process out of the tunnel's owners.
+ *
+ * The owner goes first, so that a tunnel never has more owners than vehicles, even if the process
+ * dies in between.
+ *
+ * @param scheduler The shared PriorityScheduler.
+ * @param tunnel The tunnel, whose shard is locked.
+ * @param vehicle The vehicle.
+ */
+static void exit_owned_tunnel(PriorityScheduler *scheduler, struct Tunnel *tunnel, struct Vehicle *vehicle) {
+    drop_owner(scheduler, tunnel->id, scheduler->pid);
+    tunnel_exit(tunnel, vehicle);
 }
 
 /**
  * @brief Exits a vehicle from its assigned tunnel.
- * 
+ *
+ * The vehicle leaves the tunnel without any lock held, since a tunnel's occupancy is a single
+ * atomic word. Only then is the tunnel's shard locked, to bring its index up to date and hand the
+ * freed room straight to the waiters that can use it, those of the tunnel's own shard first.
+ * Until then the index still counts the vehicle, so no other vehicle is placed in the room early.
+ * In a shared scheduler the vehicle leaves with the shard locked instead, so that the owners of the
+ * tunnel stay in step with its occupancy.
+ *
  * @param scheduler The PriorityScheduler.
  * @param vehicle The vehicle to exit.
  */
 void scheduler_exit(PriorityScheduler *scheduler, struct Vehicle *vehicle) {
-    pthread_mutex_lock(&scheduler->lock);
+    SET_LOCK_SITE(LOCK_SITE_EXIT);
+    struct Shard *home = vehicle_shard(scheduler, vehicle);
+
+    shard_lock(scheduler, home);
 
     // Find and remove the vehicle from its assigned tunnel
-    struct Tunnel *tunnel = hashmap_remove(scheduler->tunnel_map, vehicle);
-    if (tunnel) {
+    struct Tunnel *tunnel = hashmap_remove(scheduler->tunnel_maps[shard_number(scheduler, home)], vehicle);
+    shard_unlock(scheduler, home);
+    if (!tunnel) {
+        return;
+    }
+    record_exit(scheduler, vehicle, now_ns());
+    if (scheduler->name == NULL) {
         tunnel_exit(tunnel, vehicle);
     }
 
-    scheduler->priority_counts[vehicle->priority]--;
-    pthread_cond_broadcast(&scheduler->lock_cv);
+    struct Shard *shard = &scheduler->shards[scheduler->tunnel_shards[tunnel->id]];
+    bool kick = false;
+    shard_lock(scheduler, shard);
+    if (scheduler->name != NULL) {
+        exit_owned_tunnel(scheduler, tunnel, vehicle);
+    }
+    shard_update(scheduler, shard, tunnel);
+    dispatch_waiters(scheduler, shard, shard, &kick);
+
+    shard_unlock(scheduler, shard);
+
+    if (scheduler->num_shards > 1) {
+        offer_room(scheduler, shard, &kick);
+        kick_shards(scheduler, kick);
+    }
+}
+
+/**
+ * @brief Admits as many of the given vehicles as can enter a tunnel right now, without blocking.
+ *
+ * Meant for platoons of vehicles of the same type and direction. The vehicles are placed under a
+ * single acquisition of each home shard involved, so a platoon fills partially used tunnels of its
+ * class up to `tunnel_capacities` before starting on empty ones. A vehicle is only placed when
+ * `scheduler_admit` would have let it in without waiting. Vehicles that are not placed are left
+ * to the caller, who can admit them one at a time.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicles The vehicles to admit.
+ * @param num_vehicles The number of vehicles.
+ * @param tunnels Where to store the tunnel of each vehicle, or NULL for those not admitted.
+ * @return The number of vehicles admitted.
+ */
+int scheduler_admit_batch(PriorityScheduler *scheduler, struct Vehicle **vehicles, int num_vehicles,
+                          struct Tunnel **tunnels) {
+    SET_LOCK_SITE(LOCK_SITE_ADMIT);
+    int admitted = 0;
+    bool kick = false;
+    long long arrival_ns = now_ns();
+    for (int i = 0; i < num_vehicles; i++) {
+        vehicles[i]->arrival_ns = arrival_ns;
+    }
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *home = &scheduler->shards[k];
+        bool locked = false;
+        for (int i = 0; i < num_vehicles; i++) {
+            struct Vehicle *vehicle = vehicles[i];
+            if (vehicle_shard(scheduler, vehicle) != home) {
+                continue;
+            }
+            if (!valid_priority(scheduler, vehicle)) {
+                tunnels[i] = NULL;
+                continue;
+            }
+            if (!locked) {
+                shard_lock(scheduler, home);
+                locked = true;
+            }
+            bool arrived;
+            tunnels[i] = admit_or_count(scheduler, home, vehicle, &arrived, &kick);
+            if (tunnels[i] != NULL) {
+                admitted++;
+            } else {
+                uncount_waiting(scheduler, home, vehicle, &kick);
+            }
+        }
+        if (locked) {
+            shard_unlock(scheduler, home);
+        }
+    }
+    kick_shards(scheduler, kick);
+    return admitted;
+}
+
+/**
+ * @brief Exits the given vehicles from their assigned tunnels.
+ *
+ * Equivalent to calling `scheduler_exit` for each vehicle, but each shard involved is locked once
+ * and its waiters are dispatched once, after all of its tunnels have been left.
+ *
+ * @param scheduler The PriorityScheduler.
+ * @param vehicles The vehicles to exit.
+ * @param num_vehicles The number of vehicles.
+ */
+void scheduler_exit_batch(PriorityScheduler *scheduler, struct Vehicle **vehicles, int num_vehicles) {
+    SET_LOCK_SITE(LOCK_SITE_EXIT);
+    struct Tunnel **tunnels = malloc(num_vehicles * sizeof *tunnels);
+    if (num_vehicles > 0 && !tunnels) {
+        perror("scheduler_exit_batch: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Drop the vehicles from the tunnel maps of their home shards
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *home = &scheduler->shards[k];
+        bool locked = false;
+        for (int i = 0; i < num_vehicles; i++) {
+            if (vehicle_shard(scheduler, vehicles[i]) != home) {
+                continue;
+            }
+            if (!locked) {
+                shard_lock(scheduler, home);
+                locked = true;
+            }
+            tunnels[i] = hashmap_remove(scheduler->tunnel_maps[k], vehicles[i]);
+        }
+        if (locked) {
+            shard_unlock(scheduler, home);
+        }
+    }
+
+    // Leave the tunnels without a lock unless shared, then update each shard and hand the freed room on
+    long long exit_ns = now_ns();
+    for (int i = 0; i < num_vehicles; i++) {
+        if (tunnels[i] != NULL) {
+            record_exit(scheduler, vehicles[i], exit_ns);
+            if (scheduler->name == NULL) {
+                tunnel_exit(tunnels[i], vehicles[i]);
+            }
+        }
+    }
+    bool kick = false;
+    for (int k = 0; k < scheduler->num_shards; k++) {
+        struct Shard *shard = &scheduler->shards[k];
+        bool locked = false;
+        for (int i = 0; i < num_vehicles; i++) {
+            if (tunnels[i] == NULL || scheduler->tunnel_shards[tunnels[i]->id] != k) {
+                continue;
+            }
+            if (!locked) {
+                shard_lock(scheduler, shard);
+                locked = true;
+            }
+            if (scheduler->name != NULL) {
+                exit_owned_tunnel(scheduler, tunnels[i], vehicles[i]);
+            }
+            shard_update(scheduler, shard, tunnels[i]);
+        }
+        if (locked) {
+            dispatch_waiters(scheduler, shard, shard, &kick);
+            shard_unlock(scheduler, shard);
+            if (scheduler->num_shards > 1) {
+                offer_room(scheduler, shard, &kick);
+            }
+        }
+    }
+    kick_shards(scheduler, kick);
 
-    pthread_mutex_unlock(&scheduler->lock);
+    free(tunnels);
 }
@@ -2,16 +2,85 @@
 #define PRIORITY_SCHEDULER_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include "tunnel.h"
 #include "hashmap.h"
+#include "histogram.h"
 #include "logger.h"
 
+#define SCHEDULER_MAX_PRIORITIES 256
+
 typedef struct PriorityScheduler PriorityScheduler;
 
-PriorityScheduler  *scheduler_create(int num_tunnels, struct Tunnel **tunnels);
+enum SchedulerPolicy {
+    SCHEDULER_POLICY_STRICT,
+    SCHEDULER_POLICY_FAIR,
+    NUM_SCHEDULER_POLICIES,
+};
+
+extern const char *const scheduler_policy_names[];
+
+enum AdmitStatus {
+    ADMIT_ENTERED,
+    ADMIT_QUEUED,
+    ADMIT_REJECTED,
+};
+
+typedef void (*AdmitCallback)(struct Vehicle *vehicle, struct Tunnel *tunnel, void *arg);
+
+struct SchedulerCounters {
+    unsigned long admissions;
+    unsigned long wakeups;
+    unsigned long tunnel_flips;
+    unsigned long convoys;
+    unsigned long convoy_vehicles;
+    unsigned long convoy_capacity;
+};
+
+struct SchedulerSnapshot {
+    int num_tunnels;
+    struct TunnelOccupancy *tunnels;
+    int num_priorities;
+    int waiting[SCHEDULER_MAX_PRIORITIES];
+};
+
+struct SchedulerStats {
+    int num_priorities;
+    struct HistogramSummary wait[SCHEDULER_MAX_PRIORITIES];
+    struct HistogramSummary wait_by_type[NUM_VEHICLE_TYPES];
+    struct HistogramSummary occupancy[SCHEDULER_MAX_PRIORITIES];
+    struct HistogramSummary occupancy_by_type[NUM_VEHICLE_TYPES];
+};
+
+PriorityScheduler  *scheduler_create(int num_tunnels, struct Tunnel **tunnels, int num_priorities);
+PriorityScheduler  *scheduler_create_sharded(int num_tunnels, struct Tunnel **tunnels, int num_priorities,
+                                             int num_shards);
+PriorityScheduler  *scheduler_create_shared(const char *name, int num_tunnels, int num_priorities, int num_shards,
+                                            int max_waiters, Log *log);
+PriorityScheduler  *scheduler_open_shared(const char *name, Log *log);
+void                scheduler_close(PriorityScheduler *scheduler);
 void                scheduler_destroy(PriorityScheduler *scheduler);
+int                 scheduler_num_priorities(PriorityScheduler *scheduler);
+int                 scheduler_num_tunnels(PriorityScheduler *scheduler);
+struct Tunnel      *scheduler_tunnel(PriorityScheduler *scheduler, int id);
+void                scheduler_set_convoy_window(PriorityScheduler *scheduler, int window);
+void                scheduler_set_policy(PriorityScheduler *scheduler, enum SchedulerPolicy policy, const int *shares);
 
 struct Tunnel      *scheduler_admit(PriorityScheduler *scheduler, struct Vehicle *vehicle);
+struct Tunnel      *scheduler_admit_timed(PriorityScheduler *scheduler, struct Vehicle *vehicle, long long deadline_ns);
+enum AdmitStatus    scheduler_admit_async(PriorityScheduler *scheduler, struct Vehicle *vehicle,
+                                          AdmitCallback callback, void *arg, struct Tunnel **tunnel);
+bool                scheduler_cancel(PriorityScheduler *scheduler, struct Vehicle *vehicle);
+bool                scheduler_cancel_reason(PriorityScheduler *scheduler, struct Vehicle *vehicle,
+                                            enum EventType event);
 void                scheduler_exit(PriorityScheduler *scheduler, struct Vehicle *vehicle);
 
+int                 scheduler_admit_batch(PriorityScheduler *scheduler, struct Vehicle **vehicles, int num_vehicles,
+                                          struct Tunnel **tunnels);
+void                scheduler_exit_batch(PriorityScheduler *scheduler, struct Vehicle **vehicles, int num_vehicles);
+
+void                scheduler_get_counters(PriorityScheduler *scheduler, struct SchedulerCounters *counters);
+int                 scheduler_snapshot(PriorityScheduler *scheduler, struct SchedulerSnapshot *snapshot);
+void                scheduler_stats(PriorityScheduler *scheduler, struct SchedulerStats *stats);
+
 #endif
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "admit_queue.h"
+#include "logger.h"
+#include "priority_scheduler.h"
+#include "tunnel.h"
+#include "vehicle.h"
+
+/* Measures the scheduler alone: vehicles are admitted and exit again straight away, without
+ * crossing time, from a number of threads or from a single event loop using
+ * `scheduler_try_admit`. Each run prints one CSV row with the admit/exit throughput, percentiles
+ * of the time spent in admission, how often parked threads were woken per admission, and how
+ * often tunnels flipped type or direction and how full they got. With -r, reader threads poll
+ * `scheduler_snapshot` in a tight loop during the run, to show what monitoring costs admission;
+ * the row then also counts the snapshots taken and how many had to be retried. With -s
+ * the bench sweeps threads, tunnels, priority distributions and CAR/SLED mixes instead.
+ *
+ * Build: make scheduler_bench
+ * Usage: scheduler_bench [-s] [-t threads] [-n tunnels] [-v vehicles per thread] [-p uniform|skewed|flat]
+ *        [-l priority levels] [-m sled percent] [-k shards] [-b platoon size] [-c convoy window]
+ *        [-e] [-r readers]
+ */
+
+enum PriorityMix {
+    PRIORITY_UNIFORM,
+    PRIORITY_SKEWED,
+    PRIORITY_FLAT,
+    NUM_PRIORITY_MIXES,
+};
+
+static const char *const priority_mix_names[] = {
+    [PRIORITY_UNIFORM] = "uniform",
+    [PRIORITY_SKEWED] = "skewed",
+    [PRIORITY_FLAT] = "flat",
+};
+
+struct BenchConfig {
+    int num_threads;
+    int num_tunnels;
+    int per_thread;
+    enum PriorityMix priorities;
+    int num_levels;
+    int sled_percent;
+    int num_shards;
+    int batch;
+    int convoy_window;
+    bool event_loop;
+    int num_readers;
+};
+
+struct BenchThread {
+    pthread_t thread_id;
+    PriorityScheduler *scheduler;
+    struct Vehicle **vehicles;
+    long long *latencies;
+    int num_vehicles;
+    int batch;
+};
+
+struct SnapshotReader {
+    pthread_t thread_id;
+    PriorityScheduler *scheduler;
+    atomic_bool *stop;
+    struct TunnelOccupancy *tunnels;
+    unsigned long snapshots;
+    unsigned long retries;
+};
+
+static long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Uniform spreads vehicles over all priority levels, skewed sends one in ten above the lowest
+ * level and flat gives every vehicle the same priority. */
+static int random_priority(enum PriorityMix priorities, int num_levels) {
+    switch (priorities) {
+        case PRIORITY_UNIFORM: return rand() % num_levels;
+        case PRIORITY_SKEWED: return num_levels == 1 || rand() % 10 ? 0 : 1 + rand() % (num_levels - 1);
+        default: return 0;
+    }
+}
+
+static void *bench_run(void *arg) {
+    struct BenchThread *bench = arg;
+    struct Tunnel **tunnels = malloc(bench->batch * sizeof *tunnels);
+    struct Vehicle **admitted = malloc(bench->batch * sizeof *admitted);
+    if (tunnels == NULL || admitted == NULL) {
+        perror("scheduler_bench");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < bench->num_vehicles; i += bench->batch) {
+        struct Vehicle **platoon = &bench->vehicles[i];
+        long long *latencies = &bench->latencies[i];
+        int size = bench->num_vehicles - i < bench->batch ? bench->num_vehicles - i : bench->batch;
+        int num_admitted = 0;
+        if (size > 1) {
+            long long start = monotonic_ns();
+            scheduler_admit_batch(bench->scheduler, platoon, size, tunnels);
+            long long latency = monotonic_ns() - start;
+            for (int j = 0; j < size; j++) {
+                if (tunnels[j] != NULL) {
+                    latencies[j] = latency;
+                    admitted[num_admitted++] = platoon[j];
+                }
+            }
+            if (num_admitted > 0) {
+                scheduler_exit_batch(bench->scheduler, admitted, num_admitted);
+            }
+        }
+        // The rest of the platoon goes one at a time, so no thread waits while holding tunnel room
+        for (int j = 0; j < size; j++) {
+            if (size > 1 && tunnels[j] != NULL) {
+                continue;
+            }
+            long long start = monotonic_ns();
+            struct Tunnel *tunnel = scheduler_admit(bench->scheduler, platoon[j]);
+            latencies[j] = monotonic_ns() - start;
+            if (tunnel != NULL) {
+                scheduler_exit(bench->scheduler, platoon[j]);
+            }
+        }
+    }
+    free(tunnels);
+    free(admitted);
+    return NULL;
+}
+
+/* Takes snapshots of the scheduler as fast as it can until told to stop. */
+static void *snapshot_run(void *arg) {
+    struct SnapshotReader *reader = arg;
+    struct SchedulerSnapshot snapshot = { .tunnels = reader->tunnels };
+    while (!atomic_load_explicit(reader->stop, memory_order_relaxed)) {
+        reader->retries += scheduler_snapshot(reader->scheduler, &snapshot);
+        reader->snapshots++;
+    }
+    return NULL;
+}
+
+/* Runs every vehicle from the calling thread: all of them ask for a tunnel up front, and each
+ * leaves as soon as its ticket is collected from the admission queue. The latency of a vehicle
+ * runs until its ticket is collected. Returns the most tickets outstanding at once. */
+static int event_loop(PriorityScheduler *scheduler, struct Vehicle **vehicles, long long *latencies,
+                      int num_vehicles) {
+    AdmitQueue *queue = admit_queue_create();
+    struct AdmitTicket tickets[256];
+    struct pollfd pfd = { .fd = admit_queue_fd(queue), .events = POLLIN };
+    long long *starts = malloc(num_vehicles * sizeof *starts);
+    if (num_vehicles > 0 && starts == NULL) {
+        perror("scheduler_bench");
+        exit(EXIT_FAILURE);
+    }
+    int first_id = num_vehicles > 0 ? vehicles[0]->id : 0;
+    int pending = 0, max_pending = 0;
+
+    for (int i = 0; i < num_vehicles; i++) {
+        unsigned long ticket;
+        starts[i] = monotonic_ns();
+        if (scheduler_try_admit(scheduler, vehicles[i], queue, &ticket) != NULL) {
+            latencies[i] = monotonic_ns() - starts[i];
+            scheduler_exit(scheduler, vehicles[i]);
+        } else if (++pending > max_pending) {
+            max_pending = pending;
+        }
+    }
+    while (pending > 0) {
+        int count = admit_queue_poll(queue, tickets, 256);
+        if (count == 0) {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        long long now = monotonic_ns();
+        pending -= count;
+        for (int i = 0; i < count; i++) {
+            int index = tickets[i].vehicle->id - first_id;
+            latencies[index] = now - starts[index];
+            scheduler_exit(scheduler, tickets[i].vehicle);
+        }
+    }
+
+    free(starts);
+    admit_queue_destroy(queue);
+    return max_pending;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the latency below which the given fraction of the sorted latencies fall. */
+static long long percentile(const long long *sorted, int count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    int index = (int)(fraction * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void print_header(void) {
+    printf("mode,threads,tunnels,shards,platoon,priorities,levels,sled_percent,vehicles,seconds,ops_per_sec,"
+           "p50_ns,p99_ns,p999_ns,max_ns,wakeups_per_admission,max_pending,convoy,flips,fill,readers,snapshots,"
+           "snapshot_retries\n");
+}
+
+/* Runs one configuration and prints its CSV row. An admit/exit pair counts as one operation. */
+static void run_bench(const struct BenchConfig *config) {
+    int num_vehicles = config->num_threads * config->per_thread;
+    Log *log = log_create();
+    struct Tunnel **tunnels = tunnels_create(config->num_tunnels, log);
+    PriorityScheduler *scheduler = scheduler_create_sharded(config->num_tunnels, tunnels, config->num_levels,
+                                                            config->num_shards);
+    scheduler_set_convoy_window(scheduler, config->convoy_window);
+    struct Vehicle **vehicles = malloc((size_t)num_vehicles * sizeof *vehicles);
+    long long *latencies = calloc(num_vehicles, sizeof *latencies);
+    struct BenchThread *threads = malloc(config->num_threads * sizeof *threads);
+    struct SnapshotReader *readers = calloc(config->num_readers + 1, sizeof *readers);
+    if ((num_vehicles > 0 && (vehicles == NULL || latencies == NULL)) || threads == NULL || readers == NULL) {
+        perror("scheduler_bench");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    for (int i = 0; i < num_vehicles; i++) {
+        // Platoons share the type, direction and priority of their first vehicle
+        if (i % config->batch) {
+            struct Vehicle *leader = vehicles[i - i % config->batch];
+            vehicles[i] = vehicle_create(leader->vehicle_type, leader->direction, leader->priority, scheduler);
+        } else {
+            enum VehicleType type = rand() % 100 < config->sled_percent ? SLED : CAR;
+            vehicles[i] = vehicle_create(type, rand() % NUM_DIRECTIONS, random_priority(config->priorities, config->num_levels),
+                                         scheduler);
+        }
+    }
+
+    atomic_bool stop = false;
+    for (int i = 0; i < config->num_readers; i++) {
+        readers[i] = (struct SnapshotReader) {
+            .scheduler = scheduler,
+            .stop = &stop,
+            .tunnels = malloc(config->num_tunnels * sizeof *readers[i].tunnels),
+        };
+        if (readers[i].tunnels == NULL) {
+            perror("scheduler_bench");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&readers[i].thread_id, NULL, snapshot_run, &readers[i]) != 0) {
+            perror("scheduler_bench: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int max_pending = 0;
+    long long start = monotonic_ns();
+    if (config->event_loop) {
+        max_pending = event_loop(scheduler, vehicles, latencies, num_vehicles);
+    } else {
+        for (int i = 0; i < config->num_threads; i++) {
+            threads[i] = (struct BenchThread) {
+                .scheduler = scheduler,
+                .vehicles = &vehicles[i * config->per_thread],
+                .latencies = &latencies[i * config->per_thread],
+                .num_vehicles = config->per_thread,
+                .batch = config->batch,
+            };
+            if (pthread_create(&threads[i].thread_id, NULL, bench_run, &threads[i]) != 0) {
+                perror("scheduler_bench: pthread_create");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < config->num_threads; i++) {
+            pthread_join(threads[i].thread_id, NULL);
+        }
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+    atomic_store(&stop, true);
+    unsigned long snapshots = 0;
+    unsigned long snapshot_retries = 0;
+    for (int i = 0; i < config->num_readers; i++) {
+        pthread_join(readers[i].thread_id, NULL);
+        snapshots += readers[i].snapshots;
+        snapshot_retries += readers[i].retries;
+        free(readers[i].tunnels);
+    }
+
+    struct SchedulerCounters counters;
+    scheduler_get_counters(scheduler, &counters);
+    qsort(latencies, num_vehicles, sizeof *latencies, compare_latencies);
+    printf("%s,%d,%d,%d,%d,%s,%d,%d,%d,%.6f,%.0f,%lld,%lld,%lld,%lld,%.3f,%d,%d,%lu,%.3f,%d,%lu,%lu\n",
+            config->event_loop ? "event_loop" : "threads", config->num_threads, config->num_tunnels,
+            config->num_shards, config->batch, priority_mix_names[config->priorities], config->num_levels,
+            config->sled_percent,
+            num_vehicles, seconds, seconds > 0 ? num_vehicles / seconds : 0.0,
+            percentile(latencies, num_vehicles, 0.5), percentile(latencies, num_vehicles, 0.99),
+            percentile(latencies, num_vehicles, 0.999), num_vehicles ? latencies[num_vehicles - 1] : 0,
+            counters.admissions ? (double)counters.wakeups / counters.admissions : 0.0, max_pending,
+            config->convoy_window, counters.tunnel_flips,
+            counters.convoy_capacity ? (double)counters.convoy_vehicles / counters.convoy_capacity : 0.0,
+            config->num_readers, snapshots, snapshot_retries);
+    fflush(stdout);
+
+    for (int i = 0; i < num_vehicles; i++) {
+        vehicle_destroy(vehicles[i]);
+    }
+    free(vehicles);
+    free(latencies);
+    free(threads);
+    free(readers);
+    scheduler_destroy(scheduler);
+    tunnels_destroy(tunnels);
+    log_destroy(log);
+}
+
+/* Sweeps thread and tunnel counts, priority distributions and CAR/SLED mixes around the given
+ * configuration, which supplies the vehicles per thread, shards, platoon size and mode. */
+static void sweep(struct BenchConfig config) {
+    static const int thread_counts[] = { 1, 4, 16, 64 };
+    static const int tunnel_counts[] = { 1, 4, 16, 64 };
+    static const int sled_percents[] = { 0, 10, 50 };
+    for (size_t t = 0; t < sizeof thread_counts / sizeof *thread_counts; t++) {
+        for (size_t n = 0; n < sizeof tunnel_counts / sizeof *tunnel_counts; n++) {
+            for (int p = 0; p < NUM_PRIORITY_MIXES; p++) {
+                for (size_t m = 0; m < sizeof sled_percents / sizeof *sled_percents; m++) {
+                    config.num_threads = thread_counts[t];
+                    config.num_tunnels = tunnel_counts[n];
+                    config.priorities = p;
+                    config.sled_percent = sled_percents[m];
+                    run_bench(&config);
+                }
+            }
+        }
+    }
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-s] [-t threads] [-n tunnels] [-v vehicles] [-p uniform|skewed|flat] [-l levels]"
+            " [-m sled_percent] [-k shards] [-b platoon] [-c window] [-e] [-r readers]\n"
+            "  -l  number of priority levels, at most %d (default: %d)\n"
+            "  -c  group waiting vehicles of a priority into convoys of up to this many (default: 0, off)\n"
+            "  -s  sweep threads, tunnels, priority distributions and sled percentages\n"
+            "  -e  drive all vehicles from one event loop; threads only sets the number of vehicles\n"
+            "  -r  poll scheduler snapshots from this many reader threads during the run (default: 0)\n", program,
+            SCHEDULER_MAX_PRIORITIES, DEFAULT_NUM_PRIORITIES);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    struct BenchConfig config = {
+        .num_threads = 16,
+        .num_tunnels = 4,
+        .per_thread = 2000,
+        .priorities = PRIORITY_UNIFORM,
+        .num_levels = DEFAULT_NUM_PRIORITIES,
+        .sled_percent = 10,
+        .num_shards = 1,
+        .batch = 1,
+    };
+    bool run_sweep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "st:n:v:p:l:m:k:b:c:er:")) != -1) {
+        switch (opt) {
+            case 's': run_sweep = true; break;
+            case 't': config.num_threads = atoi(optarg); break;
+            case 'n': config.num_tunnels = atoi(optarg); break;
+            case 'v': config.per_thread = atoi(optarg); break;
+            case 'p':
+                for (config.priorities = 0; config.priorities < NUM_PRIORITY_MIXES; config.priorities++) {
+                    if (strcmp(optarg, priority_mix_names[config.priorities]) == 0) {
+                        break;
+                    }
+                }
+                break;
+            case 'l': config.num_levels = atoi(optarg); break;
+            case 'm': config.sled_percent = atoi(optarg); break;
+            case 'k': config.num_shards = atoi(optarg); break;
+            case 'b': config.batch = atoi(optarg); break;
+            case 'c': config.convoy_window = atoi(optarg); break;
+            case 'e': config.event_loop = true; break;
+            case 'r': config.num_readers = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (config.num_threads < 1 || config.num_tunnels < 1 || config.per_thread < 0 || config.batch < 1
+            || config.num_shards < 1 || config.priorities == NUM_PRIORITY_MIXES
+            || config.num_levels < 1 || config.num_levels > SCHEDULER_MAX_PRIORITIES || config.convoy_window < 0
+            || config.num_readers < 0) {
+        usage(argv[0]);
+    }
+
+    print_header();
+    if (run_sweep) {
+        sweep(config);
+    } else {
+        run_bench(&config);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,518 @@
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+#include "priority_scheduler.h"
+#include "tunnel.h"
+#include "vehicle.h"
+
+/* Stress test for a scheduler shared between processes. The processes forked from this one each
+ * open the same scheduler by name and run threads that admit vehicles, hold their tunnel for the
+ * crossing time and exit them again, so that vehicles wait for each other across processes. Every
+ * vehicle checks that the tunnel it was given holds only vehicles of its type and direction, within
+ * capacity, and once every process is done the parent checks that every vehicle was admitted once
+ * and that the tunnels are empty. With -o, the processes also write a shared log file, which
+ * `simulation -r` verifies for the occupancy of every tunnel and the priority order.
+ *
+ * The workload is then run again after killing a process whose vehicles wait at the highest
+ * priority, which the scheduler must reclaim, and once more through the in-process scheduler with
+ * the same number of threads for comparison. Each run prints one CSV row, and the exit status is
+ * non-zero if any check failed.
+ *
+ * Build: make shared_stress
+ * Usage: shared_stress [-P processes] [-t threads per process] [-n tunnels] [-k shards]
+ *        [-v vehicles per thread] [-l priority levels] [-m sled percent] [-c crossing us] [-o log]
+ */
+
+struct StressConfig {
+    int num_processes;
+    int num_threads;
+    int num_tunnels;
+    int num_shards;
+    int per_thread;
+    int num_levels;
+    int sled_percent;
+    int crossing_us;
+    const char *log_path;
+};
+
+/* Filled in by every process, in memory shared with the parent. */
+struct StressResults {
+    atomic_int violations;
+    long long latencies[];
+};
+
+struct StressThread {
+    pthread_t thread_id;
+    PriorityScheduler *scheduler;
+    struct Vehicle **vehicles;
+    long long *latencies;
+    int num_vehicles;
+    int crossing_us;
+    atomic_int *violations;
+};
+
+static long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Returns whether the tunnel holds the vehicle along with vehicles of its own type and direction
+ * only, within capacity. */
+static bool check_tunnel(const struct Tunnel *tunnel, const struct Vehicle *vehicle) {
+    struct TunnelOccupancy occupancy = tunnel_occupancy(tunnel);
+    return occupancy.num_vehicles >= 1 && occupancy.num_vehicles <= tunnel_capacities[vehicle->vehicle_type]
+        && occupancy.vehicle_type == vehicle->vehicle_type && occupancy.direction == vehicle->direction;
+}
+
+static void *stress_run(void *arg) {
+    struct StressThread *stress = arg;
+    for (int i = 0; i < stress->num_vehicles; i++) {
+        struct Vehicle *vehicle = stress->vehicles[i];
+        long long start = monotonic_ns();
+        struct Tunnel *tunnel = scheduler_admit(stress->scheduler, vehicle);
+        stress->latencies[i] = monotonic_ns() - start;
+        if (tunnel == NULL || !check_tunnel(tunnel, vehicle)) {
+            atomic_fetch_add(stress->violations, 1);
+        }
+        if (tunnel == NULL) {
+            continue;
+        }
+        if (stress->crossing_us > 0) {
+            usleep(stress->crossing_us);
+        }
+        scheduler_exit(stress->scheduler, vehicle);
+    }
+    return NULL;
+}
+
+/* Creates the given number of vehicles with random types, directions and priorities, numbered from
+ * `first_id` so that the vehicles of different processes can be told apart in a shared log. */
+static struct Vehicle **create_vehicles(const struct StressConfig *config, int num_vehicles, int first_id,
+                                        PriorityScheduler *scheduler) {
+    struct Vehicle **vehicles = malloc((size_t)(num_vehicles > 0 ? num_vehicles : 1) * sizeof *vehicles);
+    if (vehicles == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_vehicles; i++) {
+        enum VehicleType type = rand() % 100 < config->sled_percent ? SLED : CAR;
+        vehicles[i] = vehicle_create(type, rand() % NUM_DIRECTIONS, rand() % config->num_levels, scheduler);
+        vehicles[i]->id = first_id + i;
+    }
+    return vehicles;
+}
+
+/* Runs the given number of threads over the vehicles. */
+static void run_threads(const struct StressConfig *config, int num_threads, PriorityScheduler *scheduler,
+                        struct Vehicle **vehicles, long long *latencies, atomic_int *violations) {
+    struct StressThread *threads = malloc(num_threads * sizeof *threads);
+    if (threads == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        threads[i] = (struct StressThread){
+            .scheduler = scheduler,
+            .vehicles = &vehicles[i * config->per_thread],
+            .latencies = &latencies[i * config->per_thread],
+            .num_vehicles = config->per_thread,
+            .crossing_us = config->crossing_us,
+            .violations = violations,
+        };
+        if (pthread_create(&threads[i].thread_id, NULL, stress_run, &threads[i]) != 0) {
+            perror("shared_stress: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+    }
+    free(threads);
+}
+
+/* The body of one forked process: opens the scheduler and runs its threads, logging to `log` if it
+ * is not NULL. */
+static void run_process(const struct StressConfig *config, const char *name, int index, Log *log,
+                        struct StressResults *results) {
+    int per_process = config->num_threads * config->per_thread;
+    PriorityScheduler *scheduler = scheduler_open_shared(name, log);
+    srand(index + 1);
+    struct Vehicle **vehicles = create_vehicles(config, per_process, index * per_process + 1, scheduler);
+    run_threads(config, config->num_threads, scheduler, vehicles, &results->latencies[index * per_process],
+                &results->violations);
+    for (int i = 0; i < per_process; i++) {
+        vehicle_destroy(vehicles[i]);
+    }
+    free(vehicles);
+    scheduler_close(scheduler);
+    if (log != NULL) {
+        log_destroy(log);
+    }
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the latency below which the given fraction of the sorted latencies fall. */
+static long long percentile(const long long *sorted, int count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    int index = (int)(fraction * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void print_header(void) {
+    printf("mode,processes,threads,tunnels,levels,sled_percent,vehicles,seconds,ops_per_sec,p50_ns,p99_ns,max_ns,"
+           "wakeups_per_admission,violations\n");
+    fflush(stdout);
+}
+
+static void print_row(const char *mode, const struct StressConfig *config, int num_processes, int num_threads,
+                      long long *latencies, int num_vehicles, double seconds,
+                      const struct SchedulerCounters *counters, int violations) {
+    qsort(latencies, num_vehicles, sizeof *latencies, compare_latencies);
+    printf("%s,%d,%d,%d,%d,%d,%d,%.6f,%.0f,%lld,%lld,%lld,%.3f,%d\n", mode, num_processes, num_threads,
+           config->num_tunnels, config->num_levels, config->sled_percent, num_vehicles, seconds,
+           seconds > 0 ? num_vehicles / seconds : 0.0, percentile(latencies, num_vehicles, 0.5),
+           percentile(latencies, num_vehicles, 0.99), num_vehicles ? latencies[num_vehicles - 1] : 0,
+           counters->admissions ? (double)counters->wakeups / counters->admissions : 0.0, violations);
+    fflush(stdout);
+}
+
+/* Runs the workload over processes sharing a scheduler, checks the outcome and prints its row.
+ * Returns whether every check passed. */
+static bool run_shared(const struct StressConfig *config) {
+    int num_vehicles = config->num_processes * config->num_threads * config->per_thread;
+    size_t results_size = sizeof(struct StressResults) + (size_t)num_vehicles * sizeof(long long);
+    struct StressResults *results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                         -1, 0);
+    pid_t *children = malloc(config->num_processes * sizeof *children);
+    if (results == MAP_FAILED || children == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&results->violations, 0);
+    char name[64];
+    snprintf(name, sizeof name, "/tunnel_stress_%d", (int)getpid());
+    Log *log = config->log_path != NULL ? log_create_mapped(config->log_path) : NULL;
+    PriorityScheduler *shared = scheduler_create_shared(name, config->num_tunnels, config->num_levels,
+                                                        config->num_shards, config->num_processes * config->num_threads,
+                                                        log);
+
+    long long start = monotonic_ns();
+    for (int p = 0; p < config->num_processes; p++) {
+        if ((children[p] = fork()) < 0) {
+            perror("shared_stress: fork");
+            exit(EXIT_FAILURE);
+        }
+        if (children[p] == 0) {
+            run_process(config, name, p, log, results);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    bool passed = true;
+    for (int p = 0; p < config->num_processes; p++) {
+        int status;
+        if (waitpid(children[p], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "shared_stress: process %d failed\n", p);
+            passed = false;
+        }
+    }
+    double seconds = (monotonic_ns() - start) / 1e9;
+
+    struct SchedulerCounters counters;
+    scheduler_get_counters(shared, &counters);
+    int violations = atomic_load(&results->violations);
+    if (violations > 0) {
+        fprintf(stderr, "shared_stress: %d vehicles were given a tunnel they did not fit in\n", violations);
+        passed = false;
+    }
+    if (counters.admissions != (unsigned long)num_vehicles) {
+        fprintf(stderr, "shared_stress: %lu admissions for %d vehicles\n", counters.admissions, num_vehicles);
+        passed = false;
+    }
+    for (int i = 0; i < scheduler_num_tunnels(shared); i++) {
+        if (tunnel_occupancy(scheduler_tunnel(shared, i)).num_vehicles != 0) {
+            fprintf(stderr, "shared_stress: tunnel %d is not empty\n", i);
+            passed = false;
+        }
+    }
+    print_row("shared", config, config->num_processes, config->num_threads, results->latencies, num_vehicles,
+              seconds, &counters, violations);
+
+    scheduler_destroy(shared);
+    if (log != NULL) {
+        log_destroy(log);
+    }
+    munmap(results, results_size);
+    free(children);
+    return passed;
+}
+
+/* Waits until the given number of vehicles of the given priority are waiting, or gives up after
+ * five seconds. Returns whether they were. */
+static bool await_waiting(PriorityScheduler *scheduler, int priority, int count) {
+    struct SchedulerSnapshot *snapshot = malloc(sizeof *snapshot);
+    struct TunnelOccupancy *tunnels = malloc(scheduler_num_tunnels(scheduler) * sizeof *tunnels);
+    if (snapshot == NULL || tunnels == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->tunnels = tunnels;
+    long long give_up = monotonic_ns() + 5000000000LL;
+    bool reached = false;
+    while (!reached && monotonic_ns() < give_up) {
+        scheduler_snapshot(scheduler, snapshot);
+        reached = snapshot->waiting[priority] == count;
+        if (!reached) {
+            usleep(1000);
+        }
+    }
+    free(tunnels);
+    free(snapshot);
+    return reached;
+}
+
+/* The body of the process killed while it waits: parks one vehicle of the highest priority per
+ * thread, which cannot enter, and never returns. */
+static void run_victim(const struct StressConfig *config, const char *name, struct StressResults *results) {
+    PriorityScheduler *scheduler = scheduler_open_shared(name, NULL);
+    struct StressConfig victim = *config;
+    victim.per_thread = 1;
+    struct Vehicle **vehicles = malloc(config->num_threads * sizeof *vehicles);
+    long long *latencies = malloc(config->num_threads * sizeof *latencies);
+    if (vehicles == NULL || latencies == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < config->num_threads; i++) {
+        vehicles[i] = vehicle_create(CAR, SOUTH, config->num_levels - 1, scheduler);
+    }
+    run_threads(&victim, config->num_threads, scheduler, vehicles, latencies, &results->violations);
+    exit(EXIT_FAILURE);
+}
+
+/* Waits for the given processes for up to ten seconds, then kills those still running. Returns
+ * whether every process exited successfully in time. */
+static bool await_processes(pid_t *children, int num_children) {
+    long long give_up = monotonic_ns() + 10000000000LL;
+    bool passed = true;
+    for (int p = 0; p < num_children; p++) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(children[p], &status, WNOHANG)) == 0 && monotonic_ns() < give_up) {
+            usleep(1000);
+        }
+        if (pid == 0) {
+            fprintf(stderr, "shared_stress: process %d is stuck\n", p);
+            kill(children[p], SIGKILL);
+            waitpid(children[p], &status, 0);
+            passed = false;
+        } else if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "shared_stress: process %d failed\n", p);
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+/* Kills a process while its vehicles wait at the highest priority in front of the other processes'
+ * vehicles, which take the lower priorities and so could never be admitted unless the scheduler
+ * reclaims the killed vehicles. This process first fills the only tunnel, so that the killed
+ * process's vehicles have to wait, and empties it once the scheduler has reclaimed them. Checks that the other processes finish, and that the tunnel is empty and no
+ * vehicle waiting at the end, and prints a row. Returns whether every check passed. */
+static bool run_kill(const struct StressConfig *config) {
+    int num_vehicles = config->num_processes * config->num_threads * config->per_thread;
+    size_t results_size = sizeof(struct StressResults) + (size_t)num_vehicles * sizeof(long long);
+    struct StressResults *results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                         -1, 0);
+    pid_t *children = malloc(config->num_processes * sizeof *children);
+    if (results == MAP_FAILED || children == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&results->violations, 0);
+    char name[64];
+    snprintf(name, sizeof name, "/tunnel_stress_kill_%d", (int)getpid());
+    PriorityScheduler *shared = scheduler_create_shared(name, 1, config->num_levels, 1,
+                                                        (config->num_processes + 1) * config->num_threads, NULL);
+    int highest = config->num_levels - 1;
+    struct StressConfig survivors = *config;
+    survivors.num_levels = highest;
+    bool passed = true;
+
+    struct Vehicle *blockers[8];
+    int num_blockers = tunnel_capacities[CAR];
+    for (int i = 0; i < num_blockers; i++) {
+        blockers[i] = vehicle_create(CAR, NORTH, 0, shared);
+        scheduler_admit(shared, blockers[i]);
+    }
+    pid_t victim = fork();
+    if (victim < 0) {
+        perror("shared_stress: fork");
+        exit(EXIT_FAILURE);
+    }
+    if (victim == 0) {
+        run_victim(config, name, results);
+    }
+    if (!await_waiting(shared, highest, config->num_threads)) {
+        fprintf(stderr, "shared_stress: the vehicles to kill did not wait\n");
+        passed = false;
+    }
+    kill(victim, SIGKILL);
+    waitpid(victim, NULL, 0);
+
+    long long start = monotonic_ns();
+    for (int p = 0; p < config->num_processes; p++) {
+        if ((children[p] = fork()) < 0) {
+            perror("shared_stress: fork");
+            exit(EXIT_FAILURE);
+        }
+        if (children[p] == 0) {
+            run_process(&survivors, name, p, NULL, results);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    if (!await_waiting(shared, highest, 0)) {
+        fprintf(stderr, "shared_stress: the killed vehicles are still waiting\n");
+        passed = false;
+    }
+    for (int i = 0; i < num_blockers; i++) {
+        scheduler_exit(shared, blockers[i]);
+        vehicle_destroy(blockers[i]);
+    }
+    passed = await_processes(children, config->num_processes) && passed;
+    double seconds = (monotonic_ns() - start) / 1e9;
+
+    struct SchedulerCounters counters;
+    scheduler_get_counters(shared, &counters);
+    int violations = atomic_load(&results->violations);
+    if (violations > 0) {
+        fprintf(stderr, "shared_stress: %d vehicles were given a tunnel they did not fit in\n", violations);
+        passed = false;
+    }
+    if (tunnel_occupancy(scheduler_tunnel(shared, 0)).num_vehicles != 0) {
+        fprintf(stderr, "shared_stress: the tunnel is not empty after the kill\n");
+        passed = false;
+    }
+    for (int p = 0; p < config->num_levels; p++) {
+        if (!await_waiting(shared, p, 0)) {
+            fprintf(stderr, "shared_stress: vehicles of priority %d are still waiting after the kill\n", p);
+            passed = false;
+        }
+    }
+    print_row("kill", config, config->num_processes, config->num_threads, results->latencies, num_vehicles,
+              seconds, &counters, violations);
+
+    scheduler_destroy(shared);
+    munmap(results, results_size);
+    free(children);
+    return passed;
+}
+
+/* Runs the same number of threads through the in-process scheduler and prints its row. Returns
+ * whether every vehicle fit in its tunnel. */
+static bool run_in_process(const struct StressConfig *config) {
+    int num_threads = config->num_processes * config->num_threads;
+    int num_vehicles = num_threads * config->per_thread;
+    struct Tunnel **tunnels = tunnels_create(config->num_tunnels, NULL);
+    PriorityScheduler *scheduler = scheduler_create_sharded(config->num_tunnels, tunnels, config->num_levels,
+                                                            config->num_shards);
+    long long *latencies = calloc(num_vehicles > 0 ? num_vehicles : 1, sizeof *latencies);
+    if (latencies == NULL) {
+        perror("shared_stress");
+        exit(EXIT_FAILURE);
+    }
+    srand(1);
+    struct Vehicle **vehicles = create_vehicles(config, num_vehicles, 1, scheduler);
+    atomic_int violations;
+    atomic_init(&violations, 0);
+
+    long long start = monotonic_ns();
+    run_threads(config, num_threads, scheduler, vehicles, latencies, &violations);
+    double seconds = (monotonic_ns() - start) / 1e9;
+
+    struct SchedulerCounters counters;
+    scheduler_get_counters(scheduler, &counters);
+    print_row("in_process", config, 1, num_threads, latencies, num_vehicles, seconds, &counters,
+              atomic_load(&violations));
+
+    for (int i = 0; i < num_vehicles; i++) {
+        vehicle_destroy(vehicles[i]);
+    }
+    free(vehicles);
+    free(latencies);
+    scheduler_destroy(scheduler);
+    tunnels_destroy(tunnels);
+    return atomic_load(&violations) == 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-P processes] [-t threads] [-n tunnels] [-k shards] [-v vehicles] [-l levels]"
+            " [-m sled_percent] [-c crossing_us] [-o log]\n"
+            "  -P  number of processes sharing the scheduler (default: 4)\n"
+            "  -t  number of threads per process (default: 4)\n"
+            "  -n  number of tunnels (default: 4)\n"
+            "  -k  number of scheduler shards (default: 1)\n"
+            "  -v  number of vehicles per thread (default: 20000)\n"
+            "  -l  number of priority levels, at most %d (default: %d)\n"
+            "  -m  percentage of vehicles that are SLEDs (default: 10)\n"
+            "  -c  microseconds each vehicle holds its tunnel for (default: 10)\n"
+            "  -o  file to log the processes sharing the scheduler to, see simulation -r\n", program,
+            SCHEDULER_MAX_PRIORITIES,
+            DEFAULT_NUM_PRIORITIES);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    struct StressConfig config = {
+        .num_processes = 4,
+        .num_threads = 4,
+        .num_tunnels = 4,
+        .num_shards = 1,
+        .per_thread = 20000,
+        .num_levels = DEFAULT_NUM_PRIORITIES,
+        .sled_percent = 10,
+        .crossing_us = 10,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "P:t:n:k:v:l:m:c:o:")) != -1) {
+        switch (opt) {
+            case 'P': config.num_processes = atoi(optarg); break;
+            case 't': config.num_threads = atoi(optarg); break;
+            case 'n': config.num_tunnels = atoi(optarg); break;
+            case 'k': config.num_shards = atoi(optarg); break;
+            case 'v': config.per_thread = atoi(optarg); break;
+            case 'l': config.num_levels = atoi(optarg); break;
+            case 'm': config.sled_percent = atoi(optarg); break;
+            case 'c': config.crossing_us = atoi(optarg); break;
+            case 'o': config.log_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (config.num_processes < 1 || config.num_threads < 1 || config.num_tunnels < 1 || config.num_shards < 1
+            || config.per_thread < 0 || config.num_levels < 1 || config.num_levels > SCHEDULER_MAX_PRIORITIES
+            || config.crossing_us < 0) {
+        usage(argv[0]);
+    }
+
+    print_header();
+    bool passed = run_shared(&config);
+    if (config.num_levels > 1) {
+        passed = run_kill(&config) && passed;
+    }
+    passed = run_in_process(&config) && passed;
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,132 +1,387 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "vehicle.h"
 #include "priority_scheduler.h"
 #include "logger.h"
 #include "thread.h"
-#include "hashmap.h"
+#include "trace.h"
+#include "verifier.h"
+#include "worker_pool.h"
 
-struct TunnelState {
+enum ExecutionMode {
+    MODE_THREADS,
+    MODE_POOL,
+    MODE_DISCRETE_EVENT,
+};
+
+/* How many unread events each thread may have in the log while it is verified online. */
+#define ONLINE_LOG_EVENTS 4096
+
+struct SimulationOptions {
+    int num_tunnels;
     int num_vehicles;
-    enum VehicleType vehicle_type;
-    enum Direction direction;
+    const char *log_path;
+    enum LogLevel log_level;
+    enum ExecutionMode mode;
+    int num_workers;
+    int num_shards;
+    int num_priorities;
+    int convoy_window;
+    long long patience_ns;
+    int policy;
+    const char *shares_list;
+    int shares[SCHEDULER_MAX_PRIORITIES];
+    int verify_threads;
+    bool verify_online;
+    const char *trace_path;
+    const char *record_path;
+    int arrival_pattern;
+    double arrival_rate;
+    unsigned long long seed;
+    bool print_stats;
 };
 
-static void remove_from_tunnel(struct TunnelState *tunnel_state) {
-    tunnel_state->num_vehicles--;
+/** @brief  Prints one line of a wait or occupancy table, in microseconds. */
+static void print_summary(const char *label, const struct HistogramSummary *summary) {
+    printf("  %-10s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", label, summary->count, summary->mean / 1e3,
+            summary->p50 / 1e3, summary->p99 / 1e3, summary->p999 / 1e3, summary->max / 1e3);
+}
+
+/** @brief  Prints the wait and occupancy times of the scheduler per priority and vehicle type, then
+ *          how often tunnels changed type or direction and how full they got.
+ *
+ *  @param  scheduler   The scheduler.
+ *  @return Void.
+ */
+static void print_stats(PriorityScheduler *scheduler) {
+    static const char *const type_names[] = { [CAR] = "CAR", [SLED] = "SLED" };
+    struct SchedulerStats stats;
+    scheduler_stats(scheduler, &stats);
+    for (int table = 0; table < 2; table++) {
+        const struct HistogramSummary *by_priority = table ? stats.occupancy : stats.wait;
+        const struct HistogramSummary *by_type = table ? stats.occupancy_by_type : stats.wait_by_type;
+        printf("%s (us)      count       mean        p50        p99       p999        max\n",
+                table ? "Occupancy" : "Wait     ");
+        for (int p = stats.num_priorities - 1; p >= 0; p--) {
+            char label[24];
+            snprintf(label, sizeof label, "priority %d", p);
+            print_summary(label, &by_priority[p]);
+        }
+        for (int t = 0; t < NUM_VEHICLE_TYPES; t++) {
+            print_summary(type_names[t], &by_type[t]);
+        }
+    }
+    struct SchedulerCounters counters;
+    scheduler_get_counters(scheduler, &counters);
+    printf("Tunnels: %lu convoys, %lu flips, %.1f%% average fill\n", counters.convoys, counters.tunnel_flips,
+            counters.convoy_capacity ? 100.0 * counters.convoy_vehicles / counters.convoy_capacity : 0.0);
 }
 
-static void put_in_tunnel(struct TunnelState *tunnel_state, struct Vehicle *vehicle) {
-    tunnel_state->num_vehicles++;
-    tunnel_state->vehicle_type = vehicle->vehicle_type;
-    tunnel_state->direction = vehicle->direction;
+/** @brief  Returns the admission order the log is checked against, given the scheduling policy. */
+static struct AdmissionOrder admission_order(const struct SimulationOptions *options) {
+    return (struct AdmissionOrder){
+        .num_priorities = options->num_priorities,
+        .shares = options->policy == SCHEDULER_POLICY_FAIR ? options->shares : NULL,
+    };
 }
 
-static bool should_enter(struct TunnelState *tunnel_state, struct Vehicle *vehicle) {
-    if (tunnel_state->num_vehicles == 0) {
-        return true;
+/** @brief  Fills in the share of each priority level from a comma-separated list, lowest first.
+ *
+ *  Without a list priority p gets a share of p + 1, as in the scheduler.
+ *
+ *  @param  options The simulation options, whose shares to fill in.
+ *  @return Whether the list has one positive share per level.
+ */
+static bool parse_shares(struct SimulationOptions *options) {
+    const char *list = options->shares_list;
+    for (int p = 0; p < options->num_priorities; p++) {
+        if (list == NULL) {
+            options->shares[p] = p + 1;
+            continue;
+        }
+        char *end;
+        long share = strtol(list, &end, 10);
+        if (end == list || share < 1 || share > INT_MAX || *end != (p + 1 < options->num_priorities ? ',' : '\0')) {
+            return false;
+        }
+        options->shares[p] = (int)share;
+        list = end + 1;
     }
-    if (tunnel_state->vehicle_type != vehicle->vehicle_type || tunnel_state->direction != vehicle->direction) {
-        return false;
+    return true;
+}
+
+/** @brief  Verifies a finished log, on several threads if the options ask for it.
+ *
+ *  @param  log     The log to verify.
+ *  @param  options The simulation options.
+ *  @return Void.
+ */
+static void verify(Log *log, const struct SimulationOptions *options) {
+    struct AdmissionOrder order = admission_order(options);
+    if (options->verify_threads > 1) {
+        verify_log_parallel(log, options->num_tunnels, options->num_vehicles, &order, options->verify_threads);
+    } else {
+        verify_log(log, options->num_tunnels, options->num_vehicles, &order);
     }
-    return tunnel_state->num_vehicles < tunnel_capacities[vehicle->vehicle_type];
 }
 
-static void verify_log(Log *log, int num_tunnels, int num_vehicles) {
-    struct TunnelState *tunnel_states = calloc(num_tunnels, sizeof *tunnel_states);
-    if (tunnel_states == NULL) {
-        perror("verify_log");
-        exit(EXIT_FAILURE);
+/** @brief  Returns the vehicles to simulate, as set by the options.
+ *
+ *  The trace is read from a file, generated with an arrival pattern, or otherwise made of vehicles
+ *  that all arrive at the start: one more top priority northbound SLED than there are tunnels,
+ *  then vehicles drawn with `rand`. The seed option seeds whichever generator is used.
+ *
+ *  @param  options The simulation options.
+ *  @return Pointer to the trace.
+ */
+static struct Trace *load_trace(const struct SimulationOptions *options) {
+    if (options->trace_path) {
+        return trace_read(options->trace_path);
     }
-    HashMap *tunnel_map = hashmap_create(&vehicle_hash);
-    int last_attempt_priority = HIGHEST_PRIORITY;
-    int num_enter = 0;
-    int num_leave = 0;
-    struct Event *current_event = log_get_head(log);
-    while (current_event != NULL) {
-        struct TunnelState *tunnel_state = &tunnel_states[current_event->tunnel->id];
-        switch (current_event->event_type) {
-            case ENTER_ATTEMPT:
-                if (current_event->vehicle->priority > last_attempt_priority) {
-                    print_event(current_event);
-                    printf("Vehicle waited for lower priority vehicle\n");
-                }
-                last_attempt_priority = current_event->vehicle->priority;
-                break;
-            case ENTER_SUCCESS:
-                print_event(current_event);
-                num_enter++;
-                if (should_enter(tunnel_state, current_event->vehicle)) {
-                    put_in_tunnel(tunnel_state, current_event->vehicle);   
-                    hashmap_put(tunnel_map, current_event->vehicle, current_event->tunnel);
-                } else if (hashmap_get(tunnel_map, current_event->vehicle) != NULL) {
-                    printf("Vehicle is already in a tunnel.\n");
-                } else {
-                    printf("Vehicle should not have entered tunnel.\n");
-                }
-                break;
-            case ENTER_FAILED:
-                if (should_enter(tunnel_state, current_event->vehicle)) {
-                    print_event(current_event);
-                    printf("Vehicle should have entered tunnel.\n");
-                }
-                break;
-            case LEAVE_START:
-                break;
-            case LEAVE_END:
-                print_event(current_event);
-                num_leave++;
-                if (hashmap_remove(tunnel_map, current_event->vehicle) == NULL) {
-                    printf("Vehicle was not in a tunnel.\n");
-                } 
-                remove_from_tunnel(tunnel_state);
-                break;
-            case END_TEST:
-                break;
-            default:
-                printf("Error\n");
-        }
-        free(current_event);
-        current_event = log_get_head(log);
+    if (options->arrival_pattern >= 0) {
+        return trace_generate(options->arrival_pattern, options->num_vehicles, options->arrival_rate,
+                              options->num_priorities, options->seed);
     }
-    if (num_enter != num_vehicles) {
-        printf("Not all %d vehicles entered a tunnel.\n", num_vehicles);
-    } else if (num_leave != num_vehicles) {
-        printf("Not all %d vehicles left a tunnel.\n", num_vehicles);
-    } else {
-        printf("All %d vehicles entered and left a tunnel correctly.\n", num_vehicles);
+    struct Trace *trace = trace_create(options->num_vehicles);
+    srand(options->seed);
+    for (int i = 0; i < options->num_vehicles; i++) {
+        if (i <= options->num_tunnels) {
+            trace->entries[i] = (struct TraceEntry){ .vehicle_type = SLED, .direction = NORTH,
+                                                     .priority = options->num_priorities - 1 };
+        } else {
+            trace->entries[i] = (struct TraceEntry){ .vehicle_type = rand() % NUM_VEHICLE_TYPES,
+                                                     .direction = rand() % NUM_DIRECTIONS,
+                                                     .priority = rand() % options->num_priorities };
+        }
     }
-    hashmap_destroy(tunnel_map);
-    free(tunnel_states);
+    return trace;
 }
 
-void run_simulation(int num_tunnels, int num_vehicles) {
-    Log *log = log_create();
+/** @brief  Runs a simulation with the given options and verifies its log.
+ *
+ *  With a log path, the log is written to that binary file during the run and verified by
+ *  replaying the file afterwards instead of being kept in memory. With online verification, the
+ *  log is instead checked by a verifier thread while the simulation runs and is never kept whole.
+ *  With a summary log only one event is logged per admission, and with logging off the run is not
+ *  verified at all. Vehicles either run on a thread each, or as tasks on a fixed pool of worker threads. The
+ *  discrete-event mode is the pool driven by a virtual clock, so crossings take no real time.
+ *  Either way each vehicle asks for a tunnel at its arrival time in the trace, and gives up if it
+ *  has waited longer than the patience, if the options set one.
+ *
+ *  @param  options The simulation options.
+ *  @param  trace   The vehicles to simulate, as many as the options say.
+ *  @return Void.
+ */
+static void run_simulation(const struct SimulationOptions *options, const struct Trace *trace) {
+    int num_tunnels = options->num_tunnels;
+    int num_vehicles = options->num_vehicles;
+    Log *log;
+    Verifier *verifier = NULL;
+    if (options->log_path) {
+        log = log_create_mapped(options->log_path);
+    } else if (options->verify_online) {
+        log = log_create_bounded(ONLINE_LOG_EVENTS);
+        struct AdmissionOrder order = admission_order(options);
+        verifier = verifier_create(num_tunnels, num_vehicles, &order);
+        verifier_start(verifier, log);
+    } else {
+        log = log_create();
+    }
+    log_set_level(log, options->log_level);
     struct Tunnel **tunnels = tunnels_create(num_tunnels, log);
-    struct PriorityScheduler *scheduler = scheduler_create(num_tunnels, tunnels);
-    struct ThreadData threads[num_vehicles];
+    struct PriorityScheduler *scheduler = scheduler_create_sharded(num_tunnels, tunnels, options->num_priorities,
+                                                                    options->num_shards);
+    scheduler_set_convoy_window(scheduler, options->convoy_window);
+    scheduler_set_policy(scheduler, options->policy, options->shares);
+    struct Vehicle **vehicles = malloc(num_vehicles * sizeof *vehicles);
+    long long *arrivals = malloc(num_vehicles * sizeof *arrivals);
+    if (num_vehicles > 0 && (vehicles == NULL || arrivals == NULL)) {
+        perror("run_simulation");
+        exit(EXIT_FAILURE);
+    }
 
     for (int i = 0; i < num_vehicles; i++) {
-        if (i <= num_tunnels) {
-            threads[i].vehicle = vehicle_create(SLED, NORTH, HIGHEST_PRIORITY, scheduler);
-        } else {
-            threads[i].vehicle = vehicle_random(scheduler);
+        const struct TraceEntry *entry = &trace->entries[i];
+        vehicles[i] = vehicle_create(entry->vehicle_type, entry->direction, entry->priority, scheduler);
+        arrivals[i] = entry->arrival_ns;
+    }
+    if (options->mode == MODE_POOL) {
+        worker_pool_run(scheduler, vehicles, num_vehicles, arrivals, options->num_workers, options->patience_ns,
+                        POOL_CLOCK_REAL);
+    } else if (options->mode == MODE_DISCRETE_EVENT) {
+        worker_pool_run(scheduler, vehicles, num_vehicles, arrivals, options->num_workers, options->patience_ns,
+                        POOL_CLOCK_VIRTUAL);
+    } else {
+        struct ThreadData *threads = malloc(num_vehicles * sizeof *threads);
+        if (threads == NULL) {
+            perror("run_simulation");
+            exit(EXIT_FAILURE);
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long start = now.tv_sec * 1000000000LL + now.tv_nsec;
+        for (int i = 0; i < num_vehicles; i++) {
+            threads[i].vehicle = vehicles[i];
+            threads[i].start_ns = arrivals[i] > 0 ? start + arrivals[i] : 0;
+            threads[i].patience_ns = options->patience_ns;
+            thread_start(&threads[i]);
         }
-        thread_start(&threads[i]);
+        for (int i = 0; i < num_vehicles; i++) {
+            thread_join(&threads[i]);
+        }
+        free(threads);
     }
-    for (int i = 0; i < num_vehicles; i++) {
-        thread_join(&threads[i]);
+    if (verifier) {
+        verifier_join(verifier);
+        verifier_destroy(verifier);
+    } else if (options->log_level == LOG_OFF) {
+        printf("Logging was off, so the run was not verified.\n");
+    } else {
+        if (options->log_path) {
+            log_destroy(log);
+            log = log_open(options->log_path);
+        }
+        verify(log, options);
+    }
+    if (options->print_stats) {
+        print_stats(scheduler);
     }
-    verify_log(log, num_tunnels, num_vehicles);
     tunnels_destroy(tunnels);
     log_destroy(log);
     scheduler_destroy(scheduler);
     for (int i = 0; i < num_vehicles; i++) {
-        free(threads[i].vehicle);
+        vehicle_destroy(vehicles[i]);
     }
+    free(vehicles);
+    free(arrivals);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-t tunnels] [-v vehicles] [-p | -d] [-w workers] [-k shards] [-P levels]\n"
+            "          [-f strict|fair [-W shares]] [-c window] [-T patience] [-o | -j threads] [-s] [-l log_file]\n"
+            "          [-L full|summary|off]\n"
+            "          [-a poisson|bursty|diurnal [-R rate] | -x trace_file] [-S seed] [-X trace_file]\n"
+            "       %s [-t tunnels] [-v vehicles] [-P levels] [-f strict|fair [-W shares]] [-j threads] -r log_file\n"
+            "  -p  run vehicles on a pool of worker threads instead of a thread each\n"
+            "  -d  run vehicles on the pool with a virtual clock, so crossings take no real time\n"
+            "  -w  number of pool workers (default: number of cores)\n"
+            "  -k  number of independently locked scheduler shards (default: 1)\n"
+            "  -P  number of priority levels, at most %d (default: %d)\n"
+            "  -f  admit waiting vehicles by strict priority, or give each level a fair share (default: strict)\n"
+            "  -W  comma-separated shares of admissions per level for -f fair, lowest first (default: 1,2,3,...)\n"
+            "  -c  group waiting vehicles of a priority into convoys of up to this many (default: 0, off)\n"
+            "  -T  milliseconds a vehicle waits to be admitted before giving up (default: 0, forever)\n"
+            "  -o  verify the log on a separate thread while the simulation runs, in bounded memory\n"
+            "  -j  verify the finished log on this many threads (default: 1)\n"
+            "  -l  write the log to a file and verify it from there after the run\n"
+            "  -L  log every attempt to enter, one event per admission, or nothing (default: full)\n"
+            "  -r  only verify a log file written by an earlier run\n"
+            "  -s  print wait and tunnel occupancy times per priority and vehicle type, tunnel flips and fill\n"
+            "  -a  spread arrivals over time with this pattern instead of all arriving at the start\n"
+            "  -R  mean arrivals per second for -a (default: 20)\n"
+            "  -x  replay the vehicles and arrival times of a trace file; -v is ignored\n"
+            "  -S  seed for the generated vehicles (default: 1)\n"
+            "  -X  write the trace of the vehicles that were run to a file\n", program, program,
+            SCHEDULER_MAX_PRIORITIES, DEFAULT_NUM_PRIORITIES);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv) {
-    run_simulation(10, 100);
+    struct SimulationOptions options = {
+        .num_tunnels = 10,
+        .num_vehicles = 100,
+        .mode = MODE_THREADS,
+        .num_workers = worker_pool_default_workers(),
+        .num_shards = 1,
+        .num_priorities = DEFAULT_NUM_PRIORITIES,
+        .verify_threads = 1,
+        .arrival_pattern = -1,
+        .arrival_rate = 20,
+        .seed = 1,
+    };
+    const char *replay_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:v:pdw:k:P:f:W:c:T:oj:sl:L:r:a:R:x:S:X:")) != -1) {
+        switch (opt) {
+            case 't': options.num_tunnels = atoi(optarg); break;
+            case 'v': options.num_vehicles = atoi(optarg); break;
+            case 'p': options.mode = MODE_POOL; break;
+            case 'd': options.mode = MODE_DISCRETE_EVENT; break;
+            case 'w': options.num_workers = atoi(optarg); break;
+            case 'k': options.num_shards = atoi(optarg); break;
+            case 'P': options.num_priorities = atoi(optarg); break;
+            case 'f':
+                for (options.policy = 0; options.policy < NUM_SCHEDULER_POLICIES; options.policy++) {
+                    if (strcmp(optarg, scheduler_policy_names[options.policy]) == 0) {
+                        break;
+                    }
+                }
+                break;
+            case 'W': options.shares_list = optarg; break;
+            case 'c': options.convoy_window = atoi(optarg); break;
+            case 'T': options.patience_ns = (long long)(atof(optarg) * 1e6); break;
+            case 'o': options.verify_online = true; break;
+            case 'j': options.verify_threads = atoi(optarg); break;
+            case 's': options.print_stats = true; break;
+            case 'l': options.log_path = optarg; break;
+            case 'L':
+                for (options.log_level = 0; options.log_level < NUM_LOG_LEVELS; options.log_level++) {
+                    if (strcmp(optarg, log_level_names[options.log_level]) == 0) {
+                        break;
+                    }
+                }
+                break;
+            case 'r': replay_path = optarg; break;
+            case 'a':
+                for (options.arrival_pattern = 0; options.arrival_pattern < NUM_ARRIVAL_PATTERNS;
+                        options.arrival_pattern++) {
+                    if (strcmp(optarg, arrival_pattern_names[options.arrival_pattern]) == 0) {
+                        break;
+                    }
+                }
+                break;
+            case 'R': options.arrival_rate = atof(optarg); break;
+            case 'x': options.trace_path = optarg; break;
+            case 'S': options.seed = strtoull(optarg, NULL, 0); break;
+            case 'X': options.record_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (options.num_tunnels < 1 || options.num_vehicles < 0 || options.num_workers < 1 || options.num_shards < 1
+            || options.num_priorities < 1 || options.num_priorities > SCHEDULER_MAX_PRIORITIES
+            || options.convoy_window < 0 || options.patience_ns < 0 || options.verify_threads < 1 || (options.verify_online && options.log_path)
+            || options.arrival_pattern == NUM_ARRIVAL_PATTERNS || !(options.arrival_rate > 0)
+            || (options.trace_path && options.arrival_pattern >= 0) || options.policy == NUM_SCHEDULER_POLICIES
+            || (options.shares_list && options.policy != SCHEDULER_POLICY_FAIR) || !parse_shares(&options)
+            || options.log_level == NUM_LOG_LEVELS
+            || (options.log_level == LOG_OFF && (options.verify_online || options.log_path || replay_path))) {
+        usage(argv[0]);
+    }
+    if (replay_path) {
+        // Verify a log written by an earlier run with the same number of tunnels and vehicles
+        Log *log = log_open(replay_path);
+        verify(log, &options);
+        log_destroy(log);
+    } else {
+        struct Trace *trace = load_trace(&options);
+        options.num_vehicles = trace->num_entries;
+        for (int i = 0; i < trace->num_entries; i++) {
+            if (trace->entries[i].priority >= options.num_priorities) {
+                fprintf(stderr, "%s: the trace has priority %d, but there are only %d levels\n", argv[0],
+                        trace->entries[i].priority, options.num_priorities);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (options.record_path) {
+            trace_write(trace, options.record_path);
+        }
+        run_simulation(&options, trace);
+        trace_destroy(trace);
+    }
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,210 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "slab.h"
+
+#define MAX_SLABS 32
+#define CACHE_MAX 128
+#define CACHE_BATCH 64
+#define CHUNK_BYTES 65536
+
+/* Objects are handed out from a per-thread cache of free objects for each slab, so the common path
+ * takes no lock. Caches that grow past CACHE_MAX return a batch to the slab's shared free list, empty
+ * caches take a batch back, and only when the shared list is empty is a new chunk carved up. Chunks
+ * are never returned to the system. */
+
+#ifndef SLAB_USE_MALLOC
+
+struct SlabCache {
+    void *head;
+    int count;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Slab *registry[MAX_SLABS + 1];
+static int num_slabs;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static _Thread_local struct SlabCache caches[MAX_SLABS + 1];
+static _Thread_local bool caches_registered;
+
+/** @brief  Returns a batch of objects from the given cache to its slab.
+ *
+ *  @param  slab    The slab the objects belong to.
+ *  @param  cache   The cache to take the objects from.
+ *  @param  count   The number of objects to return.
+ *  @return Void.
+ */
+static void cache_release(struct Slab *slab, struct SlabCache *cache, int count) {
+    if (count == 0) {
+        return;
+    }
+    void *first = cache->head;
+    void *last = first;
+    for (int i = 1; i < count; i++) {
+        last = *(void **)last;
+    }
+    cache->head = *(void **)last;
+    cache->count -= count;
+    pthread_mutex_lock(&slab->lock);
+    *(void **)last = slab->free_list;
+    slab->free_list = first;
+    slab->num_free += count;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/** @brief  Returns everything cached by an exiting thread to the slabs.
+ *
+ *  @param  arg The exiting thread's cache array.
+ *  @return Void.
+ */
+static void caches_flush(void *arg) {
+    struct SlabCache *thread_caches = arg;
+    for (int id = 1; id <= MAX_SLABS; id++) {
+        if (thread_caches[id].count > 0) {
+            cache_release(registry[id], &thread_caches[id], thread_caches[id].count);
+        }
+    }
+}
+
+static void key_create(void) {
+    if (pthread_key_create(&cache_key, caches_flush) != 0) {
+        perror("slab: pthread_key_create");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/** @brief  Returns the calling thread's cache for the given slab.
+ *
+ *  Assigns the slab an id the first time any thread uses it, and arranges for the caches of the
+ *  calling thread to be flushed when it exits.
+ *
+ *  @param  slab    The slab.
+ *  @return The calling thread's cache for the slab.
+ */
+static struct SlabCache *cache_get(struct Slab *slab) {
+    int id = atomic_load_explicit(&slab->id, memory_order_acquire);
+    if (id == 0) {
+        pthread_mutex_lock(&registry_lock);
+        if ((id = atomic_load(&slab->id)) == 0) {
+            if (num_slabs == MAX_SLABS) {
+                fprintf(stderr, "slab: more than %d slabs\n", MAX_SLABS);
+                exit(EXIT_FAILURE);
+            }
+            id = ++num_slabs;
+            registry[id] = slab;
+            atomic_store_explicit(&slab->id, id, memory_order_release);
+        }
+        pthread_mutex_unlock(&registry_lock);
+    }
+    if (!caches_registered) {
+        pthread_once(&key_once, key_create);
+        pthread_setspecific(cache_key, caches);
+        caches_registered = true;
+    }
+    return &caches[id];
+}
+
+/** @brief  Fills the given empty cache with a batch of free objects.
+ *
+ *  @param  slab    The slab the cache belongs to.
+ *  @param  cache   The cache to fill.
+ *  @return Void.
+ */
+static void cache_refill(struct Slab *slab, struct SlabCache *cache) {
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free_list == NULL) {
+        size_t size = (slab->object_size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+        if (size < sizeof(void *)) {
+            size = sizeof(void *);
+        }
+        size_t count = CHUNK_BYTES / size > CACHE_BATCH ? CHUNK_BYTES / size : CACHE_BATCH;
+        char *chunk = malloc(alignof(max_align_t) + count * size);
+        if (chunk == NULL) {
+            perror("slab_alloc");
+            exit(EXIT_FAILURE);
+        }
+        *(void **)chunk = slab->chunks;
+        slab->chunks = chunk;
+        char *objects = chunk + alignof(max_align_t);
+        for (size_t i = 0; i < count; i++) {
+            *(void **)(objects + i * size) = i + 1 < count ? objects + (i + 1) * size : slab->free_list;
+        }
+        slab->free_list = objects;
+        slab->num_free += count;
+    }
+    void *first = slab->free_list;
+    void *last = first;
+    int count = 1;
+    while (count < CACHE_BATCH && *(void **)last != NULL) {
+        last = *(void **)last;
+        count++;
+    }
+    slab->free_list = *(void **)last;
+    slab->num_free -= count;
+    pthread_mutex_unlock(&slab->lock);
+
+    *(void **)last = cache->head;
+    cache->head = first;
+    cache->count += count;
+}
+
+#endif
+
+/** @brief  Allocates an object from the given slab.
+ *
+ *  Exits the program if no memory is available.
+ *
+ *  @param  slab    The slab to allocate from.
+ *  @return Pointer to an uninitialized object of the slab's object size.
+ */
+void *slab_alloc(struct Slab *slab) {
+#ifdef SLAB_USE_MALLOC
+    void *object = malloc(slab->object_size);
+    if (object == NULL) {
+        perror("slab_alloc");
+        exit(EXIT_FAILURE);
+    }
+    return object;
+#else
+    struct SlabCache *cache = cache_get(slab);
+    if (cache->head == NULL) {
+        cache_refill(slab, cache);
+    }
+    void *object = cache->head;
+    cache->head = *(void **)object;
+    cache->count--;
+    return object;
+#endif
+}
+
+/** @brief  Returns an object to the given slab.
+ *
+ *  The object may be freed by a different thread than the one that allocated it.
+ *
+ *  @param  slab    The slab the object was allocated from.
+ *  @param  object  The object to free, or NULL.
+ *  @return Void.
+ */
+void slab_free(struct Slab *slab, void *object) {
+#ifdef SLAB_USE_MALLOC
+    (void)slab;
+    free(object);
+#else
+    if (object == NULL) {
+        return;
+    }
+    struct SlabCache *cache = cache_get(slab);
+    *(void **)object = cache->head;
+    cache->head = object;
+    if (++cache->count > CACHE_MAX) {
+        cache_release(slab, cache, CACHE_BATCH);
+    }
+#endif
+}
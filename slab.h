@@ -0,0 +1,25 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* Fixed-size object allocator. Define SLAB_USE_MALLOC at compile time to fall back to plain
+ * malloc and free, e.g. to compare the two. */
+
+struct Slab {
+    size_t object_size;
+    pthread_mutex_t lock;
+    void *free_list;
+    size_t num_free;
+    void *chunks;
+    atomic_int id;
+};
+
+#define SLAB_INITIALIZER(type) { .object_size = sizeof(type), .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void   *slab_alloc(struct Slab *slab);
+void    slab_free(struct Slab *slab, void *object);
+
+#endif
@@ -1,11 +1,31 @@
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "vehicle.h"
 #include "thread.h"
 
+/* Waits until the thread's start time on the monotonic clock, if it has one, then runs its vehicle,
+ * which gives up after waiting for its patience if it has one. */
+static void *run_at(void *arg) {
+    struct ThreadData *thread = arg;
+    if (thread->start_ns > 0) {
+        struct timespec start = { thread->start_ns / 1000000000LL, thread->start_ns % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &start, NULL) == EINTR) {
+        }
+    }
+    if (thread->patience_ns > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        run_until(thread->vehicle, now.tv_sec * 1000000000LL + now.tv_nsec + thread->patience_ns);
+        return NULL;
+    }
+    return run(thread->vehicle);
+}
+
 void thread_start(struct ThreadData *thread) {
-    int result = pthread_create(&(thread->thread_id), NULL, run, thread->vehicle);
+    int result = pthread_create(&(thread->thread_id), NULL, run_at, thread);
     if (result != 0) {
         perror("pthread_create failed");
         exit(EXIT_FAILURE);
@@ -7,6 +7,8 @@
 struct ThreadData {
     pthread_t thread_id;
     struct Vehicle *vehicle;
+    long long start_ns;
+    long long patience_ns;
 };
 
 void thread_start(struct ThreadData *thread);
@@ -0,0 +1,125 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "timer_queue.h"
+
+/* Binary min-heap of timers. Timers with equal deadlines fire in the order they were pushed. */
+
+struct Timer {
+    long long deadline;
+    unsigned long seq;
+    void *item;
+};
+
+struct TimerQueue {
+    struct Timer *timers;
+    int size;
+    int capacity;
+    unsigned long next_seq;
+};
+
+/** @brief  Creates and returns a pointer to an empty timer queue.
+ *
+ *  You should call `timer_queue_destroy` to free the memory allocated to the queue.
+ *
+ *  @return Pointer to the created timer queue.
+ */
+TimerQueue *timer_queue_create(void) {
+    TimerQueue *queue = calloc(1, sizeof *queue);
+    if (queue == NULL) {
+        perror("timer_queue_create");
+        exit(EXIT_FAILURE);
+    }
+    return queue;
+}
+
+/** @brief  Frees the memory allocated to the given timer queue.
+ *
+ *  @param  queue   The timer queue to destroy.
+ *  @return Void.
+ */
+void timer_queue_destroy(TimerQueue *queue) {
+    free(queue->timers);
+    free(queue);
+}
+
+/** @brief  Returns true if timer a fires before timer b. */
+static bool fires_before(const struct Timer *a, const struct Timer *b) {
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->seq < b->seq);
+}
+
+/** @brief  Adds an item to the given timer queue.
+ *
+ *  @param  queue       The timer queue.
+ *  @param  deadline    The time at which the item is due.
+ *  @param  item        The item.
+ *  @return Void.
+ */
+void timer_queue_push(TimerQueue *queue, long long deadline, void *item) {
+    if (queue->size == queue->capacity) {
+        int capacity = queue->capacity ? 2 * queue->capacity : 64;
+        struct Timer *timers = realloc(queue->timers, capacity * sizeof *timers);
+        if (timers == NULL) {
+            perror("timer_queue_push");
+            exit(EXIT_FAILURE);
+        }
+        queue->timers = timers;
+        queue->capacity = capacity;
+    }
+    struct Timer timer = { .deadline = deadline, .seq = queue->next_seq++, .item = item };
+    int i = queue->size++;
+    while (i > 0 && fires_before(&timer, &queue->timers[(i - 1) / 2])) {
+        queue->timers[i] = queue->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    queue->timers[i] = timer;
+}
+
+/** @brief  Gets the deadline of the earliest timer of the given queue.
+ *
+ *  @param  queue       The timer queue.
+ *  @param  deadline    Where to store the deadline.
+ *  @return True if the queue has a timer, false if it is empty.
+ */
+bool timer_queue_peek(TimerQueue *queue, long long *deadline) {
+    if (queue->size == 0) {
+        return false;
+    }
+    *deadline = queue->timers[0].deadline;
+    return true;
+}
+
+/** @brief  Retrieves and removes the earliest timer of the given queue.
+ *
+ *  @param  queue   The timer queue.
+ *  @return The item of the earliest timer, or NULL if the queue is empty.
+ */
+void *timer_queue_pop(TimerQueue *queue) {
+    if (queue->size == 0) {
+        return NULL;
+    }
+    void *item = queue->timers[0].item;
+    struct Timer last = queue->timers[--queue->size];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= queue->size) {
+            break;
+        }
+        if (child + 1 < queue->size && fires_before(&queue->timers[child + 1], &queue->timers[child])) {
+            child++;
+        }
+        if (!fires_before(&queue->timers[child], &last)) {
+            break;
+        }
+        queue->timers[i] = queue->timers[child];
+        i = child;
+    }
+    queue->timers[i] = last;
+    return item;
+}
+
+/** @brief  Returns the number of timers in the given queue. */
+int timer_queue_size(TimerQueue *queue) {
+    return queue->size;
+}
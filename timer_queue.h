@@ -0,0 +1,16 @@
+#ifndef TIMER_QUEUE_H
+#define TIMER_QUEUE_H
+
+#include <stdbool.h>
+
+typedef struct TimerQueue TimerQueue;
+
+TimerQueue     *timer_queue_create(void);
+void            timer_queue_destroy(TimerQueue *queue);
+
+void            timer_queue_push(TimerQueue *queue, long long deadline, void *item);
+bool            timer_queue_peek(TimerQueue *queue, long long *deadline);
+void           *timer_queue_pop(TimerQueue *queue);
+int             timer_queue_size(TimerQueue *queue);
+
+#endif
@@ -0,0 +1,224 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "vehicle.h"
+
+/* A trace is the list of vehicles of a run with the time each one arrives, so that a run can be
+ * repeated exactly. Traces are generated from a seed with a generator of their own rather than
+ * `rand`, and are stored as text: a header line, then one line per vehicle with its arrival time
+ * in nanoseconds from the start of the run, type, direction and priority, in arrival order. */
+
+#define TRACE_HEADER "# trace v1: arrival_ns type direction priority"
+
+/* Bursty arrivals come in bursts of BURST_VEHICLES vehicles on average, at BURST_FACTOR times the
+ * mean rate, separated by quiet periods long enough to bring the rate back down to the mean. */
+#define BURST_FACTOR 10.0
+#define BURST_VEHICLES 20.0
+
+/* Diurnal arrivals follow one sine-shaped day over the length of the trace, whose rate swings this
+ * far above and below the mean. */
+#define DIURNAL_SWING 0.8
+
+const char *const arrival_pattern_names[] = {
+    [ARRIVAL_POISSON] = "poisson",
+    [ARRIVAL_BURSTY] = "bursty",
+    [ARRIVAL_DIURNAL] = "diurnal",
+};
+
+static const char *const type_names[] = {
+    [CAR] = "CAR",
+    [SLED] = "SLED",
+};
+
+static const char *const direction_names[] = {
+    [NORTH] = "NORTH",
+    [SOUTH] = "SOUTH",
+};
+
+/** @brief  Returns the next number of a splitmix64 sequence. */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/** @brief  Returns a number drawn uniformly from (0, 1]. */
+static double next_uniform(uint64_t *state) {
+    return ((next_random(state) >> 11) + 1) * 0x1.0p-53;
+}
+
+/** @brief  Returns a time drawn from the exponential distribution with the given mean. */
+static double next_exponential(uint64_t *state, double mean) {
+    return -mean * log(next_uniform(state));
+}
+
+/** @brief  Creates a trace of the given number of vehicles, all arriving at the start.
+ *
+ *  You should call `trace_destroy` to free the memory allocated to the trace.
+ *
+ *  @param  num_entries The number of vehicles.
+ *  @return Pointer to the created trace.
+ */
+struct Trace *trace_create(int num_entries) {
+    struct Trace *trace = malloc(sizeof *trace);
+    if (trace == NULL || (trace->entries = calloc(num_entries > 0 ? num_entries : 1, sizeof *trace->entries)) == NULL) {
+        perror("trace_create");
+        exit(EXIT_FAILURE);
+    }
+    trace->num_entries = num_entries;
+    return trace;
+}
+
+/** @brief  Generates a trace with the given arrival pattern.
+ *
+ *  The same arguments always give the same trace. Types, directions and priorities are uniform.
+ *
+ *  @param  pattern         How arrivals are spread over time.
+ *  @param  num_vehicles    The number of vehicles.
+ *  @param  rate            The mean number of arrivals per second.
+ *  @param  num_priorities  The number of priority levels to draw priorities from.
+ *  @param  seed            The seed of the generator.
+ *  @return Pointer to the created trace.
+ */
+struct Trace *trace_generate(enum ArrivalPattern pattern, int num_vehicles, double rate, int num_priorities,
+                             unsigned long long seed) {
+    struct Trace *trace = trace_create(num_vehicles);
+    uint64_t state = seed;
+    double mean_gap = 1.0 / rate;
+    double burst_gap = mean_gap / BURST_FACTOR;
+    double burst_length = BURST_VEHICLES * burst_gap;
+    double quiet_length = burst_length * (BURST_FACTOR - 1);
+    double burst_end = next_exponential(&state, burst_length);
+    double day = num_vehicles * mean_gap;
+    double t = 0;
+    for (int i = 0; i < num_vehicles; i++) {
+        switch (pattern) {
+            case ARRIVAL_BURSTY:
+                t += next_exponential(&state, burst_gap);
+                while (t > burst_end) {
+                    // Arrivals are memoryless, so the rest of the gap carries over past the quiet period
+                    double quiet = next_exponential(&state, quiet_length);
+                    t += quiet;
+                    burst_end += quiet + next_exponential(&state, burst_length);
+                }
+                break;
+            case ARRIVAL_DIURNAL:
+                // Thinning: candidates come at the peak rate and are kept in proportion to the rate
+                do {
+                    t += next_exponential(&state, mean_gap / (1 + DIURNAL_SWING));
+                } while (next_uniform(&state) * (1 + DIURNAL_SWING) > 1 + DIURNAL_SWING * sin(2 * M_PI * t / day));
+                break;
+            default:
+                t += next_exponential(&state, mean_gap);
+        }
+        trace->entries[i] = (struct TraceEntry){
+            .arrival_ns = (long long)(t * 1e9),
+            .vehicle_type = next_random(&state) % NUM_VEHICLE_TYPES,
+            .direction = next_random(&state) % NUM_DIRECTIONS,
+            .priority = next_random(&state) % num_priorities,
+        };
+    }
+    return trace;
+}
+
+/** @brief  Frees the memory allocated to the given trace.
+ *
+ *  @param  trace   The trace to destroy.
+ *  @return Void.
+ */
+void trace_destroy(struct Trace *trace) {
+    free(trace->entries);
+    free(trace);
+}
+
+/** @brief  Returns the index of the given name in a table of names, or -1 if it is not there. */
+static int find_name(const char *const *names, int num_names, const char *name) {
+    for (int i = 0; i < num_names; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/** @brief  Reads a trace written by `trace_write`.
+ *
+ *  Exits with a message if the file cannot be read or is not a valid trace.
+ *
+ *  @param  path    The path of the file.
+ *  @return Pointer to the read trace.
+ */
+struct Trace *trace_read(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("trace_read");
+        exit(EXIT_FAILURE);
+    }
+    char line[256];
+    if (fgets(line, sizeof line, file) == NULL || strncmp(line, TRACE_HEADER, strlen(TRACE_HEADER)) != 0) {
+        fprintf(stderr, "trace_read: %s is not a trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    int capacity = 1024;
+    struct Trace *trace = trace_create(capacity);
+    trace->num_entries = 0;
+    for (int line_number = 2; fgets(line, sizeof line, file) != NULL; line_number++) {
+        long long arrival_ns;
+        char type[16], direction[16];
+        int priority;
+        if (sscanf(line, "%lld %15s %15s %d", &arrival_ns, type, direction, &priority) != 4) {
+            fprintf(stderr, "trace_read: %s:%d: malformed line\n", path, line_number);
+            exit(EXIT_FAILURE);
+        }
+        struct TraceEntry entry = {
+            .arrival_ns = arrival_ns,
+            .vehicle_type = find_name(type_names, NUM_VEHICLE_TYPES, type),
+            .direction = find_name(direction_names, NUM_DIRECTIONS, direction),
+            .priority = priority,
+        };
+        if ((int)entry.vehicle_type < 0 || (int)entry.direction < 0 || priority < 0 || arrival_ns < 0) {
+            fprintf(stderr, "trace_read: %s:%d: invalid vehicle\n", path, line_number);
+            exit(EXIT_FAILURE);
+        }
+        if (trace->num_entries == capacity) {
+            capacity *= 2;
+            struct TraceEntry *entries = realloc(trace->entries, capacity * sizeof *entries);
+            if (entries == NULL) {
+                perror("trace_read");
+                exit(EXIT_FAILURE);
+            }
+            trace->entries = entries;
+        }
+        trace->entries[trace->num_entries++] = entry;
+    }
+    fclose(file);
+    return trace;
+}
+
+/** @brief  Writes the given trace to a file, which is truncated if it exists.
+ *
+ *  @param  trace   The trace to write.
+ *  @param  path    The path of the file.
+ *  @return Void.
+ */
+void trace_write(const struct Trace *trace, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("trace_write");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "%s\n", TRACE_HEADER);
+    for (int i = 0; i < trace->num_entries; i++) {
+        const struct TraceEntry *entry = &trace->entries[i];
+        fprintf(file, "%lld %s %s %d\n", entry->arrival_ns, type_names[entry->vehicle_type],
+                direction_names[entry->direction], entry->priority);
+    }
+    if (fclose(file) != 0) {
+        perror("trace_write");
+        exit(EXIT_FAILURE);
+    }
+}
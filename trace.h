@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "vehicle.h"
+
+enum ArrivalPattern {
+    ARRIVAL_POISSON,
+    ARRIVAL_BURSTY,
+    ARRIVAL_DIURNAL,
+    NUM_ARRIVAL_PATTERNS,
+};
+
+extern const char *const arrival_pattern_names[];
+
+struct TraceEntry {
+    long long arrival_ns;
+    enum VehicleType vehicle_type;
+    enum Direction direction;
+    int priority;
+};
+
+struct Trace {
+    struct TraceEntry *entries;
+    int num_entries;
+};
+
+struct Trace   *trace_create(int num_entries);
+struct Trace   *trace_generate(enum ArrivalPattern pattern, int num_vehicles, double rate, int num_priorities,
+                               unsigned long long seed);
+void            trace_destroy(struct Trace *trace);
+
+struct Trace   *trace_read(const char *path);
+void            trace_write(const struct Trace *trace, const char *path);
+
+#endif
@@ -11,10 +11,33 @@ const int tunnel_capacities[] = {
     [SLED] = 1,
 };
 
+/* The number of vehicles is kept in the low bits of a tunnel's state word and their type and
+ * direction above it. An empty tunnel may keep the type and direction of its last vehicles, which
+ * mean nothing once the count is zero. Entering and leaving are single atomic updates of the word,
+ * so tunnels can be entered and left from any thread without a lock. */
+#define COUNT_BITS 16
+#define COUNT_MASK ((1u << COUNT_BITS) - 1)
+#define TYPE_SHIFT COUNT_BITS
+#define DIRECTION_SHIFT (COUNT_BITS + 8)
+
+static unsigned int pack_state(int num_vehicles, enum VehicleType vehicle_type, enum Direction direction) {
+    return (unsigned int)num_vehicles | (unsigned int)vehicle_type << TYPE_SHIFT
+        | (unsigned int)direction << DIRECTION_SHIFT;
+}
+
+static struct TunnelOccupancy unpack_state(unsigned int state) {
+    return (struct TunnelOccupancy){
+        .num_vehicles = state & COUNT_MASK,
+        .vehicle_type = (state >> TYPE_SHIFT) & 0xff,
+        .direction = (state >> DIRECTION_SHIFT) & 0xff,
+    };
+}
+
 /** @brief  Intitializes and returns an array of pointers to tunnels.
  *  
  *  The array is of size num_tunnels + 1 and is terminated by a NULL value.
  *  All tunnels have the same log and have an id equivalent to their index in the array.
+ *  The tunnels themselves are stored next to each other in a single block, one cache line each.
  *  You should call `tunnels_destroy` to free the memory allocated by this function.
  *  
  *  @param  num_tunnels The number of tunnels to create.
@@ -22,94 +45,128 @@ const int tunnel_capacities[] = {
  */
 struct Tunnel **tunnels_create(int num_tunnels, Log *log) {
     struct Tunnel **tunnels = malloc((num_tunnels + 1) * sizeof *tunnels);
-    if (tunnels == NULL) {
+    size_t block_size = (num_tunnels > 0 ? num_tunnels : 1) * sizeof(struct Tunnel);
+    struct Tunnel *block = aligned_alloc(_Alignof(struct Tunnel), block_size);
+    if (tunnels == NULL || block == NULL) {
         perror("tunnels_create");
         exit(EXIT_FAILURE);
     }
     for (int i = 0; i < num_tunnels; i++) {
-        if ((tunnels[i] = malloc(sizeof *tunnels[i])) == NULL) {
-            perror("tunnels_create");
-            exit(EXIT_FAILURE);
-        }
-        *tunnels[i] = (struct Tunnel) { .id = i, .num_vehicles = 0, .log = log };
+        tunnels[i] = &block[i];
+        *tunnels[i] = (struct Tunnel) { .id = i, .state = &tunnels[i]->own_state, .log = log };
+        atomic_init(&tunnels[i]->own_state, 0);
     }
     tunnels[num_tunnels] = NULL;
+    if (num_tunnels == 0) {
+        free(block);
+    }
     return tunnels;
 }
 
-/** @brief  Frees the memory allocated by `tunnels_create`.
+/** @brief  Creates tunnels like `tunnels_create` whose state words are the given ones.
  *
- *  @param  tunnels The array of tunnels created by `tunnels_create`.
+ *  Meant for words in memory shared between processes, so that each process has tunnel objects of
+ *  its own, logging to its own log, for the same tunnels. The words are used as they are.
+ *
+ *  @param  num_tunnels The number of tunnels to create.
+ *  @param  log         The log of the tunnels.
+ *  @param  words       The state word of each tunnel, in tunnel id order.
+ *  @return Pointer to the array of tunnels, to be freed with `tunnels_destroy`.
+ */
+struct Tunnel **tunnels_attach(int num_tunnels, Log *log, struct TunnelWord *words) {
+    struct Tunnel **tunnels = tunnels_create(num_tunnels, log);
+    for (int i = 0; i < num_tunnels; i++) {
+        tunnels[i]->state = &words[i].word;
+    }
+    return tunnels;
+}
+
+/** @brief  Frees the memory allocated by `tunnels_create` or `tunnels_attach`.
+ *
+ *  The state words of attached tunnels are left alone.
+ *
+ *  @param  tunnels The array of tunnels created by `tunnels_create` or `tunnels_attach`.
  *  @return Void.
  */
 void tunnels_destroy(struct Tunnel **tunnels) {
-    for (int i = 0; tunnels[i] != NULL; i++) {
-        free(tunnels[i]);
-    }
+    // The first tunnel is the start of the block holding all of them
+    free(tunnels[0]);
     free(tunnels);
 }
 
+/** @brief  Returns the number, type and direction of the vehicles in the given tunnel.
+ *
+ *  The three are read together, so they always describe the same moment. The type and direction
+ *  are only meaningful if the tunnel is not empty.
+ *
+ *  @param  tunnel  Pointer to the tunnel.
+ *  @return The tunnel's occupancy.
+ */
+struct TunnelOccupancy tunnel_occupancy(const struct Tunnel *tunnel) {
+    return unpack_state(atomic_load(tunnel->state));
+}
+
+/** @brief  Checks whether a vehicle fits in a tunnel with the given state. */
+static bool fits(unsigned int state, const struct Vehicle *vehicle) {
+    struct TunnelOccupancy occupancy = unpack_state(state);
+    if (occupancy.num_vehicles == 0) {
+        return true;
+    }
+    if (occupancy.vehicle_type != vehicle->vehicle_type || occupancy.direction != vehicle->direction) {
+        return false;
+    }
+    return occupancy.num_vehicles < tunnel_capacities[vehicle->vehicle_type];
+}
+
+/** @brief  Checks whether the given vehicle could enter the given tunnel right now.
+ *
+ *  A vehicle can enter an empty tunnel, or a tunnel holding vehicles of the same type and
+ *  direction whose capacity for that type has not been reached. The tunnel is not modified.
+ *
+ *  @param  tunnel  Pointer to the tunnel.
+ *  @param  vehicle Pointer to the vehicle that would enter.
+ *  @return True if the vehicle fits in the tunnel, false otherwise.
+ */
+bool tunnel_can_enter(const struct Tunnel *tunnel, const struct Vehicle *vehicle) {
+    return fits(atomic_load(tunnel->state), vehicle);
+}
+
 /** @brief  Enters the given vehicle into the given tunnel if possible, based on the vehicles
  *          currently in the tunnel.
  *  
  *  Called by `tunnel_try_to_enter`. Vehicle can enter if it is has the same type and direction as the
- *  other vehicles in the tunnel, and the tunnel's capacity has not been reached.
+ *  other vehicles in the tunnel, and the tunnel's capacity has not been reached. The check and the
+ *  entry are a single compare-and-swap of the state word, retried only if another vehicle entered
+ *  or left the tunnel in between.
  *  
  *  @param  tunnel  Pointer to the tunnel.
  *  @param  vehicle Pointer to the vehicle attempting to enter.
  *  @return True if the vehicle enters the tunnel successfully, false otherwise.
  */
-/**
- * @brief Tries to admit a vehicle into the tunnel.
- * 
- * @param tunnel Pointer to the tunnel.
- * @param vehicle Pointer to the vehicle attempting to enter.
- * @return True if the vehicle enters the tunnel successfully, false otherwise.
- */
 static bool try_to_enter_inner(struct Tunnel *tunnel, struct Vehicle *vehicle) {
-    // Calculate the current tunnel occupancy in terms of capacity units
-    int current_occupancy = tunnel->num_vehicles * 
-                            ((tunnel->vehicle_type == SLED) ? 3 : 1);
-
-    // Check if the tunnel is empty
-    if (tunnel->num_vehicles == 0) {
-        // Set the tunnel's type and direction to match the vehicle
-        tunnel->vehicle_type = vehicle->vehicle_type;
-        tunnel->direction = vehicle->direction;
-        tunnel->num_vehicles++;
-        return true;
-    }
-
-    // Check compatibility of type and direction
-    if (tunnel->vehicle_type == vehicle->vehicle_type && tunnel->direction == vehicle->direction) {
-        // Check if adding this vehicle would exceed capacity
-        int vehicle_space = (vehicle->vehicle_type == SLED) ? 3 : 1;
-        if (current_occupancy + vehicle_space <= tunnel_capacities[CAR] * 3) {
-            tunnel->num_vehicles++;
-            return true;
+    unsigned int state = atomic_load(tunnel->state);
+    unsigned int entered;
+    do {
+        if (!fits(state, vehicle)) {
+            return false;
         }
-    }
-
-    // If the vehicle cannot enter the tunnel
-    return false;
+        entered = pack_state((state & COUNT_MASK) + 1, vehicle->vehicle_type, vehicle->direction);
+    } while (!atomic_compare_exchange_weak(tunnel->state, &state, entered));
+    return true;
 }
 
 
 /**
  * @brief Removes a vehicle from the tunnel.
  * 
+ * Only the count changes, so this is a single atomic subtraction. The type and direction are left
+ * as they were, and are overwritten by the next vehicle to enter once the tunnel is empty.
+ * 
  * @param tunnel Pointer to the tunnel.
  * @return Void.
  */
 static void exit_tunnel_inner(struct Tunnel *tunnel) {
-    // Decrement the number of vehicles
-    tunnel->num_vehicles--;
-
-    // If the tunnel is now empty, reset its type and direction
-    if (tunnel->num_vehicles == 0) {
-        tunnel->vehicle_type = -1; // Invalid type
-        tunnel->direction = -1;   // Invalid direction
-    }
+    atomic_fetch_sub(tunnel->state, 1);
 }
 
 
@@ -133,6 +190,19 @@ bool tunnel_try_to_enter(struct Tunnel *tunnel, struct Vehicle *vehicle) {
     return false;
 }
 
+/** @brief  Takes the given number of vehicles out of the given tunnel without logging anything.
+ *
+ *  For vehicles that can no longer leave by themselves, such as those of a process that died
+ *  while sharing the tunnel with other processes.
+ *
+ *  @param  tunnel       Pointer to the tunnel.
+ *  @param  num_vehicles The number of vehicles to take out, at most the number in the tunnel.
+ *  @return Void.
+ */
+void tunnel_evict(struct Tunnel *tunnel, int num_vehicles) {
+    atomic_fetch_sub(tunnel->state, (unsigned int)num_vehicles);
+}
+
 /** @brief  The given vehicle exits the given tunnel.
  *
  *  Also adds appropriate entries to the log.
@@ -1,6 +1,7 @@
 #ifndef TUNNEL_H 
 #define TUNNEL_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include "vehicle.h"
 
@@ -8,18 +9,36 @@ extern const int tunnel_capacities[];
 
 typedef struct Log Log;
 
+/* `state` points to the word that packs the number of vehicles in the tunnel with their type and
+ * direction, see `tunnel_occupancy`. That is `own_state`, unless the tunnel was attached to a word
+ * in memory shared with other processes by `tunnels_attach`. Tunnels are aligned to cache lines so
+ * that tunnels next to each other in memory never share one. */
 struct Tunnel {
     int id;
-    enum VehicleType vehicle_type; 
-    int direction;
-    int num_vehicles;
+    atomic_uint *state;
     Log *log;
+    atomic_uint own_state;
+} __attribute__((aligned(64)));
+
+/* A tunnel's state word on a cache line of its own, for keeping it in shared memory. */
+struct TunnelWord {
+    atomic_uint word;
+} __attribute__((aligned(64)));
+
+struct TunnelOccupancy {
+    int num_vehicles;
+    enum VehicleType vehicle_type;
+    enum Direction direction;
 };
 
 struct Tunnel **tunnels_create(int num_tunnels, Log *log);
+struct Tunnel **tunnels_attach(int num_tunnels, Log *log, struct TunnelWord *words);
 void            tunnels_destroy(struct Tunnel **tunnels);
 
+struct TunnelOccupancy tunnel_occupancy(const struct Tunnel *tunnel);
+bool            tunnel_can_enter(const struct Tunnel *tunnel, const struct Vehicle *vehicle);
 bool            tunnel_try_to_enter(struct Tunnel *tunnel, struct Vehicle *vehicle);
 void            tunnel_exit(struct Tunnel *tunnel, struct Vehicle *vehicle);
+void            tunnel_evict(struct Tunnel *tunnel, int num_vehicles);
 
 #endif
@@ -3,30 +3,30 @@
 #include <time.h>
 #include "priority_scheduler.h"
 #include "vehicle.h"
+#include "slab.h"
 
 const int speeds[] = {
     [CAR] = 6,
     [SLED] = 4,
 };
 
+static struct Slab vehicle_slab = SLAB_INITIALIZER(struct Vehicle);
+
 /** @brief  Creates and returns a pointer to a vehicle with the given parameters.
  *  
  *  Each vehicle created has an id (starting at 1) that is one higher than the 
  *  vehicle created by the previous call of this function.
+ *  You should call `vehicle_destroy` to free the memory allocated to the vehicle.
  *  
  *  @param  type        The type of vehicle - determines the vehicle's speed.
  *  @param  direction   The direction of the vehicle.
- *  @param  priority    The priority of the vehicle, in the range 0-4.
+ *  @param  priority    The priority of the vehicle, below the scheduler's number of levels.
  *  @param  scheduler   The scheduler to be used for the vehicle.
  *  @return Pointer to the created vehicle.
  */
 struct Vehicle *vehicle_create(enum VehicleType type, enum Direction direction, int priority, PriorityScheduler *scheduler) {
     static int id = 1;
-    struct Vehicle *new_vehicle = malloc(sizeof *new_vehicle);
-    if (new_vehicle == NULL) {
-        perror("vehicle_create");
-        exit(EXIT_FAILURE);
-    }
+    struct Vehicle *new_vehicle = slab_alloc(&vehicle_slab);
     *new_vehicle = (struct Vehicle) { 
         .id = id++,
         .vehicle_type = type, 
@@ -38,24 +38,43 @@ struct Vehicle *vehicle_create(enum VehicleType type, enum Direction direction,
     return new_vehicle;
 }
 
+/** @brief  Frees the memory allocated to the given vehicle.
+ *
+ *  @param  vehicle The vehicle to destroy.
+ *  @return Void.
+ */
+void vehicle_destroy(struct Vehicle *vehicle) {
+    slab_free(&vehicle_slab, vehicle);
+}
+
 /** @brief  Creates a vehicle with random type, direction, and priority.
  *
  *  @param  scheduler   The scheduler to be used for the vehicle.
  *  @return Pointer to the created vehicle.
  */
 struct Vehicle *vehicle_random(PriorityScheduler *scheduler) {
-    return vehicle_create(rand() % NUM_VEHICLE_TYPES, rand() % NUM_DIRECTIONS, rand() % (HIGHEST_PRIORITY + 1), scheduler);
+    return vehicle_create(rand() % NUM_VEHICLE_TYPES, rand() % NUM_DIRECTIONS, rand() % scheduler_num_priorities(scheduler), scheduler);
+}
+
+/** @brief  Returns how long the given vehicle takes to cross a tunnel, in nanoseconds.
+ *
+ *  The higher the vehicle's speed, the shorter the crossing.
+ *
+ *  @param  vehicle Pointer to the vehicle.
+ *  @return The crossing time in nanoseconds.
+ */
+long vehicle_crossing_ns(const struct Vehicle *vehicle) {
+    return (10 - vehicle->speed) * 100000000L;
 }
 
 /** @brief  Simulates time spent in the tunnel by sleeping for a time based on the vehicle's speed.
- *  
- *  The higher the vehicle's speed, the shorter the sleep time.
  *
  *  @param  vehicle Pointer to the vehicle that has entered a tunnel.
  *  @return Void.
  */
 static void do_while_in_tunnel(struct Vehicle *vehicle) {
-    struct timespec sleep_time = {0, (10 - vehicle->speed) * 100000000};
+    long crossing_ns = vehicle_crossing_ns(vehicle);
+    struct timespec sleep_time = { crossing_ns / 1000000000L, crossing_ns % 1000000000L };
     nanosleep(&sleep_time, NULL);
 }
 
@@ -73,21 +92,44 @@ static void do_while_in_tunnel(struct Vehicle *vehicle) {
  */
 void *run(void *arg) {
     struct Vehicle *vehicle = arg;
-    scheduler_admit(vehicle->scheduler, vehicle);
+    if (scheduler_admit(vehicle->scheduler, vehicle) != NULL) {
+        do_while_in_tunnel(vehicle);
+        scheduler_exit(vehicle->scheduler, vehicle);
+    }
+    return NULL;
+}
+
+/** @brief  Crosses through a tunnel like `run`, unless the vehicle is still waiting at the deadline.
+ *
+ *  @param  vehicle     The vehicle that will cross a tunnel.
+ *  @param  deadline_ns When the vehicle gives up waiting, in nanoseconds on the CLOCK_MONOTONIC
+ *                      clock.
+ *  @return Whether the vehicle crossed.
+ */
+bool run_until(struct Vehicle *vehicle, long long deadline_ns) {
+    if (scheduler_admit_timed(vehicle->scheduler, vehicle, deadline_ns) == NULL) {
+        return false;
+    }
     do_while_in_tunnel(vehicle);
     scheduler_exit(vehicle->scheduler, vehicle);
+    return true;
 }
 
 /** @brief  Calculates the hash code of the given vehicle.
+ *
+ *  Only the id is hashed, so the hash does not change if other fields such as the priority do.
+ *  The id is scrambled so that consecutive ids spread over the whole range, which matters for
+ *  tables that index with the low bits.
  *
  *  @param  vehicle The vehicle to calculate the hash of.
  *  @return The vehicle's hash code.
  */
 size_t vehicle_hash(const struct Vehicle *vehicle) {
-    size_t hash = 7;
-    hash = 23 * hash + vehicle->id;
-    hash = 23 * hash + vehicle->direction;
-    hash = 23 * hash + vehicle->speed;
-    hash = 23 * hash + vehicle->priority;
-    return hash;
+    unsigned long long hash = (unsigned int)vehicle->id;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return (size_t)hash;
 }
@@ -1,9 +1,10 @@
 #ifndef VEHICLE_H
 #define VEHICLE_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 
-#define HIGHEST_PRIORITY 4
+#define DEFAULT_NUM_PRIORITIES 5
 
 enum VehicleType {
     CAR,
@@ -19,6 +20,8 @@ enum Direction {
 
 typedef struct PriorityScheduler PriorityScheduler;
 
+struct Waiter;
+
 struct Vehicle {
     int id;
     enum VehicleType vehicle_type;
@@ -26,12 +29,19 @@ struct Vehicle {
     int speed;
     int priority;
     PriorityScheduler *scheduler;
+    long long arrival_ns;
+    long long entry_ns;
+    struct Waiter *waiter;
 };
 
 struct Vehicle *vehicle_create(enum VehicleType type, enum Direction direction, int priority, PriorityScheduler *scheduler);
 struct Vehicle *vehicle_random(PriorityScheduler *scheduler);
+void            vehicle_destroy(struct Vehicle *vehicle);
+
+long            vehicle_crossing_ns(const struct Vehicle *vehicle);
 
 void *run(void *arg);
+bool  run_until(struct Vehicle *vehicle, long long deadline_ns);
 
 size_t vehicle_hash(const struct Vehicle *vehicle);
 
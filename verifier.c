@@ -0,0 +1,793 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hashmap.h"
+#include "logger.h"
+#include "tunnel.h"
+#include "vehicle.h"
+#include "verifier.h"
+
+/* Checks a log event by event: every tunnel only ever holds vehicles of one type and direction up
+ * to its capacity, vehicles only fail to enter tunnels they could not have entered, and vehicles
+ * enter in the order of the scheduler's policy. The state is updated as each event is checked, so
+ * a verifier can either replay a finished log or follow one from its own thread while the
+ * simulation is still adding to it.
+ *
+ * The scheduler logs the arrival of each vehicle, so a vehicle is waiting from its arrival until
+ * it tries to enter, or until it gives up waiting on a timeout or cancellation. Vehicles that give
+ * up are not expected to enter a tunnel. Under strict priority no vehicle may try to enter while one of a higher
+ * priority is waiting. Under weighted-fair admission no priority may have more vehicles try to
+ * enter than its share while another priority is waiting, counted from the last time the waiting
+ * priority had a vehicle enter or from when it started waiting. A sharded scheduler only orders
+ * the vehicles of each shard among themselves, since shards admit vehicles under separate locks,
+ * so both are checked among the vehicles that arrived in the same shard.
+ *
+ * A summary log has one ENTER_SUMMARY per admission in place of the attempts and the entry, so it
+ * is checked as an attempt and an entry at once. Failed attempts are not in a summary log, so
+ * whether a vehicle wrongly failed to enter a tunnel cannot be checked from one.
+ *
+ * `verify_log_parallel` splits the same checks between threads instead. The state of a tunnel only
+ * depends on the events of that tunnel, and whether a vehicle is in some tunnel only depends on
+ * the events of that vehicle, so the log is checked per tunnel, then per vehicle, by threads that
+ * each own a share of the tunnels or vehicles. The admission order of the arrivals and attempts is
+ * checked by one more thread alongside the tunnels. Before that, each thread reads its own range
+ * of the log and sorts its events by the threads that check them, so the checks of a share take
+ * the events of every range in turn, which keeps them in sequence order. Every thread records what
+ * it finds against the event it found it at, and the findings are printed in sequence order at
+ * the end. */
+
+/* How long the verifier thread sleeps when it has caught up with the log. */
+#define VERIFIER_POLL_NS 100000
+
+/* Per scheduler shard s, the waiting vehicles of each priority p at `waiting[s * num_priorities + p]`,
+ * and for each priority p with waiting vehicles, the number of vehicles of every priority q that
+ * entered since, at `overtakes[(s * num_priorities + p) * num_priorities + q]`. Shards are added as
+ * their first vehicle arrives, and `homes` holds the shard of each vehicle by id, or -1 before it
+ * arrives. */
+struct PriorityOrder {
+    int num_priorities;
+    int max_shards;
+    int *shares;
+    int num_shards;
+    int *waiting;
+    int *overtakes;
+    int num_homes;
+    int *homes;
+};
+
+struct TunnelState {
+    int num_vehicles;
+    enum VehicleType vehicle_type;
+    enum Direction direction;
+};
+
+struct Verifier {
+    int num_tunnels;
+    int num_vehicles;
+    struct TunnelState *tunnel_states;
+    HashMap *tunnel_map;
+    struct PriorityOrder order;
+    int num_enter;
+    int num_leave;
+    int num_gave_up;
+    Log *log;
+    pthread_t thread_id;
+    atomic_bool done;
+};
+
+static void remove_from_tunnel(struct TunnelState *tunnel_state) {
+    tunnel_state->num_vehicles--;
+}
+
+static void put_in_tunnel(struct TunnelState *tunnel_state, struct Vehicle *vehicle) {
+    tunnel_state->num_vehicles++;
+    tunnel_state->vehicle_type = vehicle->vehicle_type;
+    tunnel_state->direction = vehicle->direction;
+}
+
+static bool should_enter(struct TunnelState *tunnel_state, struct Vehicle *vehicle) {
+    if (tunnel_state->num_vehicles == 0) {
+        return true;
+    }
+    if (tunnel_state->vehicle_type != vehicle->vehicle_type || tunnel_state->direction != vehicle->direction) {
+        return false;
+    }
+    return tunnel_state->num_vehicles < tunnel_capacities[vehicle->vehicle_type];
+}
+
+/** @brief  Sets up the priority order state for the given admission order, for a scheduler of the
+ *          given number of tunnels, which it has at most as many shards as. */
+static void order_init(struct PriorityOrder *order, const struct AdmissionOrder *admission, int num_tunnels) {
+    int n = admission->num_priorities;
+    *order = (struct PriorityOrder){ .num_priorities = n, .max_shards = num_tunnels > 1 ? num_tunnels : 1 };
+    if (admission->shares != NULL) {
+        if ((order->shares = malloc(n * sizeof *order->shares)) == NULL) {
+            perror("verifier_create");
+            exit(EXIT_FAILURE);
+        }
+        for (int p = 0; p < n; p++) {
+            order->shares[p] = admission->shares[p];
+        }
+    }
+}
+
+static void order_destroy(struct PriorityOrder *order) {
+    free(order->shares);
+    free(order->waiting);
+    free(order->overtakes);
+    free(order->homes);
+}
+
+/** @brief  Returns the home shard of the given vehicle, which is 0 if its arrival was not seen. */
+static int order_home(const struct PriorityOrder *order, const struct Vehicle *vehicle) {
+    if (vehicle->id < 0 || vehicle->id >= order->num_homes || order->homes[vehicle->id] < 0) {
+        return 0;
+    }
+    return order->homes[vehicle->id];
+}
+
+/** @brief  Makes room for the state of the given shard and the home of the given vehicle id. */
+static void order_grow(struct PriorityOrder *order, int shard, int id) {
+    int n = order->num_priorities;
+    if (shard >= order->num_shards) {
+        int num_shards = shard + 1;
+        int *waiting = realloc(order->waiting, (size_t)num_shards * n * sizeof *waiting);
+        int *overtakes = realloc(order->overtakes, (size_t)num_shards * n * n * sizeof *overtakes);
+        if (waiting == NULL || overtakes == NULL) {
+            perror("verifier: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = (size_t)order->num_shards * n; i < (size_t)num_shards * n; i++) {
+            waiting[i] = 0;
+        }
+        for (size_t i = (size_t)order->num_shards * n * n; i < (size_t)num_shards * n * n; i++) {
+            overtakes[i] = 0;
+        }
+        order->waiting = waiting;
+        order->overtakes = overtakes;
+        order->num_shards = num_shards;
+    }
+    if (id >= order->num_homes) {
+        int num_homes = order->num_homes ? order->num_homes : 1024;
+        while (num_homes <= id) {
+            num_homes *= 2;
+        }
+        int *homes = realloc(order->homes, num_homes * sizeof *homes);
+        if (homes == NULL) {
+            perror("verifier: realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = order->num_homes; i < num_homes; i++) {
+            homes[i] = -1;
+        }
+        order->homes = homes;
+        order->num_homes = num_homes;
+    }
+}
+
+/** @brief  Counts the given vehicle as waiting in the given shard. Returns false if its priority,
+ *          id or shard is out of range. */
+static bool order_arrive(struct PriorityOrder *order, const struct Vehicle *vehicle, int shard) {
+    int n = order->num_priorities;
+    int p = vehicle->priority;
+    if (p < 0 || p >= n || vehicle->id < 0 || shard < 0 || shard >= order->max_shards) {
+        return false;
+    }
+    order_grow(order, shard, vehicle->id);
+    order->homes[vehicle->id] = shard;
+    if (order->waiting[shard * n + p]++ == 0) {
+        for (int q = 0; q < n; q++) {
+            order->overtakes[((size_t)shard * n + p) * n + q] = 0;
+        }
+    }
+    return true;
+}
+
+/** @brief  Stops counting the given vehicle as waiting now that it gave up. Returns false if its
+ *          priority is out of range. */
+static bool order_leave(struct PriorityOrder *order, const struct Vehicle *vehicle) {
+    int n = order->num_priorities;
+    int p = vehicle->priority;
+    if (p < 0 || p >= n) {
+        return false;
+    }
+    int shard = order_home(order, vehicle);
+    if (shard < order->num_shards && order->waiting[shard * n + p] > 0) {
+        order->waiting[shard * n + p]--;
+    }
+    return true;
+}
+
+/** @brief  Stops counting the given vehicle as waiting now that it tries to enter, and checks it
+ *          against the vehicles waiting in its shard.
+ *
+ *  @return What the vehicle broke by entering, or NULL if it was its turn.
+ */
+static const char *order_enter(struct PriorityOrder *order, const struct Vehicle *vehicle) {
+    int n = order->num_priorities;
+    int p = vehicle->priority;
+    if (p < 0 || p >= n) {
+        return "Error";
+    }
+    int shard = order_home(order, vehicle);
+    if (shard >= order->num_shards) {
+        return NULL;
+    }
+    int *waiting = &order->waiting[shard * n];
+    int *overtakes = &order->overtakes[(size_t)shard * n * n];
+    if (waiting[p] > 0) {
+        waiting[p]--;
+    }
+    const char *message = NULL;
+    for (int q = 0; q < n; q++) {
+        if (q == p || waiting[q] == 0) {
+            continue;
+        }
+        if (order->shares == NULL) {
+            if (q > p) {
+                message = "Vehicle waited for lower priority vehicle";
+            }
+        } else if (++overtakes[q * n + p] > order->shares[p]) {
+            message = "Vehicle entered beyond its share while another priority waited";
+        }
+    }
+    for (int q = 0; q < n; q++) {
+        overtakes[p * n + q] = 0;
+    }
+    return message;
+}
+
+/** @brief  Follows a vehicle entering a tunnel and prints what is wrong with it, if anything. */
+static void check_entry(Verifier *verifier, struct TunnelState *tunnel_state, struct Event *event) {
+    verifier->num_enter++;
+    if (should_enter(tunnel_state, event->vehicle)) {
+        put_in_tunnel(tunnel_state, event->vehicle);
+        hashmap_put(verifier->tunnel_map, event->vehicle, event->tunnel);
+    } else if (hashmap_get(verifier->tunnel_map, event->vehicle) != NULL) {
+        printf("Vehicle is already in a tunnel.\n");
+    } else {
+        printf("Vehicle should not have entered tunnel.\n");
+    }
+}
+
+/** @brief  Prints whether every vehicle that did not give up entered and left a tunnel, given the
+ *          counts of entries, exits and vehicles that gave up. */
+static void print_report(int num_enter, int num_leave, int num_gave_up, int num_vehicles) {
+    int expected = num_vehicles - num_gave_up;
+    if (num_enter != expected) {
+        printf("Not all %d vehicles entered a tunnel.\n", expected);
+    } else if (num_leave != expected) {
+        printf("Not all %d vehicles left a tunnel.\n", expected);
+    } else if (num_gave_up > 0) {
+        printf("All %d vehicles that did not give up entered and left a tunnel correctly, %d gave up.\n",
+               expected, num_gave_up);
+    } else {
+        printf("All %d vehicles entered and left a tunnel correctly.\n", num_vehicles);
+    }
+}
+
+/** @brief  Creates a verifier for a log of the given number of tunnels and vehicles.
+ *
+ *  @param  num_tunnels     The number of tunnels of the simulation.
+ *  @param  num_vehicles    The number of vehicles that should enter and leave a tunnel or give up.
+ *  @param  order           The order vehicles must be admitted in.
+ *  @return Pointer to the created verifier.
+ */
+Verifier *verifier_create(int num_tunnels, int num_vehicles, const struct AdmissionOrder *order) {
+    Verifier *verifier = calloc(1, sizeof *verifier);
+    if (verifier == NULL || (verifier->tunnel_states = calloc(num_tunnels, sizeof *verifier->tunnel_states)) == NULL) {
+        perror("verifier_create");
+        exit(EXIT_FAILURE);
+    }
+    verifier->num_tunnels = num_tunnels;
+    verifier->num_vehicles = num_vehicles;
+    verifier->tunnel_map = hashmap_create(&vehicle_hash);
+    order_init(&verifier->order, order, num_tunnels);
+    atomic_init(&verifier->done, false);
+    return verifier;
+}
+
+/** @brief  Frees the memory allocated to the given verifier.
+ *
+ *  @param  verifier    The verifier to destroy.
+ *  @return Void.
+ */
+void verifier_destroy(Verifier *verifier) {
+    hashmap_destroy(verifier->tunnel_map);
+    order_destroy(&verifier->order);
+    free(verifier->tunnel_states);
+    free(verifier);
+}
+
+/** @brief  Checks the next event of the log and prints it if it breaks the rules.
+ *
+ *  Successful entries and exits, and vehicles giving up, are always printed. Events must be checked
+ *  in sequence order.
+ *
+ *  @param  verifier    The verifier.
+ *  @param  event       The event to check, which is not used after this returns.
+ *  @return Void.
+ */
+void verifier_check(Verifier *verifier, struct Event *event) {
+    if (event->event_type == ARRIVE) {
+        if (!order_arrive(&verifier->order, event->vehicle, event->shard)) {
+            print_event(event);
+            printf("Error\n");
+        }
+        return;
+    }
+    if (event->event_type == ENTER_TIMEOUT || event->event_type == ENTER_CANCELLED) {
+        print_event(event);
+        verifier->num_gave_up++;
+        if (!order_leave(&verifier->order, event->vehicle)) {
+            printf("Error\n");
+        }
+        return;
+    }
+    if (event->tunnel->id >= verifier->num_tunnels) {
+        print_event(event);
+        printf("Error\n");
+        return;
+    }
+    struct TunnelState *tunnel_state = &verifier->tunnel_states[event->tunnel->id];
+    switch (event->event_type) {
+        case ENTER_ATTEMPT: {
+            const char *message = order_enter(&verifier->order, event->vehicle);
+            if (message != NULL) {
+                print_event(event);
+                printf("%s\n", message);
+            }
+            break;
+        }
+        case ENTER_SUCCESS:
+            print_event(event);
+            check_entry(verifier, tunnel_state, event);
+            break;
+        case ENTER_SUMMARY: {
+            print_event(event);
+            const char *message = order_enter(&verifier->order, event->vehicle);
+            if (message != NULL) {
+                printf("%s\n", message);
+            }
+            check_entry(verifier, tunnel_state, event);
+            break;
+        }
+        case ENTER_FAILED:
+            if (should_enter(tunnel_state, event->vehicle)) {
+                print_event(event);
+                printf("Vehicle should have entered tunnel.\n");
+            }
+            break;
+        case LEAVE_START:
+            break;
+        case LEAVE_END:
+            print_event(event);
+            verifier->num_leave++;
+            if (hashmap_remove(verifier->tunnel_map, event->vehicle) == NULL) {
+                printf("Vehicle was not in a tunnel.\n");
+            }
+            remove_from_tunnel(tunnel_state);
+            break;
+        case END_TEST:
+            break;
+        default:
+            printf("Error\n");
+    }
+}
+
+/** @brief  Prints whether every vehicle entered and left a tunnel in the events checked so far.
+ *
+ *  @param  verifier    The verifier.
+ *  @return Void.
+ */
+void verifier_report(Verifier *verifier) {
+    print_report(verifier->num_enter, verifier->num_leave, verifier->num_gave_up, verifier->num_vehicles);
+}
+
+/** @brief  Checks events as they become available until told to stop, then drains the log. */
+static void *verifier_run(void *arg) {
+    Verifier *verifier = arg;
+    const struct timespec poll_interval = { .tv_nsec = VERIFIER_POLL_NS };
+    for (;;) {
+        // Read before draining, so that every event added before the stop is still checked
+        bool done = atomic_load(&verifier->done);
+        struct Event *event;
+        while ((event = log_get_head(verifier->log)) != NULL) {
+            verifier_check(verifier, event);
+        }
+        if (done) {
+            return NULL;
+        }
+        nanosleep(&poll_interval, NULL);
+    }
+}
+
+/** @brief  Starts checking the given log on a thread of its own while it is being written.
+ *
+ *  Each event is checked and released shortly after it has been added, so with a log from
+ *  `log_create_bounded` the memory used stays the same however long the simulation runs. The log
+ *  must be read only by the verifier until `verifier_join` returns.
+ *
+ *  @param  verifier    The verifier.
+ *  @param  log         The log to follow, which must be kept in memory.
+ *  @return Void.
+ */
+void verifier_start(Verifier *verifier, Log *log) {
+    verifier->log = log;
+    if (pthread_create(&verifier->thread_id, NULL, verifier_run, verifier) != 0) {
+        perror("verifier_start");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/** @brief  Waits for the verifier thread to check the rest of the log and prints the report.
+ *
+ *  Must only be called once nothing adds to the log any more.
+ *
+ *  @param  verifier    The verifier, started with `verifier_start`.
+ *  @return Void.
+ */
+void verifier_join(Verifier *verifier) {
+    atomic_store(&verifier->done, true);
+    pthread_join(verifier->thread_id, NULL);
+    verifier_report(verifier);
+}
+
+/** @brief  Checks a finished log from start to end and prints the report.
+ *
+ *  @param  log             The log to check.
+ *  @param  num_tunnels     The number of tunnels of the simulation.
+ *  @param  num_vehicles    The number of vehicles that should enter and leave a tunnel or give up.
+ *  @param  order           The order vehicles must be admitted in.
+ *  @return Void.
+ */
+void verify_log(Log *log, int num_tunnels, int num_vehicles, const struct AdmissionOrder *order) {
+    Verifier *verifier = verifier_create(num_tunnels, num_vehicles, order);
+    struct Event *event;
+    while ((event = log_get_head(log)) != NULL) {
+        verifier_check(verifier, event);
+    }
+    verifier_report(verifier);
+    verifier_destroy(verifier);
+}
+
+/* Positions in the loaded log of the events of one range that one thread checks, in sequence order. */
+struct Partition {
+    int *events;
+    int count;
+    int capacity;
+};
+
+/* What the parallel checks found at one event of the log. `entered` is set by the tunnel checks
+ * when a vehicle entered a tunnel that had room for it, for the vehicle checks to pick up.
+ * `admission` is what the priority checks found, kept apart from `message` since both check a
+ * summarised entry. */
+struct Finding {
+    bool print_event;
+    bool entered;
+    const char *admission;
+    const char *message;
+};
+
+/* One range of the log, as read by one thread: its events sorted by the threads that check them,
+ * one partition per thread for the tunnels and for the vehicles, and the counts found on the way. */
+struct LogPart {
+    pthread_t thread_id;
+    struct ParallelLog *log;
+    unsigned long first;
+    unsigned long last;
+    LogRange *range;
+    struct Partition *tunnel_partitions;
+    struct Partition *vehicle_partitions;
+    struct Partition admissions;
+    int num_enter;
+    int num_leave;
+    int num_gave_up;
+};
+
+struct ParallelLog {
+    Log *log;
+    struct Event *events;
+    struct Finding *findings;
+    unsigned long num_events;
+    struct TunnelState *tunnel_states;
+    int num_threads;
+    struct LogPart *parts;
+    const struct AdmissionOrder *order;
+    int num_tunnels;
+};
+
+/* A check run on one share of the tunnels or vehicles, numbered `share`, or on the admissions. */
+struct CheckThread {
+    pthread_t thread_id;
+    void *(*check)(void *);
+    struct ParallelLog *log;
+    int share;
+};
+
+static void partition_add(struct Partition *partition, int event) {
+    if (partition->count == partition->capacity) {
+        int capacity = partition->capacity ? 2 * partition->capacity : 1024;
+        int *events = realloc(partition->events, capacity * sizeof *events);
+        if (events == NULL) {
+            perror("verify_log_parallel");
+            exit(EXIT_FAILURE);
+        }
+        partition->events = events;
+        partition->capacity = capacity;
+    }
+    partition->events[partition->count++] = event;
+}
+
+/** @brief  Reads one range of the log and hands each of its events to the threads that have to
+ *          check it.
+ *
+ *  Checks that need no state, and the enter and leave counts, are done on the way.
+ */
+static void *load_part(void *arg) {
+    struct LogPart *part = arg;
+    struct ParallelLog *parallel = part->log;
+    int num_threads = parallel->num_threads;
+    part->range = log_read_range(parallel->log, part->first, part->last, &parallel->events[part->first]);
+    for (unsigned long i = part->first; i < part->last; i++) {
+        struct Event *event = &parallel->events[i];
+        if (event->event_type == ARRIVE) {
+            partition_add(&part->admissions, i);
+            continue;
+        }
+        if (event->event_type == ENTER_TIMEOUT || event->event_type == ENTER_CANCELLED) {
+            part->num_gave_up++;
+            parallel->findings[i].print_event = true;
+            partition_add(&part->admissions, i);
+            continue;
+        }
+        if (event->tunnel->id >= parallel->num_tunnels) {
+            parallel->findings[i] = (struct Finding){ .print_event = true, .message = "Error" };
+            continue;
+        }
+        struct Partition *tunnel_partition = &part->tunnel_partitions[event->tunnel->id % num_threads];
+        struct Partition *vehicle_partition = &part->vehicle_partitions[event->vehicle->id % num_threads];
+        switch (event->event_type) {
+            case ENTER_ATTEMPT:
+                partition_add(&part->admissions, i);
+                break;
+            case ENTER_SUCCESS:
+                part->num_enter++;
+                partition_add(tunnel_partition, i);
+                partition_add(vehicle_partition, i);
+                break;
+            case ENTER_SUMMARY:
+                part->num_enter++;
+                partition_add(&part->admissions, i);
+                partition_add(tunnel_partition, i);
+                partition_add(vehicle_partition, i);
+                break;
+            case ENTER_FAILED:
+                partition_add(tunnel_partition, i);
+                break;
+            case LEAVE_START:
+                break;
+            case LEAVE_END:
+                part->num_leave++;
+                partition_add(tunnel_partition, i);
+                partition_add(vehicle_partition, i);
+                break;
+            case END_TEST:
+                break;
+            default:
+                parallel->findings[i].message = "Error";
+        }
+    }
+    return NULL;
+}
+
+/** @brief  Follows the occupancy of a share of the tunnels through their events. */
+static void *check_tunnels(void *arg) {
+    struct CheckThread *thread = arg;
+    struct ParallelLog *parallel = thread->log;
+    for (int r = 0; r < parallel->num_threads; r++) {
+        const struct Partition *partition = &parallel->parts[r].tunnel_partitions[thread->share];
+        for (int j = 0; j < partition->count; j++) {
+            int i = partition->events[j];
+            struct Event *event = &parallel->events[i];
+            struct TunnelState *tunnel_state = &parallel->tunnel_states[event->tunnel->id];
+            switch (event->event_type) {
+                case ENTER_SUCCESS:
+                case ENTER_SUMMARY:
+                    if (should_enter(tunnel_state, event->vehicle)) {
+                        put_in_tunnel(tunnel_state, event->vehicle);
+                        parallel->findings[i].entered = true;
+                    }
+                    break;
+                case ENTER_FAILED:
+                    if (should_enter(tunnel_state, event->vehicle)) {
+                        parallel->findings[i].print_event = true;
+                        parallel->findings[i].message = "Vehicle should have entered tunnel.";
+                    }
+                    break;
+                default:
+                    remove_from_tunnel(tunnel_state);
+            }
+        }
+    }
+    return NULL;
+}
+
+/** @brief  Checks that vehicles tried to enter in the order of the admission policy, following
+ *          which vehicles wait from their arrivals and their giving up. */
+static void *check_priorities(void *arg) {
+    struct CheckThread *thread = arg;
+    struct ParallelLog *parallel = thread->log;
+    struct PriorityOrder order;
+    order_init(&order, parallel->order, parallel->num_tunnels);
+    for (int r = 0; r < parallel->num_threads; r++) {
+        const struct Partition *partition = &parallel->parts[r].admissions;
+        for (int j = 0; j < partition->count; j++) {
+            int i = partition->events[j];
+            struct Event *event = &parallel->events[i];
+            const char *message;
+            if (event->event_type == ARRIVE) {
+                message = order_arrive(&order, event->vehicle, event->shard) ? NULL : "Error";
+            } else if (event->event_type == ENTER_TIMEOUT || event->event_type == ENTER_CANCELLED) {
+                message = order_leave(&order, event->vehicle) ? NULL : "Error";
+            } else {
+                message = order_enter(&order, event->vehicle);
+            }
+            if (message != NULL) {
+                parallel->findings[i].print_event = true;
+                parallel->findings[i].admission = message;
+            }
+        }
+    }
+    order_destroy(&order);
+    return NULL;
+}
+
+/** @brief  Follows which tunnel a share of the vehicles are in, once the tunnels are checked. */
+static void *check_vehicles(void *arg) {
+    struct CheckThread *thread = arg;
+    struct ParallelLog *parallel = thread->log;
+    HashMap *tunnel_map = hashmap_create(&vehicle_hash);
+    for (int r = 0; r < parallel->num_threads; r++) {
+        const struct Partition *partition = &parallel->parts[r].vehicle_partitions[thread->share];
+        for (int j = 0; j < partition->count; j++) {
+            int i = partition->events[j];
+            struct Event *event = &parallel->events[i];
+            struct Finding *finding = &parallel->findings[i];
+            finding->print_event = true;
+            if (event->event_type == ENTER_SUCCESS || event->event_type == ENTER_SUMMARY) {
+                if (finding->entered) {
+                    hashmap_put(tunnel_map, event->vehicle, event->tunnel);
+                } else if (hashmap_get(tunnel_map, event->vehicle) != NULL) {
+                    finding->message = "Vehicle is already in a tunnel.";
+                } else {
+                    finding->message = "Vehicle should not have entered tunnel.";
+                }
+            } else if (hashmap_remove(tunnel_map, event->vehicle) == NULL) {
+                finding->message = "Vehicle was not in a tunnel.";
+            }
+        }
+    }
+    hashmap_destroy(tunnel_map);
+    return NULL;
+}
+
+/** @brief  Starts each of the given threads on its check and waits for all of them. */
+static void run_checks(struct CheckThread *threads, int num_threads) {
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t].thread_id, NULL, threads[t].check, &threads[t]) != 0) {
+            perror("verify_log_parallel: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t].thread_id, NULL);
+    }
+}
+
+/** @brief  Checks a finished log on several threads and prints the report.
+ *
+ *  Prints exactly what `verify_log` prints for the same log, but holds the whole log in memory.
+ *  The log is read in as many ranges as there are threads, one range per thread.
+ *
+ *  @param  log             The log to check, which must not have been read with `log_get_head`.
+ *  @param  num_tunnels     The number of tunnels of the simulation.
+ *  @param  num_vehicles    The number of vehicles that should enter and leave a tunnel or give up.
+ *  @param  order           The order vehicles must be admitted in.
+ *  @param  num_threads     The number of threads reading the log, then checking tunnels, and then
+ *                          vehicles.
+ *  @return Void.
+ */
+void verify_log_parallel(Log *log, int num_tunnels, int num_vehicles, const struct AdmissionOrder *order,
+                         int num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    unsigned long num_events = log_length(log);
+    struct ParallelLog parallel = {
+        .log = log,
+        .num_events = num_events,
+        .num_threads = num_threads,
+        .order = order,
+        .num_tunnels = num_tunnels,
+    };
+    parallel.events = malloc((num_events > 0 ? num_events : 1) * sizeof *parallel.events);
+    parallel.findings = calloc(num_events > 0 ? num_events : 1, sizeof *parallel.findings);
+    parallel.tunnel_states = calloc(num_tunnels, sizeof *parallel.tunnel_states);
+    parallel.parts = calloc(num_threads, sizeof *parallel.parts);
+    struct CheckThread *threads = calloc(num_threads + 1, sizeof *threads);
+    if (parallel.events == NULL || parallel.findings == NULL || parallel.tunnel_states == NULL
+            || parallel.parts == NULL || threads == NULL) {
+        perror("verify_log_parallel");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each thread reads and sorts its own range of the log
+    for (int r = 0; r < num_threads; r++) {
+        struct LogPart *part = &parallel.parts[r];
+        part->log = &parallel;
+        part->first = num_events * r / num_threads;
+        part->last = num_events * (r + 1) / num_threads;
+        part->tunnel_partitions = calloc(num_threads, sizeof *part->tunnel_partitions);
+        part->vehicle_partitions = calloc(num_threads, sizeof *part->vehicle_partitions);
+        if (part->tunnel_partitions == NULL || part->vehicle_partitions == NULL) {
+            perror("verify_log_parallel");
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&part->thread_id, NULL, load_part, part) != 0) {
+            perror("verify_log_parallel: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int num_enter = 0, num_leave = 0, num_gave_up = 0;
+    for (int r = 0; r < num_threads; r++) {
+        pthread_join(parallel.parts[r].thread_id, NULL);
+        num_enter += parallel.parts[r].num_enter;
+        num_leave += parallel.parts[r].num_leave;
+        num_gave_up += parallel.parts[r].num_gave_up;
+    }
+
+    // The tunnels and the priority order first, then the vehicles, which need the tunnel results
+    for (int t = 0; t < num_threads; t++) {
+        threads[t] = (struct CheckThread){ .check = check_tunnels, .log = &parallel, .share = t };
+    }
+    threads[num_threads] = (struct CheckThread){ .check = check_priorities, .log = &parallel };
+    run_checks(threads, num_threads + 1);
+    for (int t = 0; t < num_threads; t++) {
+        threads[t].check = check_vehicles;
+    }
+    run_checks(threads, num_threads);
+
+    for (unsigned long i = 0; i < num_events; i++) {
+        if (parallel.findings[i].print_event) {
+            print_event(&parallel.events[i]);
+        }
+        if (parallel.findings[i].admission != NULL) {
+            printf("%s\n", parallel.findings[i].admission);
+        }
+        if (parallel.findings[i].message != NULL) {
+            printf("%s\n", parallel.findings[i].message);
+        }
+    }
+    print_report(num_enter, num_leave, num_gave_up, num_vehicles);
+
+    for (int r = 0; r < num_threads; r++) {
+        struct LogPart *part = &parallel.parts[r];
+        for (int t = 0; t < num_threads; t++) {
+            free(part->tunnel_partitions[t].events);
+            free(part->vehicle_partitions[t].events);
+        }
+        free(part->tunnel_partitions);
+        free(part->vehicle_partitions);
+        free(part->admissions.events);
+        log_range_destroy(part->range);
+    }
+    free(parallel.parts);
+    free(parallel.tunnel_states);
+    free(parallel.events);
+    free(parallel.findings);
+    free(threads);
+}
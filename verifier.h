@@ -0,0 +1,29 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "logger.h"
+
+typedef struct Verifier Verifier;
+
+/* The order vehicles must be admitted in: strict priority if `shares` is NULL, otherwise
+ * weighted-fair with the given share of each priority, see `scheduler_set_policy`. It is checked
+ * among the vehicles of each scheduler shard, as logged with their arrivals. */
+struct AdmissionOrder {
+    int num_priorities;
+    const int *shares;
+};
+
+Verifier       *verifier_create(int num_tunnels, int num_vehicles, const struct AdmissionOrder *order);
+void            verifier_destroy(Verifier *verifier);
+
+void            verifier_check(Verifier *verifier, struct Event *event);
+void            verifier_report(Verifier *verifier);
+
+void            verifier_start(Verifier *verifier, Log *log);
+void            verifier_join(Verifier *verifier);
+
+void            verify_log(Log *log, int num_tunnels, int num_vehicles, const struct AdmissionOrder *order);
+void            verify_log_parallel(Log *log, int num_tunnels, int num_vehicles, const struct AdmissionOrder *order,
+                                    int num_threads);
+
+#endif
@@ -0,0 +1,257 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "priority_scheduler.h"
+#include "timer_queue.h"
+#include "vehicle.h"
+#include "worker_pool.h"
+
+/* Drives vehicles through the scheduler as tasks on a fixed set of worker threads. A vehicle is
+ * only on a worker while it calls into the scheduler: admission goes through
+ * `scheduler_admit_async`, and the time spent crossing is a timer rather than a sleeping thread.
+ * Vehicles with a limited patience that have to wait also get a timer to give up at, which cancels
+ * them with `scheduler_cancel_reason` if they are still waiting by then, logging a timeout.
+ *
+ * With the virtual clock the pool is a discrete-event simulation: time does not pass on its own,
+ * and whenever no task is ready and no worker is running one, the clock jumps straight to the end
+ * of the next crossing or arrival. */
+
+enum TaskState {
+    TASK_ADMIT,
+    TASK_EXIT,
+    TASK_GIVE_UP,
+};
+
+struct WorkerPool;
+
+struct VehicleTask {
+    struct Vehicle *vehicle;
+    enum TaskState state;
+    struct WorkerPool *pool;
+    struct VehicleTask *give_up;
+};
+
+struct WorkerPool {
+    PriorityScheduler *scheduler;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    struct VehicleTask **ready;
+    int ready_head;
+    int ready_count;
+    int ready_capacity;
+    TimerQueue *timers;
+    int remaining;
+    long long patience_ns;
+    enum PoolClock clock;
+    long long virtual_now;
+    int busy;
+};
+
+/** @brief  Returns the number of online processors, the default number of workers. */
+int worker_pool_default_workers(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/** @brief  Returns the current time of the pool's clock in nanoseconds, with its lock held. */
+static long long now_ns(struct WorkerPool *pool) {
+    if (pool->clock == POOL_CLOCK_VIRTUAL) {
+        return pool->virtual_now;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/** @brief  Appends a task to the ready queue of the pool, whose lock must be held.
+ *
+ *  The queue has room for every task of the pool, since a vehicle's give-up timer is not cancelled
+ *  when it is admitted and may be ready alongside its exit.
+ */
+static void push_ready(struct WorkerPool *pool, struct VehicleTask *task) {
+    if (pool->ready_count == pool->ready_capacity) {
+        fprintf(stderr, "worker_pool: ready queue overflow\n");
+        abort();
+    }
+    pool->ready[(pool->ready_head + pool->ready_count++) % pool->ready_capacity] = task;
+}
+
+/** @brief  Starts the crossing of an admitted vehicle, with the pool's lock held. */
+static void start_crossing(struct WorkerPool *pool, struct VehicleTask *task) {
+    task->state = TASK_EXIT;
+    timer_queue_push(pool->timers, now_ns(pool) + vehicle_crossing_ns(task->vehicle), task);
+    pthread_cond_signal(&pool->cv);
+}
+
+/** @brief  Admission callback for vehicles that had to wait. Vehicles that gave up are counted as
+ *          done by their give-up task instead. */
+static void on_admitted(struct Vehicle *vehicle, struct Tunnel *tunnel, void *arg) {
+    (void)vehicle;
+    if (tunnel == NULL) {
+        return;
+    }
+    struct VehicleTask *task = arg;
+    pthread_mutex_lock(&task->pool->lock);
+    start_crossing(task->pool, task);
+    pthread_mutex_unlock(&task->pool->lock);
+}
+
+/** @brief  Counts a vehicle as done, without the pool's lock held. */
+static void finish_vehicle(struct WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->remaining == 0) {
+        pthread_cond_broadcast(&pool->cv);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** @brief  Runs the next step of the given task, without the pool's lock held. */
+static void run_task(struct WorkerPool *pool, struct VehicleTask *task) {
+    switch (task->state) {
+        case TASK_ADMIT: {
+            struct Tunnel *tunnel;
+            enum AdmitStatus status = scheduler_admit_async(pool->scheduler, task->vehicle, on_admitted, task,
+                                                            &tunnel);
+            if (status == ADMIT_ENTERED) {
+                pthread_mutex_lock(&pool->lock);
+                start_crossing(pool, task);
+                pthread_mutex_unlock(&pool->lock);
+            } else if (status == ADMIT_REJECTED) {
+                finish_vehicle(pool);
+            } else if (pool->patience_ns > 0) {
+                // If the vehicle is admitted before this fires, cancelling it does nothing
+                pthread_mutex_lock(&pool->lock);
+                timer_queue_push(pool->timers, now_ns(pool) + pool->patience_ns, task->give_up);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            break;
+        }
+        case TASK_EXIT:
+            scheduler_exit(pool->scheduler, task->vehicle);
+            finish_vehicle(pool);
+            break;
+        case TASK_GIVE_UP:
+            if (scheduler_cancel_reason(pool->scheduler, task->vehicle, ENTER_TIMEOUT)) {
+                finish_vehicle(pool);
+            }
+            break;
+    }
+}
+
+/** @brief  Worker thread: runs ready tasks and fires due arrivals and crossings until every vehicle
+ *          is done. */
+static void *worker_run(void *arg) {
+    struct WorkerPool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->remaining > 0) {
+        long long deadline;
+        int fired = 0;
+        long long now = now_ns(pool);
+        while (timer_queue_peek(pool->timers, &deadline) && deadline <= now) {
+            push_ready(pool, timer_queue_pop(pool->timers));
+            fired++;
+        }
+        if (fired > 1) {
+            pthread_cond_broadcast(&pool->cv);
+        }
+        if (pool->ready_count > 0) {
+            struct VehicleTask *task = pool->ready[pool->ready_head];
+            pool->ready_head = (pool->ready_head + 1) % pool->ready_capacity;
+            pool->ready_count--;
+            pool->busy++;
+            pthread_mutex_unlock(&pool->lock);
+            run_task(pool, task);
+            pthread_mutex_lock(&pool->lock);
+            pool->busy--;
+        } else if (pool->clock == POOL_CLOCK_VIRTUAL) {
+            // Nothing can happen before the next timer fires unless a running task makes it
+            if (pool->busy == 0 && timer_queue_peek(pool->timers, &deadline)) {
+                pool->virtual_now = deadline;
+            } else {
+                pthread_cond_wait(&pool->cv, &pool->lock);
+            }
+        } else if (timer_queue_peek(pool->timers, &deadline)) {
+            struct timespec until = { deadline / 1000000000LL, deadline % 1000000000LL };
+            pthread_cond_timedwait(&pool->cv, &pool->lock, &until);
+        } else {
+            pthread_cond_wait(&pool->cv, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/** @brief  Admits, crosses and exits every given vehicle using a fixed number of worker threads.
+ *
+ *  Vehicles are submitted for admission in array order, or at their arrival times if given.
+ *  Returns once every vehicle has exited or given up. With the real clock arrivals and crossings take their
+ *  actual time; with the virtual clock they happen as soon as nothing else is left to do before
+ *  them.
+ *
+ *  @param  scheduler       The scheduler to admit the vehicles through.
+ *  @param  vehicles        The vehicles.
+ *  @param  num_vehicles    The number of vehicles.
+ *  @param  arrivals        When each vehicle arrives, in nanoseconds from the start of the run, or
+ *                          NULL for all of them at the start.
+ *  @param  num_workers     The number of worker threads.
+ *  @param  patience_ns     How long a vehicle waits to be admitted before giving up, in
+ *                          nanoseconds of the pool's clock, or 0 to wait as long as it takes.
+ *  @param  clock           The clock crossings are timed with.
+ *  @return Void.
+ */
+void worker_pool_run(PriorityScheduler *scheduler, struct Vehicle **vehicles, int num_vehicles,
+                     const long long *arrivals, int num_workers, long long patience_ns, enum PoolClock clock) {
+    struct WorkerPool pool = {
+        .scheduler = scheduler,
+        .ready_capacity = num_vehicles > 0 ? 2 * num_vehicles : 1,
+        .remaining = num_vehicles,
+        .patience_ns = patience_ns,
+        .timers = timer_queue_create(),
+        .clock = clock,
+    };
+    struct VehicleTask *tasks = malloc(pool.ready_capacity * sizeof *tasks);
+    pool.ready = malloc(pool.ready_capacity * sizeof *pool.ready);
+    pthread_t *workers = malloc(num_workers * sizeof *workers);
+    if (tasks == NULL || pool.ready == NULL || workers == NULL) {
+        perror("worker_pool_run");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool.cv, &attr);
+    pthread_condattr_destroy(&attr);
+
+    long long start = now_ns(&pool);
+    for (int i = 0; i < num_vehicles; i++) {
+        struct VehicleTask *give_up = &tasks[num_vehicles + i];
+        *give_up = (struct VehicleTask){ .vehicle = vehicles[i], .state = TASK_GIVE_UP, .pool = &pool };
+        tasks[i] = (struct VehicleTask){ .vehicle = vehicles[i], .state = TASK_ADMIT, .pool = &pool,
+                                         .give_up = give_up };
+        if (arrivals != NULL) {
+            timer_queue_push(pool.timers, start + arrivals[i], &tasks[i]);
+        } else {
+            push_ready(&pool, &tasks[i]);
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_run, &pool) != 0) {
+            perror("worker_pool_run: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool.cv);
+    pthread_mutex_destroy(&pool.lock);
+    timer_queue_destroy(pool.timers);
+    free(workers);
+    free(pool.ready);
+    free(tasks);
+}
@@ -0,0 +1,17 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "priority_scheduler.h"
+#include "vehicle.h"
+
+enum PoolClock {
+    POOL_CLOCK_REAL,
+    POOL_CLOCK_VIRTUAL,
+};
+
+int             worker_pool_default_workers(void);
+void            worker_pool_run(PriorityScheduler *scheduler, struct Vehicle **vehicles, int num_vehicles,
+                                const long long *arrivals, int num_workers, long long patience_ns,
+                                enum PoolClock clock);
+
+#endif